@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+static size_t arena_round(size_t size) {
+  return (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+void arena_init(struct arena *arena) {
+  arena->base = arena->inline_block;
+  arena->size = sizeof(arena->inline_block);
+  arena->used = arena->last = 0;
+  arena->blocks = NULL;
+}
+
+/* Returns SIZE bytes from ARENA, or NULL if memory runs out. Blocks at least
+ * double in size, so a body grown one append at a time is copied a
+ * logarithmic number of times. */
+void *arena_alloc(struct arena *arena, size_t size) {
+  size = arena_round(size);
+  if (size > arena->size - arena->used) {
+    size_t block_size = arena->size * 2;
+    if (block_size < size) block_size = size;
+    if (block_size > SIZE_MAX - sizeof(struct arena_block)) return NULL;
+
+    struct arena_block *block = malloc(sizeof(struct arena_block) + block_size);
+    if (block == NULL) return NULL;
+    block->size = block_size;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->base = block->data;
+    arena->size = block_size;
+    arena->used = 0;
+  }
+  arena->last = arena->used;
+  arena->used += size;
+  return arena->base + arena->last;
+}
+
+/*
+ * Resizes PTR, an allocation of OLD_SIZE bytes from ARENA (or NULL), to
+ * NEW_SIZE bytes. The latest allocation grows in place while its block has
+ * room; any other one is copied. Returns NULL if memory runs out, leaving PTR
+ * as it was.
+ */
+void *arena_grow(struct arena *arena, void *ptr, size_t old_size, size_t new_size) {
+  if (ptr != NULL && ptr == arena->base + arena->last
+      && arena_round(new_size) <= arena->size - arena->last) {
+    arena->used = arena->last + arena_round(new_size);
+    return ptr;
+  }
+  void *grown = arena_alloc(arena, new_size);
+  if (grown != NULL && ptr != NULL) memcpy(grown, ptr, old_size);
+  return grown;
+}
+
+/* Frees everything allocated from ARENA, keeping its largest heap block if it
+ * is small enough to be worth holding on to. */
+void arena_reset(struct arena *arena) {
+  struct arena_block *keep = NULL;
+  while (arena->blocks != NULL) {
+    struct arena_block *block = arena->blocks;
+    arena->blocks = block->next;
+    if (block->size <= ARENA_RETAIN_MAX && (keep == NULL || block->size > keep->size)) {
+      free(keep);
+      keep = block;
+    } else {
+      free(block);
+    }
+  }
+
+  arena_init(arena);
+  if (keep != NULL) {
+    keep->next = NULL;
+    arena->blocks = keep;
+    arena->base = keep->data;
+    arena->size = keep->size;
+  }
+}
+
+void arena_free(struct arena *arena) {
+  while (arena->blocks != NULL) {
+    struct arena_block *block = arena->blocks;
+    arena->blocks = block->next;
+    free(block);
+  }
+  arena_init(arena);
+}
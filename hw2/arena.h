@@ -0,0 +1,41 @@
+#ifndef __ARENA__
+#define __ARENA__
+
+#include <stddef.h>
+
+/* ARENA is a bump allocator for memory that lives as long as one request.
+ * Allocations are carved out of a block in order and never freed one by one;
+ * arena_reset hands all of them back at once when the request is done.
+ *
+ * Each arena starts with a small block of its own, so a connection needs no
+ * heap memory until a request outgrows it. A request that does spills into
+ * heap blocks, and the largest of those (up to ARENA_RETAIN_MAX) is kept
+ * across resets, so a connection whose requests all need the same amount of
+ * memory stops calling malloc after its first request. */
+
+#define ARENA_INLINE_SIZE 4096
+#define ARENA_RETAIN_MAX (256 << 10)
+#define ARENA_ALIGN 16
+
+struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct arena {
+  char *base;                   // Block being allocated from.
+  size_t size;
+  size_t used;
+  size_t last;                  // Offset of the latest allocation, for arena_grow.
+  struct arena_block *blocks;   // Heap blocks, newest first.
+  char inline_block[ARENA_INLINE_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+void arena_init(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_grow(struct arena *arena, void *ptr, size_t old_size, size_t new_size);
+void arena_reset(struct arena *arena);
+void arena_free(struct arena *arena);
+
+#endif
@@ -0,0 +1,110 @@
+#!/bin/bash
+# Serves one file of each size in SIZES and measures throughput and the
+# read/write syscalls httpserver makes per request (the syscr and syscw
+# counters of /proc/<pid>/io; sendfile bumps each once). Runs the
+# current tree and, for comparison, the baseline commit's 1 KB read/write
+# loop, rebuilt from git. Settings can be overridden from the environment,
+# e.g.
+#   make bench-sizes SIZES="4K 1M" DURATION=10
+#   make bench-sizes BASELINE=    # skip the baseline
+
+PORT=${PORT:-8200}
+DURATION=${DURATION:-5}
+SIZES=${SIZES:-"4K 1M 1G"}
+CONNECTIONS=${CONNECTIONS:-1}
+REQUESTS=${REQUESTS:-5}
+BASELINE=${BASELINE-$(git rev-list --max-parents=0 HEAD)}
+WORK=${WORK:-${TMPDIR:-/tmp}/httpserver-bench-sizes}
+
+cd "$(dirname "$0")"
+server_pid=
+
+stop_server() {
+  if [ -n "$server_pid" ]; then
+    kill "$server_pid" 2>/dev/null
+    wait "$server_pid" 2>/dev/null
+  fi
+  server_pid=
+}
+trap stop_server EXIT
+
+# fetch PORT PATH: requests PATH over HTTP/1.0 and reads the whole response.
+fetch() {
+  exec 3<> "/dev/tcp/127.0.0.1/$1" || return 1
+  printf "GET %s HTTP/1.0\r\n\r\n" "$2" >&3
+  cat <&3 > /dev/null 2>&1
+  exec 3<&-
+}
+
+# start_server BINARY PORT ARGS...: starts a server and waits until it accepts.
+start_server() {
+  local binary=$1 port=$2
+  shift 2
+  "$binary" --port "$port" "$@" > /dev/null 2>&1 &
+  server_pid=$!
+  # The baseline crashes on a connection that sends nothing, so probe with
+  # a request.
+  for _ in $(seq 50); do
+    if fetch "$port" / 2> /dev/null; then
+      return 0
+    fi
+    sleep 0.1
+  done
+  echo "$binary did not start on port $port" >&2
+  exit 1
+}
+
+# syscalls PID: prints the read and write syscalls PID has made so far.
+syscalls() {
+  awk '/^syscr|^syscw/ { n += $2 } END { print n }' "/proc/$1/io"
+}
+
+# sweep TITLE BINARY: benchmarks every size against BINARY. Syscalls are
+# counted over REQUESTS complete requests, apart from the throughput run,
+# because the baseline dies of SIGPIPE when httpbench hangs up at its end.
+sweep() {
+  local title=$1 binary=$2
+  echo "== $title"
+  printf "%6s %12s %12s %16s\n" size "req/s" "MB/s" "syscalls/req"
+  for size in $SIZES; do
+    start_server "$binary" "$PORT" --files "$WORK/files"
+    local before after
+    before=$(syscalls "$server_pid")
+    for _ in $(seq "$REQUESTS"); do
+      fetch "$PORT" "/$size"
+    done
+    after=$(syscalls "$server_pid")
+
+    local output
+    output=$(./httpbench --port "$PORT" --threads 1 --connections "$CONNECTIONS" \
+      --duration "$DURATION" --no-keep-alive --path "/$size")
+    stop_server
+    PORT=$((PORT + 1))
+
+    echo "$output" | awk -v size="$size" -v per_request="$(((after - before) / REQUESTS))" '
+      /Requests:/ { rate = $5 }
+      /Transfer:/ { mbps = $4 }
+      END { printf "%6s %12s %12s %16s\n", size, rate, mbps, per_request }'
+  done
+  echo
+}
+
+mkdir -p "$WORK/files"
+for size in $SIZES; do
+  if [ ! -f "$WORK/files/$size" ]; then
+    head -c "$size" /dev/urandom > "$WORK/files/$size" || exit 1
+  fi
+done
+
+if [ -n "$BASELINE" ]; then
+  rm -rf "$WORK/baseline"
+  mkdir -p "$WORK/baseline"
+  prefix=$(git rev-parse --show-prefix)
+  git -C "$(git rev-parse --show-toplevel)" archive "$BASELINE:${prefix%/}" \
+    | tar -x -C "$WORK/baseline" || exit 1
+  make -s -C "$WORK/baseline" > /dev/null 2>&1 || { echo "Failed to build $BASELINE" >&2; exit 1; }
+  sweep "baseline $(git rev-parse --short "$BASELINE"), 1 KB read/write loop" \
+    "$WORK/baseline/httpserver"
+fi
+
+sweep "this tree, sendfile" ./httpserver
@@ -0,0 +1,77 @@
+#!/bin/bash
+# Runs httpbench against httpserver serving FILES (files/ by default) from a
+# thread pool of each size in THREADS and from the event loop, then through a
+# proxy in front of it. Settings can be overridden from the environment, e.g.
+#   make bench THREADS="2 8" DURATION=30
+# and a directory of large files measures the sendfile path:
+#   make bench FILES=/tmp/big
+# and the event loop backend is picked at build time:
+#   make bench BACKEND=io_uring
+
+PORT=${PORT:-8100}
+DURATION=${DURATION:-5}
+WARMUP=${WARMUP:-1}
+THREADS=${THREADS:-"1 4 16"}
+CONNECTIONS=${CONNECTIONS:-32}
+BENCH_THREADS=${BENCH_THREADS:-2}
+BACKEND=${BACKEND:-epoll}
+FILES=${FILES:-files}
+
+cd "$(dirname "$0")"
+server_pids=()
+
+stop_servers() {
+  for pid in "${server_pids[@]}"; do
+    kill "$pid" 2>/dev/null
+    wait "$pid" 2>/dev/null
+  done
+  server_pids=()
+}
+trap stop_servers EXIT
+
+# start_server PORT ARGS...: starts httpserver and waits until it accepts.
+start_server() {
+  local port=$1
+  shift
+  ./httpserver --port "$port" --keep-alive-max 1000000 "$@" > /dev/null 2>&1 &
+  server_pids+=($!)
+  for _ in $(seq 50); do
+    if (exec 3<> "/dev/tcp/127.0.0.1/$port") 2> /dev/null; then
+      return 0
+    fi
+    sleep 0.1
+  done
+  echo "httpserver $* did not start on port $port" >&2
+  exit 1
+}
+
+# bench TITLE CONNECTIONS ARGS...: runs httpbench over the FILES tree.
+bench() {
+  local title=$1 connections=$2
+  shift 2
+  echo "== $title"
+  ./httpbench --port "$PORT" --threads "$BENCH_THREADS" --connections "$connections" \
+    --duration "$DURATION" --warmup "$WARMUP" --files "$FILES" "$@"
+  echo
+}
+
+# A pooled worker serves one keep-alive connection until it closes, so
+# keep-alive runs against a pool use one connection per worker.
+for threads in $THREADS; do
+  start_server "$PORT" --files "$FILES" --num-threads "$threads"
+  bench "$FILES, $threads threads, keep-alive" "$threads"
+  bench "$FILES, $threads threads, connection per request" "$CONNECTIONS" --no-keep-alive
+  stop_servers
+done
+
+start_server "$PORT" --files "$FILES" --event-loop
+bench "$FILES, $BACKEND event loop, keep-alive" "$CONNECTIONS"
+bench "$FILES, $BACKEND event loop, connection per request" "$CONNECTIONS" --no-keep-alive
+stop_servers
+
+threads=${THREADS##* }
+start_server $((PORT + 1)) --files "$FILES" --event-loop
+start_server "$PORT" --proxy "127.0.0.1:$((PORT + 1))" --num-threads "$threads"
+bench "proxy to $BACKEND event loop, $threads threads, keep-alive" "$threads"
+bench "proxy to $BACKEND event loop, $threads threads, connection per request" "$CONNECTIONS" --no-keep-alive
+stop_servers
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "dircache.h"
+#include "utlist.h"
+
+#define DIRCACHE_BUCKETS 1024
+
+/* Changes that alter what a listing shows. */
+#define DIRCACHE_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+    | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct dircache_page {
+  char *headers;
+  size_t headers_length;
+  char *body;
+  size_t body_length;
+} dircache_page_t;
+
+typedef struct dircache_entry {
+  char *key;
+  unsigned long hash;
+  int wd;                       /* Inotify watch on the directory, or -1. */
+
+  int num_pages;
+  dircache_page_t *pages;
+
+  /* One reference is held by the cache, one by every response in flight. */
+  int refcount;
+
+  struct dircache_entry *hash_next;
+  struct dircache_entry *wd_next;
+  struct dircache_entry *prev;  /* LRU list, least recently used first. */
+  struct dircache_entry *next;
+} dircache_entry_t;
+
+static pthread_mutex_t dircache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static dircache_entry_t *buckets[DIRCACHE_BUCKETS];
+static dircache_entry_t *wd_buckets[DIRCACHE_BUCKETS];
+static dircache_entry_t *lru;
+static int num_entries = 0;
+static int max_entries = 0;
+static int inotify_fd = -1;
+
+/* Bumped for every batch of inotify events, so a listing rendered while its
+ * directory changed is not cached. */
+static unsigned long generation = 0;
+
+static unsigned long dircache_hash(char *key) {
+  /* FNV-1a */
+  unsigned long hash = 14695981039346656037UL;
+  for (; *key != '\0'; key++) {
+    hash ^= (unsigned char) *key;
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+static void dircache_release(void *arg) {
+  dircache_entry_t *entry = arg;
+  if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
+  for (int i = 0; i < entry->num_pages; i++) {
+    free(entry->pages[i].headers);
+    free(entry->pages[i].body);
+  }
+  free(entry->pages);
+  free(entry->key);
+  free(entry);
+}
+
+/* Returns 1 if some cached entry uses watch WD. dircache_mutex must be held. */
+static int dircache_watched(int wd) {
+  dircache_entry_t *entry = wd_buckets[wd % DIRCACHE_BUCKETS];
+  while (entry != NULL && entry->wd != wd) entry = entry->wd_next;
+  return entry != NULL;
+}
+
+/* Unlinks ENTRY and drops the cache's reference to it, removing its watch if
+ * no other entry shares it. dircache_mutex must be held. */
+static void dircache_remove(dircache_entry_t *entry) {
+  dircache_entry_t **link = &buckets[entry->hash % DIRCACHE_BUCKETS];
+  while (*link != entry) link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  link = &wd_buckets[entry->wd % DIRCACHE_BUCKETS];
+  while (*link != entry) link = &(*link)->wd_next;
+  *link = entry->wd_next;
+  DL_DELETE(lru, entry);
+  num_entries--;
+
+  if (!dircache_watched(entry->wd)) inotify_rm_watch(inotify_fd, entry->wd);
+  dircache_release(entry);
+}
+
+static dircache_entry_t *dircache_find(char *key, unsigned long hash) {
+  dircache_entry_t *entry = buckets[hash % DIRCACHE_BUCKETS];
+  while (entry != NULL && (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+    entry = entry->hash_next;
+  }
+  return entry;
+}
+
+/* Drops every listing of the directory behind watch WD. dircache_mutex must
+ * be held. */
+static void dircache_invalidate(int wd) {
+  dircache_entry_t *entry = wd_buckets[wd % DIRCACHE_BUCKETS];
+  while (entry != NULL) {
+    dircache_entry_t *next = entry->wd_next;
+    if (entry->wd == wd) dircache_remove(entry);
+    entry = next;
+  }
+}
+
+static void *dircache_watch_thread(void *arg) {
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (1) {
+    ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+    if (length < 0 && errno == EINTR) continue;
+    if (length <= 0) {
+      perror("Failed to read inotify events");
+      return NULL;
+    }
+
+    pthread_mutex_lock(&dircache_mutex);
+    generation++;
+    for (char *p = buffer; p < buffer + length;) {
+      struct inotify_event *event = (struct inotify_event *) p;
+      if (event->mask & IN_Q_OVERFLOW) {
+        // Events were lost, so any listing may be stale
+        while (lru != NULL) dircache_remove(lru);
+      } else {
+        dircache_invalidate(event->wd);
+      }
+      p += sizeof(struct inotify_event) + event->len;
+    }
+    pthread_mutex_unlock(&dircache_mutex);
+  }
+  return NULL;
+}
+
+/*
+ * Fills in RESPONSE with page PAGE (counted from 1) of ENTRY, handing the
+ * caller's reference to the response. A page past the end is a 404.
+ */
+static void dircache_fill_response(dircache_entry_t *entry, int page,
+    struct http_response *response) {
+  if (page < 1 || page > entry->num_pages) {
+    dircache_release(entry);
+    http_response_error(response, 404);
+    return;
+  }
+  dircache_page_t *cached = &entry->pages[page - 1];
+  http_response_init(response, 200, "text/html");
+  response->headers = cached->headers;
+  response->headers_length = cached->headers_length;
+  response->body = cached->body;
+  response->body_length = cached->body_length;
+  response->release = dircache_release;
+  response->release_arg = entry;
+}
+
+static int dircache_filter(const struct dirent *ent) {
+  // Don't list current (.) and parent (..) directory links
+  return strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0;
+}
+
+/* Renders the sorted NAMES into ENTRY's pages. Returns 0, or -1 if memory
+ * runs out. */
+static int dircache_render_pages(dircache_entry_t *entry, struct dirent **names,
+    int num_names) {
+  entry->num_pages = num_names > 0
+      ? (num_names + DIRCACHE_PAGE_ENTRIES - 1) / DIRCACHE_PAGE_ENTRIES : 1;
+  entry->pages = calloc(entry->num_pages, sizeof(dircache_page_t));
+  if (entry->pages == NULL) {
+    entry->num_pages = 0;
+    return -1;
+  }
+
+  for (int page = 0; page < entry->num_pages; page++) {
+    struct http_response body;
+    // Pages outlive the request, so they are built on the heap
+    http_response_init(&body, 200, "text/html");
+    body.arena = NULL;
+
+    int last = (page + 1) * DIRCACHE_PAGE_ENTRIES;
+    for (int i = page * DIRCACHE_PAGE_ENTRIES; i < num_names && i < last; i++) {
+      http_response_append_string(&body, "<a href=\"");
+      http_response_append_string(&body, names[i]->d_name);
+      http_response_append_string(&body, "\">");
+      http_response_append_string(&body, names[i]->d_name);
+      http_response_append_string(&body, "</a><br>");
+    }
+    if (entry->num_pages > 1) {
+      char links[128];
+      int length = 0;
+      if (page > 0) {
+        length += snprintf(links + length, sizeof(links) - length,
+            "<a href=\"?page=%d\">Previous page</a> ", page);
+      }
+      if (page + 1 < entry->num_pages) {
+        length += snprintf(links + length, sizeof(links) - length,
+            "<a href=\"?page=%d\">Next page</a>", page + 2);
+      }
+      http_response_append(&body, links, length);
+      http_response_append_string(&body, "<br>");
+    }
+    http_response_append_string(&body, "<a href=\"../\">Parent directory</a>");
+
+    char headers[256];
+    int headers_length = snprintf(headers, sizeof(headers),
+        "HTTP/1.1 200 %s\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: %zu\r\n",
+        http_get_response_message(200), body.body_length);
+
+    entry->pages[page].headers = strdup(headers);
+    entry->pages[page].headers_length = headers_length;
+    entry->pages[page].body = body.body;
+    entry->pages[page].body_length = body.body_length;
+    if (entry->pages[page].headers == NULL) return -1;
+  }
+  return 0;
+}
+
+/*
+ * Keeps at most MAX listings (0 disables the cache) and starts the thread
+ * that watches the cached directories.
+ */
+void dircache_init(int max) {
+  if (max <= 0) return;
+
+  inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (inotify_fd == -1) {
+    perror("Failed to create inotify instance, not caching listings");
+    return;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, dircache_watch_thread, NULL) != 0) {
+    perror("Failed to create directory watch thread");
+    exit(errno);
+  }
+  pthread_detach(thread);
+  max_entries = max;
+}
+
+/*
+ * Fills in RESPONSE with page PAGE of the listing cached for directory PATH.
+ * Returns 1 on a hit, or 0 if it is not cached.
+ */
+int dircache_lookup(char *path, int page, struct http_response *response) {
+  if (max_entries == 0) return 0;
+
+  unsigned long hash = dircache_hash(path);
+  pthread_mutex_lock(&dircache_mutex);
+  dircache_entry_t *entry = dircache_find(path, hash);
+  if (entry == NULL) {
+    pthread_mutex_unlock(&dircache_mutex);
+    return 0;
+  }
+  __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+  DL_DELETE(lru, entry);
+  DL_APPEND(lru, entry);
+  pthread_mutex_unlock(&dircache_mutex);
+
+  dircache_fill_response(entry, page, response);
+  return 1;
+}
+
+/*
+ * Lists directory PATH into RESPONSE, showing page PAGE, and caches the
+ * listing if the directory can be watched. Returns 0 without touching
+ * RESPONSE if the directory cannot be read.
+ */
+int dircache_render(char *path, int page, struct http_response *response) {
+  dircache_entry_t *entry = calloc(1, sizeof(dircache_entry_t));
+  if (entry == NULL) return 0;
+  entry->wd = -1;
+  entry->refcount = 1;
+
+  /* The watch goes on before the directory is read, so any change made after
+   * the read shows up as an event. */
+  unsigned long start = 0;
+  if (max_entries > 0) {
+    pthread_mutex_lock(&dircache_mutex);
+    start = generation;
+    pthread_mutex_unlock(&dircache_mutex);
+    entry->wd = inotify_add_watch(inotify_fd, path, DIRCACHE_WATCH_MASK);
+  }
+
+  struct dirent **names;
+  int num_names = scandir(path, &names, dircache_filter, alphasort);
+  int rendered = num_names >= 0 && dircache_render_pages(entry, names, num_names) == 0;
+  for (int i = 0; i < num_names; i++) free(names[i]);
+  if (num_names >= 0) free(names);
+
+  pthread_mutex_lock(&dircache_mutex);
+  if (rendered && entry->wd != -1 && generation == start
+      && (entry->key = strdup(path)) != NULL) {
+    entry->hash = dircache_hash(path);
+    entry->refcount = 2;
+
+    /* The new entry goes in first, so a replaced one sharing its watch does
+     * not remove it. */
+    dircache_entry_t *existing = dircache_find(path, entry->hash);
+    entry->hash_next = buckets[entry->hash % DIRCACHE_BUCKETS];
+    buckets[entry->hash % DIRCACHE_BUCKETS] = entry;
+    entry->wd_next = wd_buckets[entry->wd % DIRCACHE_BUCKETS];
+    wd_buckets[entry->wd % DIRCACHE_BUCKETS] = entry;
+    DL_APPEND(lru, entry);
+    num_entries++;
+
+    if (existing != NULL) dircache_remove(existing);
+    while (num_entries > max_entries) dircache_remove(lru);
+  } else if (entry->wd != -1 && !dircache_watched(entry->wd)) {
+    inotify_rm_watch(inotify_fd, entry->wd);
+  }
+  pthread_mutex_unlock(&dircache_mutex);
+
+  if (!rendered) {
+    dircache_release(entry);
+    return 0;
+  }
+  dircache_fill_response(entry, page, response);
+  return 1;
+}
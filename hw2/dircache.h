@@ -0,0 +1,23 @@
+#ifndef __DIRCACHE__
+#define __DIRCACHE__
+
+#include "libhttp.h"
+
+/* DIRCACHE renders the listing of a directory without an index.html once and
+ * keeps it in memory, with its preformatted headers, so later requests are
+ * answered without reading the directory again. Names are sorted, and a
+ * directory with more than DIRCACHE_PAGE_ENTRIES names is split into pages,
+ * picked with ?page=N.
+ *
+ * Every cached directory is watched with inotify. A background thread drops
+ * a listing as soon as a name is created, deleted or moved in its directory,
+ * or the directory itself goes away. At most a fixed number of listings are
+ * kept, least recently used first out. */
+
+#define DIRCACHE_PAGE_ENTRIES 10000
+
+void dircache_init(int max_entries);
+int dircache_lookup(char *path, int page, struct http_response *response);
+int dircache_render(char *path, int page, struct http_response *response);
+
+#endif
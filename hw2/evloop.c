@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "evloop.h"
+#include "metrics.h"
+#include "utlist.h"
+
+#define EVLOOP_MAX_EVENTS 256
+#define EVLOOP_FILE_BUFFER_SIZE 16384
+
+/* Each connection moves through these states in order. A state only hands
+ * over to the next one once its work is finished, so a connection that
+ * would block simply stays put until epoll reports it ready again. */
+enum conn_state {
+  CONN_READ_REQUEST,
+  CONN_SEND_HEADERS,       /* Headers and in-memory body, in one sendmsg. */
+  CONN_SEND_FILE,
+  CONN_DONE,
+};
+
+typedef struct conn conn_t;
+
+typedef struct evloop {
+  int epoll_fd;
+  int server_socket;
+  evloop_handler handler;
+  time_t now;
+  conn_t *conns;          /* Open connections, least recently active first. */
+} evloop_t;
+
+struct conn {
+  int fd;
+  enum conn_state state;
+  evloop_t *loop;
+  int requests;
+  int waiting;             /* Accepted but not yet processed. */
+  time_t last_active;
+  conn_t *prev;
+  conn_t *next;
+
+  /* Request bytes read so far. May hold pipelined requests after the one
+   * being parsed. */
+  char buf[LIBHTTP_REQUEST_MAX_SIZE];
+  size_t buf_length;
+  struct http_parser parser;
+  struct http_request request;
+  uint64_t started;        /* When the first byte of the request was read. */
+
+  struct http_response response;
+  uint64_t send_started;
+  struct http_builder builder;
+  size_t headers_length;
+
+  /* Memory for the current request and its response body. */
+  struct arena arena;
+
+  /* Bytes of the headers and in-memory body already sent. */
+  size_t sent;
+
+  /* Staging buffer for files that cannot be sent with sendfile. */
+  size_t file_sent;
+  char *file_buf;
+  size_t file_buf_length;
+  size_t file_buf_sent;
+};
+
+/* Result of running one connection state. */
+#define CONN_ERROR -1
+#define CONN_BLOCKED 0
+#define CONN_PROGRESS 1
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("Failed to make socket non-blocking");
+    exit(errno);
+  }
+}
+
+static time_t monotonic_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+static void conn_close(conn_t *conn) {
+  metrics_closed();
+  http_response_free(&conn->response);
+  DL_DELETE(conn->loop->conns, conn);
+  /* Closing the socket also removes it from the epoll set. */
+  close(conn->fd);
+  arena_free(&conn->arena);
+  free(conn->file_buf);
+  free(conn);
+}
+
+/* Reads until a full request is buffered, then builds the response. */
+static int conn_read_request(conn_t *conn) {
+  ssize_t request_length;
+
+  while ((request_length = http_parser_execute(&conn->parser, &conn->request,
+          conn->buf, conn->buf_length)) == HTTP_PARSE_INCOMPLETE
+      && conn->buf_length < sizeof(conn->buf)) {
+    ssize_t bytes_read = read(conn->fd, conn->buf + conn->buf_length,
+        sizeof(conn->buf) - conn->buf_length);
+    if (bytes_read == 0) return CONN_ERROR;
+    if (bytes_read < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return CONN_BLOCKED;
+      return CONN_ERROR;
+    }
+    if (conn->buf_length == 0) conn->started = metrics_now();
+    conn->buf_length += bytes_read;
+  }
+  conn->requests++;
+
+  http_response_use_arena(&conn->arena);
+  if (request_length <= 0) {
+    /* Malformed or too large; the connection is closed after the reply. */
+    http_response_error(&conn->response, 400);
+    request_length = conn->buf_length;
+    conn->send_started = metrics_now();
+  } else {
+    uint64_t start = metrics_record(METRICS_PARSE, conn->started);
+    conn->loop->handler(&conn->request, &conn->response);
+    /* Request bodies are not read, so a request with one ends the connection. */
+    conn->response.keep_alive = conn->request.keep_alive && conn->request.content_length == 0
+        && conn->requests < http_keep_alive_max;
+    conn->send_started = metrics_record(METRICS_HANDLER, start);
+  }
+  http_response_use_arena(NULL);
+
+  /* The request is no longer needed; keep only the pipelined bytes. */
+  conn->buf_length -= request_length;
+  memmove(conn->buf, conn->buf + request_length, conn->buf_length);
+  http_parser_init(&conn->parser, &conn->request);
+  if (conn->buf_length > 0) conn->started = metrics_now();
+
+  conn->headers_length = http_response_format_headers(&conn->response,
+      &conn->builder);
+  if (conn->headers_length == 0) return CONN_ERROR;
+
+  conn->state = CONN_SEND_HEADERS;
+  return CONN_PROGRESS;
+}
+
+/* Closes CONN after its response, or readies it for the next request. */
+static int conn_finish_response(conn_t *conn) {
+  metrics_record(METRICS_SEND, conn->send_started);
+  metrics_count_response(conn->response.status_code,
+      conn->response.body_length + conn->response.file_length);
+  if (!conn->response.keep_alive) {
+    conn->state = CONN_DONE;
+    return CONN_PROGRESS;
+  }
+
+  http_response_free(&conn->response);
+  arena_reset(&conn->arena);
+  conn->file_sent = conn->file_buf_length = conn->file_buf_sent = 0;
+  conn->state = CONN_READ_REQUEST;
+  return CONN_PROGRESS;
+}
+
+/* Sends the headers and the in-memory body together, continuing after the
+ * bytes already sent. */
+static int conn_send_headers(conn_t *conn) {
+  size_t headers_length = conn->headers_length;
+  size_t total = headers_length + conn->response.body_length;
+
+  while (conn->sent < total) {
+    struct iovec iov[2];
+    int iovcnt = 0;
+    if (conn->sent < headers_length) {
+      iov[iovcnt].iov_base = conn->builder.buffer + conn->sent;
+      iov[iovcnt].iov_len = headers_length - conn->sent;
+      iovcnt++;
+    }
+    size_t body_sent = conn->sent > headers_length ? conn->sent - headers_length : 0;
+    if (body_sent < conn->response.body_length) {
+      iov[iovcnt].iov_base = conn->response.body + body_sent;
+      iov[iovcnt].iov_len = conn->response.body_length - body_sent;
+      iovcnt++;
+    }
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = iovcnt;
+    /* Let the kernel fill the last segment with file data as well. */
+    int more = conn->response.file_fd != -1 ? MSG_MORE : 0;
+    ssize_t bytes_sent = sendmsg(conn->fd, &message, MSG_NOSIGNAL | more);
+    if (bytes_sent < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return CONN_BLOCKED;
+      return CONN_ERROR;
+    }
+    conn->sent += bytes_sent;
+  }
+  conn->sent = 0;
+  return CONN_PROGRESS;
+}
+
+/* Sends the response file with sendfile, or through a staging buffer for
+ * files that sendfile cannot read from. */
+static int conn_send_file(conn_t *conn) {
+  struct http_response *response = &conn->response;
+  if (response->file_fd == -1) return CONN_PROGRESS;
+
+  while (conn->file_buf == NULL && conn->file_sent < response->file_length) {
+    off_t offset = response->file_offset + conn->file_sent;
+    ssize_t bytes_sent = sendfile(conn->fd, response->file_fd, &offset,
+        response->file_length - conn->file_sent);
+    if (bytes_sent > 0) {
+      conn->file_sent += bytes_sent;
+      continue;
+    }
+    if (bytes_sent == 0) return CONN_ERROR;
+    if (errno == EINTR) continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return CONN_BLOCKED;
+    if (errno != EINVAL && errno != ENOSYS) return CONN_ERROR;
+    conn->file_buf = malloc(EVLOOP_FILE_BUFFER_SIZE);
+    if (conn->file_buf == NULL) return CONN_ERROR;
+  }
+
+  while (conn->file_sent < response->file_length) {
+    if (conn->file_buf_sent == conn->file_buf_length) {
+      size_t remaining = response->file_length - conn->file_sent;
+      ssize_t bytes_read = pread(response->file_fd, conn->file_buf,
+          remaining < EVLOOP_FILE_BUFFER_SIZE ? remaining : EVLOOP_FILE_BUFFER_SIZE,
+          response->file_offset + conn->file_sent);
+      if (bytes_read < 0 && errno == EINTR) continue;
+      if (bytes_read <= 0) return CONN_ERROR;
+      conn->file_buf_length = bytes_read;
+      conn->file_buf_sent = 0;
+    }
+
+    ssize_t bytes_sent = send(conn->fd, conn->file_buf + conn->file_buf_sent,
+        conn->file_buf_length - conn->file_buf_sent, MSG_NOSIGNAL);
+    if (bytes_sent < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return CONN_BLOCKED;
+      return CONN_ERROR;
+    }
+    conn->file_buf_sent += bytes_sent;
+    conn->file_sent += bytes_sent;
+  }
+  return CONN_PROGRESS;
+}
+
+/* Runs CONN's state machine until it finishes or would block. */
+static void conn_process(conn_t *conn) {
+  int status = CONN_PROGRESS;
+
+  if (conn->waiting) {
+    metrics_serving(conn->fd);
+    conn->waiting = 0;
+  }
+
+  /* Keep the connection list ordered by last activity for evloop_expire. */
+  conn->last_active = conn->loop->now;
+  DL_DELETE(conn->loop->conns, conn);
+  DL_APPEND(conn->loop->conns, conn);
+
+  while (status == CONN_PROGRESS && conn->state != CONN_DONE) {
+    switch (conn->state) {
+      case CONN_READ_REQUEST:
+        status = conn_read_request(conn);
+        break;
+      case CONN_SEND_HEADERS:
+        status = conn_send_headers(conn);
+        if (status == CONN_PROGRESS) conn->state = CONN_SEND_FILE;
+        break;
+      case CONN_SEND_FILE:
+        status = conn_send_file(conn);
+        if (status == CONN_PROGRESS) status = conn_finish_response(conn);
+        break;
+      case CONN_DONE:
+        break;
+    }
+  }
+
+  if (status == CONN_ERROR || conn->state == CONN_DONE) {
+    conn_close(conn);
+  }
+}
+
+/* Accepts every pending connection on the listening socket. */
+static void evloop_accept(evloop_t *loop) {
+  while (1) {
+    int client_socket = accept4(loop->server_socket, NULL, NULL,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_socket < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("Error accepting socket");
+      }
+      return;
+    }
+
+    conn_t *conn = calloc(1, sizeof(conn_t));
+    if (conn == NULL) {
+      close(client_socket);
+      continue;
+    }
+    metrics_accepted(client_socket);
+    conn->fd = client_socket;
+    conn->waiting = 1;
+    conn->state = CONN_READ_REQUEST;
+    conn->loop = loop;
+    conn->last_active = loop->now;
+    conn->response.file_fd = -1;
+    arena_init(&conn->arena);
+    http_parser_init(&conn->parser, &conn->request);
+    DL_APPEND(loop->conns, conn);
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_socket, &event) == -1) {
+      perror("Failed to add socket to epoll");
+      conn_close(conn);
+    }
+  }
+}
+
+/* Closes connections idle for longer than http_keep_alive_timeout. */
+static void evloop_expire(evloop_t *loop) {
+  while (loop->conns != NULL
+      && loop->now - loop->conns->last_active >= http_keep_alive_timeout) {
+    conn_close(loop->conns);
+  }
+}
+
+/*
+ * Serves connections accepted on SERVER_SOCKET forever from the calling
+ * thread. HANDLER is called once per request to build the response.
+ */
+void evloop_serve(int server_socket, evloop_handler handler) {
+  evloop_t loop;
+  memset(&loop, 0, sizeof(loop));
+  loop.server_socket = server_socket;
+  loop.handler = handler;
+
+  int epoll_fd = loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    perror("Failed to create epoll instance");
+    exit(errno);
+  }
+
+  set_nonblocking(server_socket);
+
+  /* The listening socket is the only entry without connection state. */
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = NULL;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event) == -1) {
+    perror("Failed to add server socket to epoll");
+    exit(errno);
+  }
+
+  /* Wake up once a second to close idle connections. */
+  int wait_timeout = http_keep_alive_timeout > 0 ? 1000 : -1;
+
+  struct epoll_event events[EVLOOP_MAX_EVENTS];
+  while (1) {
+    int num_events = epoll_wait(epoll_fd, events, EVLOOP_MAX_EVENTS, wait_timeout);
+    if (num_events < 0) {
+      if (errno == EINTR) continue;
+      perror("Failed to wait for events");
+      exit(errno);
+    }
+
+    loop.now = monotonic_seconds();
+    for (int i = 0; i < num_events; i++) {
+      if (events[i].data.ptr == NULL) {
+        evloop_accept(&loop);
+      } else {
+        conn_process(events[i].data.ptr);
+      }
+    }
+
+    if (http_keep_alive_timeout > 0) evloop_expire(&loop);
+  }
+}
@@ -0,0 +1,22 @@
+#ifndef __EVLOOP__
+#define __EVLOOP__
+
+#include "libhttp.h"
+
+/* EVLOOP is a single-threaded, edge-triggered epoll reactor. Every client
+ * socket is non-blocking and is driven by a small state machine that reads
+ * the request, sends the headers and then sends the body, so one thread can
+ * keep many slow or idle connections open at once. Keep-alive connections go
+ * back to reading the next request, and are closed once idle for
+ * http_keep_alive_timeout seconds.
+ *
+ * evloop.c implements it with epoll. evloop_uring.c, built with
+ * "make BACKEND=io_uring", implements the same interface on io_uring. */
+
+/* Builds the response for a parsed request. Must not block on the client. */
+typedef void (*evloop_handler)(struct http_request *request,
+    struct http_response *response);
+
+void evloop_serve(int server_socket, evloop_handler handler);
+
+#endif
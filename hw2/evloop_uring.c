@@ -0,0 +1,807 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "evloop.h"
+#include "metrics.h"
+#include "utlist.h"
+
+/* io_uring backend of evloop.h, built with "make BACKEND=io_uring".
+ *
+ * Every operation of every connection goes through one ring per event loop.
+ * Operations are queued as submission entries while completions are handled,
+ * and the whole batch is submitted with the same io_uring_enter call that
+ * waits for the next completions, so a busy loop makes one system call for
+ * many connections instead of one or more per connection.
+ *
+ * - The listening socket has a single multishot accept armed, which puts
+ *   every client socket straight into the ring's registered file table.
+ *   Client sockets never become ordinary file descriptors, and the kernel
+ *   does not look them up on each operation.
+ * - Every connection has a multishot receive armed, which stays armed from
+ *   one request to the next. It receives into buffers from a ring of
+ *   provided buffers, so the buffer is picked when data arrives rather than
+ *   reserved for every idle keep-alive connection. A request that arrives
+ *   whole is parsed in place; otherwise it is gathered in the connection's
+ *   own buffer.
+ * - Files are sent in chunks with a read of the file linked to a send of the
+ *   chunk, queued behind the headers, so the kernel runs the whole response
+ *   without coming back to the loop in between.
+ *
+ * Needs Linux 6.0 or later. */
+
+#define URING_ENTRIES 1024
+#define URING_MAX_FILES 65536
+#define URING_BUFFERS 2048          /* Provided buffers; a power of two. */
+#define URING_BUFFER_SIZE 2048
+#define URING_MAX_HELD 16
+#define URING_BUFFER_GROUP 0
+#define URING_FILE_CHUNK 65536
+#define URING_SPLICE_MIN 16384
+
+/* What a completion is for, kept in the low bits of its user_data. The rest
+ * is the connection, or NULL for the listening socket and for operations
+ * nothing waits on. */
+enum uring_op {
+  URING_ACCEPT,
+  URING_RECV,
+  URING_SEND,              /* Headers and in-memory body. */
+  URING_READ_FILE,
+  URING_SEND_FILE,
+  URING_CANCEL,
+  URING_CLOSE,
+};
+#define URING_OP_MASK 7
+
+typedef struct uring {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_queued;      /* Local tail: entries queued, submitted or not. */
+  unsigned sq_submitted;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *buf_ring;
+  char *buffers;
+  unsigned buf_tail;
+} uring_t;
+
+/* Each connection moves through these states in order, as in evloop.c. */
+enum conn_state {
+  CONN_READ_REQUEST,
+  CONN_SEND,               /* Headers, in-memory body and then the file. */
+  CONN_CLOSING,            /* Waiting for its operations to be cancelled. */
+};
+
+typedef struct conn conn_t;
+
+typedef struct evloop {
+  uring_t ring;
+  int server_socket;
+  evloop_handler handler;
+  time_t now;
+  conn_t *conns;          /* Open connections, least recently active first. */
+} evloop_t;
+
+struct conn {
+  int slot;                /* Index of the socket in the registered files. */
+  enum conn_state state;
+  evloop_t *loop;
+  int requests;
+  int inflight;            /* Operations submitted and not yet completed. */
+  int sending;             /* Those of them that send the response. */
+  int failed;              /* One of them failed; close once they are done. */
+  int receiving;           /* A receive is armed. */
+  int recv_cancelled;      /* It has been asked to stop. */
+  int no_buffers;          /* The provided buffers ran out; receive into buf. */
+  int peer_closed;         /* The client will send nothing more. */
+  time_t last_active;
+  conn_t *prev;
+  conn_t *next;
+
+  /* Request bytes received so far, unless the whole request arrived in one
+   * provided buffer. May hold pipelined requests after the one being
+   * parsed. */
+  char buf[LIBHTTP_REQUEST_MAX_SIZE];
+  size_t buf_length;
+  struct http_parser parser;
+  struct http_request request;
+  uint64_t started;        /* When the first byte of the request was read. */
+
+  /* Provided buffers received while buf was full, oldest first. The receive
+   * is cancelled while there are any, and armed again once they are used. */
+  struct {
+    unsigned short bid;
+    unsigned short offset;
+    unsigned short length;
+  } held[URING_MAX_HELD];
+  int num_held;
+
+  struct http_response response;
+  uint64_t send_started;
+  struct http_builder builder;
+  size_t headers_length;
+
+  /* Memory for the current request and its response body. */
+  struct arena arena;
+
+  /* Bytes of the headers and in-memory body already sent, and the message
+   * the kernel sends them from. */
+  size_t sent;
+  struct msghdr message;
+  struct iovec iov[2];
+
+  /* Bytes of the file sent, and the chunk read for the send in flight. */
+  size_t file_sent;
+  char *file_buf;
+  int pipe[2];
+  size_t chunk_length;     /* Bytes asked of the read. */
+  size_t chunk_read;
+  size_t chunk_sent;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, void *arg, size_t arg_size) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static time_t monotonic_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+/* Creates the ring, preferring the setup flags that let the kernel defer its
+ * completion work to our io_uring_enter calls, where it is batched. */
+static void uring_init(uring_t *ring) {
+  static const unsigned flag_sets[] = {
+    IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+    IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+    0,
+  };
+  struct io_uring_params params;
+  for (size_t i = 0; i < sizeof(flag_sets) / sizeof(flag_sets[0]); i++) {
+    memset(&params, 0, sizeof(params));
+    params.flags = flag_sets[i] | IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4;
+    ring->fd = io_uring_setup(URING_ENTRIES, &params);
+    if (ring->fd >= 0 || errno != EINVAL) break;
+  }
+  if (ring->fd < 0) {
+    perror("Failed to set up io_uring");
+    exit(errno);
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+    fprintf(stderr, "io_uring on this kernel is too old for the event loop\n");
+    exit(ENOSYS);
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  size_t rings_size = sq_size > cq_size ? sq_size : cq_size;
+  char *rings = mmap(NULL, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring->fd, IORING_OFF_SQ_RING);
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (rings == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    perror("Failed to map io_uring");
+    exit(errno);
+  }
+
+  ring->sq_head = (unsigned *) (rings + params.sq_off.head);
+  ring->sq_tail = (unsigned *) (rings + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *) (rings + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_queued = ring->sq_submitted = *ring->sq_tail;
+  /* Entries are always submitted in order, so the index array is fixed. */
+  unsigned *array = (unsigned *) (rings + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; i++) array[i] = i;
+
+  ring->cq_head = (unsigned *) (rings + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (rings + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *) (rings + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (rings + params.cq_off.cqes);
+
+  /* An empty table the kernel fills with accepted sockets. */
+  struct rlimit limit;
+  unsigned num_files = URING_MAX_FILES;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < num_files) {
+    num_files = limit.rlim_cur;
+  }
+  struct io_uring_rsrc_register files;
+  memset(&files, 0, sizeof(files));
+  files.nr = num_files;
+  files.flags = IORING_RSRC_REGISTER_SPARSE;
+  if (io_uring_register(ring->fd, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0) {
+    perror("Failed to register io_uring files");
+    exit(errno);
+  }
+
+  size_t buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+  ring->buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ring->buffers = malloc((size_t) URING_BUFFERS * URING_BUFFER_SIZE);
+  if (ring->buf_ring == MAP_FAILED || ring->buffers == NULL) {
+    perror("Failed to allocate io_uring buffers");
+    exit(errno);
+  }
+  struct io_uring_buf_reg buf_reg;
+  memset(&buf_reg, 0, sizeof(buf_reg));
+  buf_reg.ring_addr = (unsigned long) ring->buf_ring;
+  buf_reg.ring_entries = URING_BUFFERS;
+  buf_reg.bgid = URING_BUFFER_GROUP;
+  if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &buf_reg, 1) < 0) {
+    perror("Failed to register io_uring buffers");
+    exit(errno);
+  }
+  ring->buf_tail = 0;
+}
+
+/* Hands buffer BID back to the kernel. */
+static void uring_recycle_buffer(uring_t *ring, unsigned bid) {
+  struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+  buf->addr = (unsigned long) (ring->buffers + (size_t) bid * URING_BUFFER_SIZE);
+  buf->len = URING_BUFFER_SIZE;
+  buf->bid = bid;
+  ring->buf_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, (unsigned short) ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* Submits the queued entries and waits for at least WAIT_NR completions, or
+ * for TIMEOUT if it is not NULL. */
+static void uring_enter(uring_t *ring, unsigned wait_nr, struct timespec *timeout) {
+  __atomic_store_n(ring->sq_tail, ring->sq_queued, __ATOMIC_RELEASE);
+
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (timeout != NULL) {
+    ts.tv_sec = timeout->tv_sec;
+    ts.tv_nsec = timeout->tv_nsec;
+    arg.ts = (unsigned long) &ts;
+  }
+
+  unsigned flags = IORING_ENTER_EXT_ARG | (wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+  while (1) {
+    int submitted = io_uring_enter(ring->fd, ring->sq_queued - ring->sq_submitted, wait_nr,
+        flags, &arg, sizeof(arg));
+    if (submitted >= 0) {
+      ring->sq_submitted += submitted;
+      if (ring->sq_submitted == ring->sq_queued) return;
+      continue;
+    }
+    if (errno == EINTR) continue;
+    /* Out of completion space or timed out: reaping comes next. */
+    if (errno == EBUSY || errno == EAGAIN || errno == ETIME) return;
+    perror("Failed to enter io_uring");
+    exit(errno);
+  }
+}
+
+/* Makes sure COUNT entries can be queued together, so a linked chain is
+ * never split across two submissions. */
+static void uring_reserve(uring_t *ring, unsigned count) {
+  while (ring->sq_queued - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count
+      > ring->sq_entries) {
+    uring_enter(ring, 0, NULL);
+  }
+}
+
+/* Queues a blank entry for OP of CONN. */
+static struct io_uring_sqe *uring_queue(uring_t *ring, conn_t *conn, enum uring_op op) {
+  uring_reserve(ring, 1);
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sq_queued++ & ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (unsigned long) conn | op;
+  if (conn != NULL) {
+    conn->inflight++;
+    if (op != URING_RECV) conn->sending++;
+  }
+  return sqe;
+}
+
+/* Arms a multishot accept that puts client sockets into free slots of the
+ * registered file table. */
+static void evloop_arm_accept(evloop_t *loop) {
+  struct io_uring_sqe *sqe = uring_queue(&loop->ring, NULL, URING_ACCEPT);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = loop->server_socket;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->file_index = IORING_FILE_INDEX_ALLOC;
+}
+
+/* Closes CONN's socket and frees it. Nothing of it may be in flight. */
+static void conn_free(conn_t *conn) {
+  struct io_uring_sqe *sqe = uring_queue(&conn->loop->ring, NULL, URING_CLOSE);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->file_index = conn->slot + 1;
+
+  for (int i = 0; i < conn->num_held; i++) {
+    uring_recycle_buffer(&conn->loop->ring, conn->held[i].bid);
+  }
+  metrics_closed();
+  http_response_free(&conn->response);
+  arena_free(&conn->arena);
+  free(conn->file_buf);
+  if (conn->pipe[0] != -1) {
+    close(conn->pipe[0]);
+    close(conn->pipe[1]);
+  }
+  free(conn);
+}
+
+/* Closes CONN once whatever it has in flight is cancelled. */
+static void conn_close(conn_t *conn) {
+  if (conn->state == CONN_CLOSING) return;
+  conn->state = CONN_CLOSING;
+  DL_DELETE(conn->loop->conns, conn);
+  if (conn->inflight == 0) {
+    conn_free(conn);
+    return;
+  }
+
+  struct io_uring_sqe *sqe = uring_queue(&conn->loop->ring, NULL, URING_CANCEL);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = conn->slot;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_FD_FIXED
+      | IORING_ASYNC_CANCEL_ALL;
+}
+
+/* Arms a multishot receive for the next requests, unless one is armed. If
+ * the provided buffers ran out, receives once straight into buf instead. */
+static void conn_recv(conn_t *conn) {
+  conn->state = CONN_READ_REQUEST;
+  if (conn->receiving) return;
+
+  struct io_uring_sqe *sqe = uring_queue(&conn->loop->ring, conn, URING_RECV);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->slot;
+  sqe->flags = IOSQE_FIXED_FILE;
+  if (conn->no_buffers) {
+    sqe->addr = (unsigned long) (conn->buf + conn->buf_length);
+    sqe->len = sizeof(conn->buf) - conn->buf_length;
+  } else {
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+  }
+  conn->receiving = 1;
+  conn->recv_cancelled = 0;
+}
+
+/* Moves held bytes into buf while there is room, and stops the receive
+ * while any are left. */
+static void conn_drain_held(conn_t *conn) {
+  uring_t *ring = &conn->loop->ring;
+  while (conn->num_held > 0 && conn->buf_length < sizeof(conn->buf)) {
+    size_t room = sizeof(conn->buf) - conn->buf_length;
+    size_t length = conn->held[0].length < room ? conn->held[0].length : room;
+    memcpy(conn->buf + conn->buf_length,
+        ring->buffers + (size_t) conn->held[0].bid * URING_BUFFER_SIZE + conn->held[0].offset,
+        length);
+    conn->buf_length += length;
+    conn->held[0].offset += length;
+    conn->held[0].length -= length;
+    if (conn->held[0].length == 0) {
+      uring_recycle_buffer(ring, conn->held[0].bid);
+      memmove(&conn->held[0], &conn->held[1], --conn->num_held * sizeof(conn->held[0]));
+    }
+  }
+
+  if (conn->num_held > 0 && conn->receiving && !conn->recv_cancelled) {
+    struct io_uring_sqe *sqe = uring_queue(ring, NULL, URING_CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (unsigned long) conn | URING_RECV;
+    conn->recv_cancelled = 1;
+  }
+}
+
+/* Returns 1 if CONN's file goes through a pipe, setting it up if needed. */
+static int conn_pipe(conn_t *conn) {
+  if (conn->response.file_length < URING_SPLICE_MIN) return 0;
+  if (conn->pipe[0] == -1 && pipe2(conn->pipe, O_CLOEXEC) == -1) {
+    conn->pipe[0] = conn->pipe[1] = -1;
+    return 0;
+  }
+  return 1;
+}
+
+/* Queues whatever is left of the response: the rest of the headers and
+ * in-memory body, then a chain that reads the next chunk of the file and
+ * sends it, all linked so they run in order. */
+static void conn_send(conn_t *conn) {
+  uring_t *ring = &conn->loop->ring;
+  struct http_response *response = &conn->response;
+  size_t headers_length = conn->headers_length;
+  size_t total = headers_length + response->body_length;
+  int file_left = response->file_fd != -1 && conn->file_sent < response->file_length;
+  int chunk_left = conn->chunk_sent < conn->chunk_read;
+
+  uring_reserve(ring, 3);
+  struct io_uring_sqe *last = NULL;
+
+  if (conn->sent < total) {
+    int iovcnt = 0;
+    if (conn->sent < headers_length) {
+      conn->iov[iovcnt].iov_base = conn->builder.buffer + conn->sent;
+      conn->iov[iovcnt].iov_len = headers_length - conn->sent;
+      iovcnt++;
+    }
+    size_t body_sent = conn->sent > headers_length ? conn->sent - headers_length : 0;
+    if (body_sent < response->body_length) {
+      conn->iov[iovcnt].iov_base = response->body + body_sent;
+      conn->iov[iovcnt].iov_len = response->body_length - body_sent;
+      iovcnt++;
+    }
+    memset(&conn->message, 0, sizeof(conn->message));
+    conn->message.msg_iov = conn->iov;
+    conn->message.msg_iovlen = iovcnt;
+
+    last = uring_queue(ring, conn, URING_SEND);
+    last->opcode = IORING_OP_SENDMSG;
+    last->fd = conn->slot;
+    last->flags = IOSQE_FIXED_FILE;
+    last->addr = (unsigned long) &conn->message;
+    /* A short send breaks the chain instead of sending the file early. */
+    last->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (file_left ? MSG_MORE : 0);
+  }
+
+  if (file_left) {
+    int splicing = conn_pipe(conn);
+    size_t pending = conn->chunk_read - conn->chunk_sent;
+    if (!chunk_left) {
+      if (!splicing && conn->file_buf == NULL) conn->file_buf = malloc(URING_FILE_CHUNK);
+      if (!splicing && conn->file_buf == NULL) {
+        conn->failed = 1;
+        if (conn->sending == 0) conn_close(conn);
+        return;
+      }
+      size_t remaining = response->file_length - conn->file_sent;
+      pending = conn->chunk_length = remaining < URING_FILE_CHUNK ? remaining : URING_FILE_CHUNK;
+      conn->chunk_read = conn->chunk_sent = 0;
+
+      if (last != NULL) last->flags |= IOSQE_IO_LINK;
+      last = uring_queue(ring, conn, URING_READ_FILE);
+      if (splicing) {
+        last->opcode = IORING_OP_SPLICE;
+        last->fd = conn->pipe[1];
+        last->splice_fd_in = response->file_fd;
+        last->splice_off_in = response->file_offset + conn->file_sent;
+        last->off = -1;
+      } else {
+        last->opcode = IORING_OP_READ;
+        last->fd = response->file_fd;
+        last->addr = (unsigned long) conn->file_buf;
+        last->off = response->file_offset + conn->file_sent;
+      }
+      last->len = conn->chunk_length;
+      /* A short read breaks the chain, and the send is queued again with the
+       * bytes that were read. */
+      last->flags = IOSQE_IO_LINK;
+    }
+
+    int more = conn->file_sent + pending < response->file_length;
+    if (last != NULL) last->flags |= IOSQE_IO_LINK;
+    last = uring_queue(ring, conn, URING_SEND_FILE);
+    last->fd = conn->slot;
+    last->flags = IOSQE_FIXED_FILE;
+    last->len = pending;
+    if (splicing) {
+      last->opcode = IORING_OP_SPLICE;
+      last->splice_fd_in = conn->pipe[0];
+      last->splice_off_in = -1;
+      last->off = -1;
+      last->splice_flags = more ? SPLICE_F_MORE : 0;
+    } else {
+      last->opcode = IORING_OP_SEND;
+      last->addr = (unsigned long) (conn->file_buf + conn->chunk_sent);
+      last->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (more ? MSG_MORE : 0);
+    }
+  }
+  conn->state = CONN_SEND;
+}
+
+static void conn_parse(conn_t *conn);
+
+/* Builds the response to the request in the first REQUEST_LENGTH bytes of
+ * BUFFER, or to a malformed one if REQUEST_LENGTH is not positive, keeps the
+ * pipelined bytes after it and starts sending. */
+static void conn_respond(conn_t *conn, char *buffer, size_t length, ssize_t request_length) {
+  conn->requests++;
+
+  http_response_use_arena(&conn->arena);
+  if (request_length <= 0) {
+    /* Malformed or too large; the connection is closed after the reply. */
+    http_response_error(&conn->response, 400);
+    request_length = length;
+    conn->send_started = metrics_now();
+  } else {
+    uint64_t start = metrics_record(METRICS_PARSE, conn->started);
+    conn->loop->handler(&conn->request, &conn->response);
+    /* Request bodies are not read, so a request with one ends the connection. */
+    conn->response.keep_alive = conn->request.keep_alive && conn->request.content_length == 0
+        && conn->requests < http_keep_alive_max;
+    conn->send_started = metrics_record(METRICS_HANDLER, start);
+  }
+  http_response_use_arena(NULL);
+
+  /* The request is no longer needed; keep only the pipelined bytes. */
+  conn->buf_length = length - request_length;
+  memmove(conn->buf, buffer + request_length, conn->buf_length);
+  http_parser_init(&conn->parser, &conn->request);
+  if (conn->buf_length > 0) conn->started = metrics_now();
+
+  conn->headers_length = http_response_format_headers(&conn->response,
+      &conn->builder);
+  if (conn->headers_length == 0) {
+    conn_close(conn);
+    return;
+  }
+  conn->sent = conn->file_sent = conn->chunk_read = conn->chunk_sent = 0;
+  conn_send(conn);
+}
+
+/* Parses the bytes gathered in buf, and responds or receives more. */
+static void conn_parse(conn_t *conn) {
+  conn_drain_held(conn);
+  ssize_t request_length = http_parser_execute(&conn->parser, &conn->request,
+      conn->buf, conn->buf_length);
+  if (request_length == HTTP_PARSE_INCOMPLETE && conn->buf_length < sizeof(conn->buf)) {
+    if (conn->peer_closed) {
+      conn_close(conn);
+    } else {
+      conn_recv(conn);
+    }
+    return;
+  }
+  conn_respond(conn, conn->buf, conn->buf_length, request_length);
+}
+
+/* Handles LENGTH bytes received into provided buffer BID, or straight into
+ * buf if BID is -1. Bytes that arrive while a response is being sent wait in
+ * buf for it to finish. */
+static void conn_received(conn_t *conn, int bid, size_t length) {
+  uring_t *ring = &conn->loop->ring;
+  if (conn->buf_length == 0 && conn->num_held == 0) conn->started = metrics_now();
+
+  if (bid == -1) {
+    conn->buf_length += length;
+  } else if (conn->state == CONN_READ_REQUEST && conn->buf_length == 0 && conn->num_held == 0) {
+    /* Usually the whole request is here; then it is parsed where it is. */
+    char *data = ring->buffers + (size_t) bid * URING_BUFFER_SIZE;
+    ssize_t request_length = http_parser_execute(&conn->parser, &conn->request,
+        data, length);
+    if (request_length != HTTP_PARSE_INCOMPLETE) {
+      conn_respond(conn, data, length, request_length);
+      uring_recycle_buffer(ring, bid);
+      return;
+    }
+    /* The parser points into DATA, so it starts over once DATA is copied. */
+    http_parser_init(&conn->parser, &conn->request);
+  }
+
+  if (bid != -1) {
+    if (conn->num_held == URING_MAX_HELD) {
+      uring_recycle_buffer(ring, bid);
+      conn_close(conn);
+      return;
+    }
+    conn->held[conn->num_held].bid = bid;
+    conn->held[conn->num_held].offset = 0;
+    conn->held[conn->num_held].length = length;
+    conn->num_held++;
+  }
+
+  if (conn->state == CONN_READ_REQUEST) {
+    conn_parse(conn);
+  } else {
+    conn_drain_held(conn);
+  }
+}
+
+/* Closes CONN after its response, or readies it for the next request. */
+static void conn_finish_response(conn_t *conn) {
+  metrics_record(METRICS_SEND, conn->send_started);
+  metrics_count_response(conn->response.status_code,
+      conn->response.body_length + conn->response.file_length);
+  if (!conn->response.keep_alive) {
+    conn_close(conn);
+    return;
+  }
+
+  http_response_free(&conn->response);
+  arena_reset(&conn->arena);
+  conn_parse(conn);
+}
+
+/* Moves CONN on once every operation sending its response has completed.
+ * May free CONN. */
+static void conn_continue(conn_t *conn) {
+  if (conn->failed) {
+    conn_close(conn);
+    return;
+  }
+
+  struct http_response *response = &conn->response;
+  if (conn->sent < conn->headers_length + response->body_length
+      || (response->file_fd != -1 && conn->file_sent < response->file_length)) {
+    conn_send(conn);
+  } else {
+    conn_finish_response(conn);
+  }
+}
+
+/* Handles the completion of OP of CONN, with result RES. May free CONN. */
+static void conn_complete(conn_t *conn, enum uring_op op, int res, unsigned flags) {
+  evloop_t *loop = conn->loop;
+  /* A multishot receive stays in flight until a completion without MORE. */
+  if (op != URING_RECV || !(flags & IORING_CQE_F_MORE)) {
+    conn->inflight--;
+    if (op == URING_RECV) conn->receiving = 0;
+  }
+  if (op != URING_RECV) conn->sending--;
+
+  if (conn->state == CONN_CLOSING) {
+    if (flags & IORING_CQE_F_BUFFER) {
+      uring_recycle_buffer(&loop->ring, flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    if (conn->inflight == 0) conn_free(conn);
+    return;
+  }
+
+  /* Keep the connection list ordered by last activity for evloop_expire. */
+  conn->last_active = loop->now;
+  DL_DELETE(loop->conns, conn);
+  DL_APPEND(loop->conns, conn);
+
+  switch (op) {
+    case URING_RECV:
+      if (res > 0) {
+        conn->no_buffers = 0;
+        conn_received(conn, flags & IORING_CQE_F_BUFFER
+            ? (int) (flags >> IORING_CQE_BUFFER_SHIFT) : -1, res);
+      } else if (res == -ENOBUFS || res == -ECANCELED) {
+        /* Out of buffers, or stopped while bytes were held: go on when the
+         * request needs more. */
+        if (res == -ENOBUFS) conn->no_buffers = 1;
+        if (conn->state == CONN_READ_REQUEST) conn_parse(conn);
+      } else if (res == 0 && conn->state == CONN_SEND) {
+        conn->peer_closed = 1;
+      } else {
+        conn_close(conn);
+      }
+      return;
+    case URING_SEND:
+      if (res > 0) conn->sent += res;
+      else conn->failed = 1;
+      break;
+    case URING_READ_FILE:
+      if (res > 0) conn->chunk_read = res;
+      else if (res != -ECANCELED) conn->failed = 1;
+      break;
+    case URING_SEND_FILE:
+      if (res > 0) {
+        conn->chunk_sent += res;
+        conn->file_sent += res;
+      } else if (res != -ECANCELED) {
+        conn->failed = 1;
+      }
+      break;
+    default:
+      return;
+  }
+
+  if (conn->sending == 0) conn_continue(conn);
+}
+
+/* Sets up a connection for the client socket the kernel put in SLOT. */
+static void evloop_accepted(evloop_t *loop, int slot) {
+  conn_t *conn = calloc(1, sizeof(conn_t));
+  if (conn == NULL) {
+    struct io_uring_sqe *sqe = uring_queue(&loop->ring, NULL, URING_CLOSE);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+    return;
+  }
+  /* The socket is not a file descriptor, and is served as soon as it is
+   * reaped, so there is no accept wait to record. */
+  metrics_accepted(-1);
+  conn->slot = slot;
+  conn->loop = loop;
+  conn->last_active = loop->now;
+  conn->response.file_fd = -1;
+  conn->pipe[0] = conn->pipe[1] = -1;
+  arena_init(&conn->arena);
+  http_parser_init(&conn->parser, &conn->request);
+  DL_APPEND(loop->conns, conn);
+  conn_recv(conn);
+}
+
+/* Closes connections idle for longer than http_keep_alive_timeout. */
+static void evloop_expire(evloop_t *loop) {
+  while (loop->conns != NULL
+      && loop->now - loop->conns->last_active >= http_keep_alive_timeout) {
+    conn_close(loop->conns);
+  }
+}
+
+/* Handles every completion posted so far. */
+static void evloop_reap(evloop_t *loop) {
+  uring_t *ring = &loop->ring;
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    conn_t *conn = (conn_t *) (unsigned long) (cqe->user_data & ~(__u64) URING_OP_MASK);
+    enum uring_op op = cqe->user_data & URING_OP_MASK;
+    int res = cqe->res;
+    unsigned flags = cqe->flags;
+    /* Free the entry first; handling it may queue more work. */
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    if (conn != NULL) {
+      conn_complete(conn, op, res, flags);
+    } else if (op == URING_ACCEPT) {
+      if (res >= 0) {
+        evloop_accepted(loop, res);
+      } else if (res != -ECONNABORTED && res != -EINTR) {
+        fprintf(stderr, "Error accepting socket: %s\n", strerror(-res));
+      }
+      if (!(flags & IORING_CQE_F_MORE)) evloop_arm_accept(loop);
+    }
+  }
+}
+
+/*
+ * Serves connections accepted on SERVER_SOCKET forever from the calling
+ * thread. HANDLER is called once per request to build the response.
+ */
+void evloop_serve(int server_socket, evloop_handler handler) {
+  evloop_t loop;
+  memset(&loop, 0, sizeof(loop));
+  loop.server_socket = server_socket;
+  loop.handler = handler;
+
+  uring_init(&loop.ring);
+  for (unsigned bid = 0; bid < URING_BUFFERS; bid++) {
+    uring_recycle_buffer(&loop.ring, bid);
+  }
+  evloop_arm_accept(&loop);
+
+  /* Wake up once a second to close idle connections. */
+  struct timespec wait_timeout = { 1, 0 };
+
+  while (1) {
+    uring_enter(&loop.ring, 1, http_keep_alive_timeout > 0 ? &wait_timeout : NULL);
+    loop.now = monotonic_seconds();
+    evloop_reap(&loop);
+    if (http_keep_alive_timeout > 0) evloop_expire(&loop);
+  }
+}
@@ -0,0 +1,365 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filecache.h"
+#include "utlist.h"
+
+#define FILECACHE_SHARDS 16
+#define FILECACHE_BUCKETS 1024
+
+typedef struct filecache_entry {
+  char *key;
+  char *path;                   /* File the contents were read from. */
+  unsigned long hash;
+
+  /* Identity of the file when it was read, checked on revalidation. */
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  struct timespec mtime;
+  time_t validated;
+
+  char *content_type;           /* A string constant. */
+  char etag[48];
+  char *headers;
+  size_t headers_length;
+  char *body;                   /* Contents, or NULL if FD is kept instead. */
+  size_t body_length;
+  int mapped;                   /* BODY is a mapping of the file, not a copy. */
+  int map_fd;                   /* The mapped file, to copy ranges from. */
+  int fd;                       /* Open file, for files too large to hold. */
+  size_t cost;                  /* Bytes charged against the budget. */
+
+  /* One reference is held by the cache, one by every response in flight. */
+  int refcount;
+
+  struct filecache_entry *hash_next;
+  struct filecache_entry *prev; /* LRU list, least recently used first. */
+  struct filecache_entry *next;
+} filecache_entry_t;
+
+typedef struct filecache_shard {
+  pthread_mutex_t mutex;
+  filecache_entry_t *buckets[FILECACHE_BUCKETS];
+  filecache_entry_t *lru;
+  size_t bytes;
+  int fds;
+} __attribute__((aligned(64))) filecache_shard_t;
+
+static filecache_shard_t shards[FILECACHE_SHARDS];
+static size_t shard_max_bytes = 0;
+static int shard_max_fds = 0;
+static int revalidate_interval = 0;
+static size_t map_max_size = 0;
+
+static unsigned long filecache_hash(char *key) {
+  /* FNV-1a */
+  unsigned long hash = 14695981039346656037UL;
+  for (; *key != '\0'; key++) {
+    hash ^= (unsigned char) *key;
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+static filecache_shard_t *filecache_shard(unsigned long hash) {
+  return &shards[(hash >> 32) % FILECACHE_SHARDS];
+}
+
+static time_t monotonic_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+static void filecache_release(void *arg) {
+  filecache_entry_t *entry = arg;
+  if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
+  free(entry->key);
+  free(entry->path);
+  free(entry->headers);
+  if (entry->mapped) {
+    munmap(entry->body, entry->body_length);
+  } else {
+    free(entry->body);
+  }
+  if (entry->map_fd != -1) close(entry->map_fd);
+  if (entry->fd != -1) close(entry->fd);
+  free(entry);
+}
+
+/* Unlinks ENTRY from SHARD and drops the cache's reference to it. The
+ * shard's mutex must be held. */
+static void filecache_remove(filecache_shard_t *shard, filecache_entry_t *entry) {
+  filecache_entry_t **link = &shard->buckets[entry->hash % FILECACHE_BUCKETS];
+  while (*link != entry) link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  DL_DELETE(shard->lru, entry);
+  shard->bytes -= entry->cost;
+  if (entry->fd != -1) shard->fds--;
+  filecache_release(entry);
+}
+
+/* Evicts least recently used entries from SHARD until ENTRY fits within both
+ * its byte and its fd budget. The shard's mutex must be held. */
+static void filecache_make_room(filecache_shard_t *shard, filecache_entry_t *entry) {
+  filecache_entry_t *victim = shard->lru;
+  while (victim != NULL) {
+    int over_bytes = shard->bytes + entry->cost > shard_max_bytes;
+    int over_fds = entry->fd != -1 && shard->fds >= shard_max_fds;
+    if (!over_bytes && !over_fds) break;
+
+    filecache_entry_t *next = victim->next;
+    if (victim->fd == -1 ? over_bytes : over_fds) filecache_remove(shard, victim);
+    victim = next;
+  }
+}
+
+static filecache_entry_t *filecache_find(filecache_shard_t *shard, char *key,
+    unsigned long hash) {
+  filecache_entry_t *entry = shard->buckets[hash % FILECACHE_BUCKETS];
+  while (entry != NULL && (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+    entry = entry->hash_next;
+  }
+  return entry;
+}
+
+/* Returns 1 if ENTRY still matches the file on disk. */
+static int filecache_still_valid(filecache_entry_t *entry) {
+  struct stat statbuf;
+  if (stat(entry->path, &statbuf) != 0) return 0;
+  return statbuf.st_dev == entry->device && statbuf.st_ino == entry->inode
+      && statbuf.st_size == entry->size
+      && statbuf.st_mtim.tv_sec == entry->mtime.tv_sec
+      && statbuf.st_mtim.tv_nsec == entry->mtime.tv_nsec;
+}
+
+static void filecache_fill_response(filecache_entry_t *entry,
+    struct http_response *response) {
+  http_response_init(response, 200, entry->content_type);
+  strcpy(response->etag, entry->etag);
+  response->last_modified = entry->mtime.tv_sec;
+  response->headers = entry->headers;
+  response->headers_length = entry->headers_length;
+  response->body = entry->body;
+  response->body_length = entry->body_length;
+  response->body_fd = entry->map_fd;
+  if (entry->fd != -1) {
+    response->file_fd = entry->fd;
+    response->file_length = entry->size;
+  }
+  response->release = filecache_release;
+  response->release_arg = entry;
+}
+
+/*
+ * Sets the cache budget to MAX_BYTES of file contents and about MAX_FDS open
+ * files (0 and 0 disable the cache). Entries older than REVALIDATE_SECONDS
+ * are checked against the file with a stat before they are served; 0 never
+ * checks. Files of up to MAP_MAX bytes are mapped rather than copied into
+ * memory; 0 copies them all.
+ */
+void filecache_init(size_t max_bytes, int max_fds, int revalidate_seconds, size_t map_max) {
+  for (int i = 0; i < FILECACHE_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].mutex, NULL);
+  }
+  shard_max_bytes = max_bytes / FILECACHE_SHARDS;
+  shard_max_fds = (max_fds + FILECACHE_SHARDS - 1) / FILECACHE_SHARDS;
+  revalidate_interval = revalidate_seconds;
+  map_max_size = map_max;
+}
+
+int filecache_enabled() {
+  return shard_max_bytes > 0 || shard_max_fds > 0;
+}
+
+/*
+ * Fills in RESPONSE from the entry cached under KEY. Returns 1 on a hit, or 0
+ * if there is no valid entry.
+ */
+int filecache_lookup(char *key, struct http_response *response) {
+  if (!filecache_enabled()) return 0;
+
+  unsigned long hash = filecache_hash(key);
+  filecache_shard_t *shard = filecache_shard(hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  filecache_entry_t *entry = filecache_find(shard, key, hash);
+  if (entry == NULL) {
+    pthread_mutex_unlock(&shard->mutex);
+    return 0;
+  }
+  __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+  DL_DELETE(shard->lru, entry);
+  DL_APPEND(shard->lru, entry);
+  time_t now = monotonic_seconds();
+  int revalidate = revalidate_interval > 0
+      && now - entry->validated >= revalidate_interval;
+  pthread_mutex_unlock(&shard->mutex);
+
+  if (revalidate) {
+    /* The stat runs without the shard lock held. */
+    int valid = filecache_still_valid(entry);
+
+    pthread_mutex_lock(&shard->mutex);
+    if (valid) {
+      entry->validated = now;
+    } else if (filecache_find(shard, key, hash) == entry) {
+      filecache_remove(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (!valid) {
+      filecache_release(entry);
+      return 0;
+    }
+  }
+
+  filecache_fill_response(entry, response);
+  return 1;
+}
+
+/* Reads all SIZE bytes of FD into a new buffer. Returns NULL on failure. */
+static char *filecache_read(int fd, size_t size) {
+  char *body = malloc(size > 0 ? size : 1);
+  if (body == NULL) return NULL;
+
+  size_t read_total = 0;
+  while (read_total < size) {
+    ssize_t bytes_read = pread(fd, body + read_total, size - read_total,
+        read_total);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) break;
+    read_total += bytes_read;
+  }
+  if (read_total != size) {
+    free(body);
+    return NULL;
+  }
+  return body;
+}
+
+/* Maps all SIZE bytes of FD, shared with the page cache, and starts reading
+ * in whatever of it is not there yet. Returns NULL on failure.
+ *
+ * Unlike a copy, a mapping follows the file: until revalidation drops the
+ * entry, a rewritten file is served as it is now, and reading past the end
+ * of a truncated one raises SIGBUS. Sends only fail, and multi-range
+ * responses copy from a duplicate of FD kept with the mapping, so a mapped
+ * entry also holds a descriptor. That is why mapping is opt-in. */
+static char *filecache_map(int fd, size_t size) {
+  if (size == 0) return NULL;
+  char *body = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (body == MAP_FAILED) return NULL;
+  madvise(body, size, MADV_WILLNEED);
+  return body;
+}
+
+/*
+ * Adds the regular file open on FD (PATH, described by STATBUF) to the cache
+ * under KEY, and fills in RESPONSE from the new entry. Small files are read
+ * into memory, or mapped if they are no larger than the map limit, so hits
+ * need no syscall besides the send. Larger ones keep a duplicate of FD, so
+ * later hits go straight to sendfile. Returns 0 without touching RESPONSE if
+ * the file cannot be cached. FD is left open either way.
+ */
+int filecache_add(char *key, char *path, int fd, struct stat *statbuf,
+    char *content_type, struct http_response *response) {
+  if (!filecache_enabled()) return 0;
+
+  filecache_entry_t *entry = calloc(1, sizeof(filecache_entry_t));
+  if (entry == NULL) return 0;
+
+  /* A single file may take at most half of its shard. */
+  size_t size = statbuf->st_size;
+  entry->fd = entry->map_fd = -1;
+  if (shard_max_bytes > 0 && size <= shard_max_bytes / 2) {
+    if (size <= map_max_size) {
+      entry->body = filecache_map(fd, size);
+      if (entry->body != NULL) entry->map_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+      if (entry->body != NULL && entry->map_fd == -1) {
+        munmap(entry->body, size);
+        entry->body = NULL;
+      }
+      entry->mapped = entry->body != NULL;
+    }
+    if (entry->body == NULL) entry->body = filecache_read(fd, size);
+    entry->body_length = size;
+  } else if (shard_max_fds > 0) {
+    entry->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    /* Every send reads the file from start to end; widen its readahead. */
+    if (entry->fd != -1) posix_fadvise(entry->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  if (entry->body == NULL && entry->fd == -1) {
+    free(entry);
+    return 0;
+  }
+
+  char last_modified[64];
+  http_format_etag(entry->etag, sizeof(entry->etag), statbuf, NULL);
+  http_format_date(last_modified, sizeof(last_modified), statbuf->st_mtim.tv_sec);
+
+  /* Text is also sent gzip-encoded (see gzcache.h), so it varies by
+   * Accept-Encoding even as it is. */
+  char headers[512];
+  int headers_length = snprintf(headers, sizeof(headers),
+      "HTTP/1.1 200 %s\r\n"
+      "Content-Type: %s\r\n"
+      "%s"
+      "ETag: %s\r\n"
+      "Last-Modified: %s\r\n"
+      "Accept-Ranges: bytes\r\n"
+      "Content-Length: %zu\r\n",
+      http_get_response_message(200), content_type,
+      http_mime_type_compressible(content_type) ? "Vary: Accept-Encoding\r\n" : "",
+      entry->etag, last_modified, size);
+
+  entry->key = strdup(key);
+  entry->path = strdup(path);
+  entry->headers = strdup(headers);
+  if (entry->key == NULL || entry->path == NULL || entry->headers == NULL) {
+    entry->refcount = 1;
+    filecache_release(entry);
+    return 0;
+  }
+  entry->headers_length = headers_length;
+  entry->content_type = content_type;
+  entry->hash = filecache_hash(key);
+  entry->device = statbuf->st_dev;
+  entry->inode = statbuf->st_ino;
+  entry->size = statbuf->st_size;
+  entry->mtime = statbuf->st_mtim;
+  entry->validated = monotonic_seconds();
+  /* Open files are only charged against the fd budget. */
+  if (entry->body != NULL) {
+    /* A mapping takes whole pages. */
+    size_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    entry->cost = (entry->mapped ? (size + page_mask) & ~page_mask : size)
+        + headers_length + strlen(key) + strlen(path) + sizeof(filecache_entry_t);
+  }
+  entry->refcount = 2;
+
+  filecache_shard_t *shard = filecache_shard(entry->hash);
+  pthread_mutex_lock(&shard->mutex);
+  filecache_entry_t *existing = filecache_find(shard, key, entry->hash);
+  if (existing != NULL) filecache_remove(shard, existing);
+  filecache_make_room(shard, entry);
+  entry->hash_next = shard->buckets[entry->hash % FILECACHE_BUCKETS];
+  shard->buckets[entry->hash % FILECACHE_BUCKETS] = entry;
+  DL_APPEND(shard->lru, entry);
+  shard->bytes += entry->cost;
+  if (entry->fd != -1) shard->fds++;
+  pthread_mutex_unlock(&shard->mutex);
+
+  filecache_fill_response(entry, response);
+  return 1;
+}
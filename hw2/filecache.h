@@ -0,0 +1,23 @@
+#ifndef __FILECACHE__
+#define __FILECACHE__
+
+#include <sys/stat.h>
+
+#include "libhttp.h"
+
+/* FILECACHE keeps recently served files ready to send, together with their
+ * preformatted headers, so a hit is answered without a path lookup, stat or
+ * open. Small files are held in memory, either copied or mapped; larger ones
+ * are held open and sent with sendfile. Entries are keyed by resolved path,
+ * spread over independently locked shards, and evicted least recently used
+ * first once the cache holds more than its byte or open file budget. Entries
+ * are refcounted, so one evicted while it is still being sent stays alive,
+ * and its file open or mapped, until that send finishes. */
+
+void filecache_init(size_t max_bytes, int max_fds, int revalidate_seconds, size_t map_max);
+int filecache_enabled();
+int filecache_lookup(char *key, struct http_response *response);
+int filecache_add(char *key, char *path, int fd, struct stat *statbuf,
+    char *content_type, struct http_response *response);
+
+#endif
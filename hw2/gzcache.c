@@ -0,0 +1,368 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "gzcache.h"
+#include "utlist.h"
+
+#define GZCACHE_SHARDS 16
+#define GZCACHE_BUCKETS 256
+
+typedef struct gzcache_entry {
+  char *key;                    /* Path of the uncompressed file. */
+  char *path;                   /* File the entry was made from. */
+  unsigned long hash;
+
+  /* Identity of PATH when it was read, checked on revalidation. */
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  struct timespec mtime;
+  time_t validated;
+
+  char etag[48];
+  char *headers;
+  size_t headers_length;
+  char *body;                   /* Gzip data, or NULL if not worth it. */
+  size_t body_length;
+  size_t cost;                  /* Bytes charged against the budget. */
+
+  /* One reference is held by the cache, one by every response in flight. */
+  int refcount;
+
+  struct gzcache_entry *hash_next;
+  struct gzcache_entry *prev;   /* LRU list, least recently used first. */
+  struct gzcache_entry *next;
+} gzcache_entry_t;
+
+typedef struct gzcache_shard {
+  pthread_mutex_t mutex;
+  gzcache_entry_t *buckets[GZCACHE_BUCKETS];
+  gzcache_entry_t *lru;
+  size_t bytes;
+} __attribute__((aligned(64))) gzcache_shard_t;
+
+static gzcache_shard_t shards[GZCACHE_SHARDS];
+static size_t shard_max_bytes = 0;
+static int compression_level = 0;
+static int revalidate_interval = 0;
+
+static unsigned long gzcache_hash(char *key) {
+  /* FNV-1a */
+  unsigned long hash = 14695981039346656037UL;
+  for (; *key != '\0'; key++) {
+    hash ^= (unsigned char) *key;
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+static gzcache_shard_t *gzcache_shard(unsigned long hash) {
+  return &shards[(hash >> 32) % GZCACHE_SHARDS];
+}
+
+static time_t monotonic_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+static void gzcache_release(void *arg) {
+  gzcache_entry_t *entry = arg;
+  if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
+  free(entry->key);
+  free(entry->path);
+  free(entry->headers);
+  free(entry->body);
+  free(entry);
+}
+
+/* Unlinks ENTRY from SHARD and drops the cache's reference to it. The
+ * shard's mutex must be held. */
+static void gzcache_remove(gzcache_shard_t *shard, gzcache_entry_t *entry) {
+  gzcache_entry_t **link = &shard->buckets[entry->hash % GZCACHE_BUCKETS];
+  while (*link != entry) link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  DL_DELETE(shard->lru, entry);
+  shard->bytes -= entry->cost;
+  gzcache_release(entry);
+}
+
+static gzcache_entry_t *gzcache_find(gzcache_shard_t *shard, char *key,
+    unsigned long hash) {
+  gzcache_entry_t *entry = shard->buckets[hash % GZCACHE_BUCKETS];
+  while (entry != NULL && (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+    entry = entry->hash_next;
+  }
+  return entry;
+}
+
+/* Returns 1 if ENTRY still matches the file on disk. */
+static int gzcache_still_valid(gzcache_entry_t *entry) {
+  struct stat statbuf;
+  if (stat(entry->path, &statbuf) != 0) return 0;
+  return statbuf.st_dev == entry->device && statbuf.st_ino == entry->inode
+      && statbuf.st_size == entry->size
+      && statbuf.st_mtim.tv_sec == entry->mtime.tv_sec
+      && statbuf.st_mtim.tv_nsec == entry->mtime.tv_nsec;
+}
+
+/* Fills in RESPONSE from ENTRY, handing over the caller's reference. */
+static void gzcache_fill_response(gzcache_entry_t *entry,
+    struct http_response *response) {
+  http_response_init(response, 200, NULL);
+  response->content_encoding = "gzip";
+  strcpy(response->etag, entry->etag);
+  response->last_modified = entry->mtime.tv_sec;
+  response->headers = entry->headers;
+  response->headers_length = entry->headers_length;
+  response->body = entry->body;
+  response->body_length = entry->body_length;
+  response->release = gzcache_release;
+  response->release_arg = entry;
+}
+
+/* Reads all SIZE bytes of FD into a new buffer. Returns NULL on failure. */
+static char *gzcache_read(int fd, size_t size) {
+  char *data = malloc(size > 0 ? size : 1);
+  if (data == NULL) return NULL;
+
+  size_t read_total = 0;
+  while (read_total < size) {
+    ssize_t bytes_read = pread(fd, data + read_total, size - read_total, read_total);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) break;
+    read_total += bytes_read;
+  }
+  if (read_total != size) {
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+/*
+ * Compresses the SIZE bytes of DATA into a new gzip buffer, storing its
+ * length in *LENGTH. Returns NULL if that fails or would not save anything.
+ */
+static char *gzcache_compress(char *data, size_t size, size_t *length) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  /* 15 window bits, plus 16 for a gzip header instead of a zlib one. */
+  if (deflateInit2(&stream, compression_level, Z_DEFLATED, 15 + 16, 8,
+        Z_DEFAULT_STRATEGY) != Z_OK) {
+    return NULL;
+  }
+
+  size_t bound = deflateBound(&stream, size);
+  char *compressed = malloc(bound);
+  if (compressed == NULL) {
+    deflateEnd(&stream);
+    return NULL;
+  }
+  stream.next_in = (Bytef *) data;
+  stream.avail_in = size;
+  stream.next_out = (Bytef *) compressed;
+  stream.avail_out = bound;
+  int status = deflate(&stream, Z_FINISH);
+  *length = stream.total_out;
+  deflateEnd(&stream);
+
+  if (status != Z_STREAM_END || *length >= size) {
+    free(compressed);
+    return NULL;
+  }
+  char *shrunk = realloc(compressed, *length);
+  return shrunk != NULL ? shrunk : compressed;
+}
+
+/* Inserts ENTRY into the cache under its key, unless it is too large. */
+static void gzcache_insert(gzcache_entry_t *entry) {
+  if (entry->cost > shard_max_bytes / 2) return;
+  entry->refcount++;
+
+  gzcache_shard_t *shard = gzcache_shard(entry->hash);
+  pthread_mutex_lock(&shard->mutex);
+  gzcache_entry_t *existing = gzcache_find(shard, entry->key, entry->hash);
+  if (existing != NULL) gzcache_remove(shard, existing);
+  while (shard->lru != NULL && shard->bytes + entry->cost > shard_max_bytes) {
+    gzcache_remove(shard, shard->lru);
+  }
+  entry->hash_next = shard->buckets[entry->hash % GZCACHE_BUCKETS];
+  shard->buckets[entry->hash % GZCACHE_BUCKETS] = entry;
+  DL_APPEND(shard->lru, entry);
+  shard->bytes += entry->cost;
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+/*
+ * Sets the cache budget to MAX_BYTES of compressed data, and compresses at
+ * zlib LEVEL (1 to 9). With a budget or level of 0, nothing is compressed on
+ * the fly and only precompressed siblings are served. Entries older than
+ * REVALIDATE_SECONDS are checked against their file before they are served;
+ * 0 never checks.
+ */
+void gzcache_init(size_t max_bytes, int level, int revalidate_seconds) {
+  for (int i = 0; i < GZCACHE_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].mutex, NULL);
+  }
+  shard_max_bytes = max_bytes / GZCACHE_SHARDS;
+  compression_level = level;
+  revalidate_interval = revalidate_seconds;
+}
+
+/*
+ * Fills in RESPONSE with the gzip copy cached under KEY. Returns GZCACHE_HIT,
+ * GZCACHE_MISS, or GZCACHE_IDENTITY if the file is known not to compress, in
+ * which case RESPONSE is left alone.
+ */
+int gzcache_lookup(char *key, struct http_response *response) {
+  if (shard_max_bytes == 0) return GZCACHE_MISS;
+
+  unsigned long hash = gzcache_hash(key);
+  gzcache_shard_t *shard = gzcache_shard(hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  gzcache_entry_t *entry = gzcache_find(shard, key, hash);
+  if (entry == NULL) {
+    pthread_mutex_unlock(&shard->mutex);
+    return GZCACHE_MISS;
+  }
+  __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+  DL_DELETE(shard->lru, entry);
+  DL_APPEND(shard->lru, entry);
+  time_t now = monotonic_seconds();
+  int revalidate = revalidate_interval > 0
+      && now - entry->validated >= revalidate_interval;
+  pthread_mutex_unlock(&shard->mutex);
+
+  if (revalidate) {
+    /* The stat runs without the shard lock held. */
+    int valid = gzcache_still_valid(entry);
+
+    pthread_mutex_lock(&shard->mutex);
+    if (valid) {
+      entry->validated = now;
+    } else if (gzcache_find(shard, key, hash) == entry) {
+      gzcache_remove(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (!valid) {
+      gzcache_release(entry);
+      return GZCACHE_MISS;
+    }
+  }
+
+  if (entry->body == NULL) {
+    gzcache_release(entry);
+    return GZCACHE_IDENTITY;
+  }
+  gzcache_fill_response(entry, response);
+  return GZCACHE_HIT;
+}
+
+/*
+ * Fills in RESPONSE with a gzip copy of the regular file open on FD (PATH,
+ * described by STATBUF), cached under KEY: its PATH.gz sibling if there is
+ * one, or else the file compressed now. Returns 1 if RESPONSE was filled in,
+ * or 0 if the file should be sent as it is. FD is left open either way.
+ */
+int gzcache_add(char *key, char *path, int fd, struct stat *statbuf,
+    char *content_type, struct http_response *response) {
+  gzcache_entry_t *entry = calloc(1, sizeof(gzcache_entry_t));
+  if (entry == NULL) return 0;
+  entry->refcount = 1;
+
+  char sibling[PATH_MAX];
+  int sibling_fd = -1;
+  struct stat sibling_statbuf;
+  if (snprintf(sibling, sizeof(sibling), "%s.gz", path) < (int) sizeof(sibling)) {
+    sibling_fd = open(sibling, O_RDONLY | O_CLOEXEC);
+  }
+  if (sibling_fd != -1 && (fstat(sibling_fd, &sibling_statbuf) != 0
+        || !S_ISREG(sibling_statbuf.st_mode))) {
+    close(sibling_fd);
+    sibling_fd = -1;
+  }
+
+  if (sibling_fd != -1) {
+    entry->path = strdup(sibling);
+    statbuf = &sibling_statbuf;
+    if ((size_t) statbuf->st_size <= shard_max_bytes / 2) {
+      entry->body = gzcache_read(sibling_fd, statbuf->st_size);
+      entry->body_length = statbuf->st_size;
+    }
+    if (entry->body == NULL) {
+      // Too large to hold, or unreadable: send the sibling from disk
+      free(entry->path);
+      free(entry);
+      http_response_init(response, 200, content_type);
+      response->content_encoding = "gzip";
+      http_response_set_validators(response, &sibling_statbuf, "-gzip");
+      response->file_fd = sibling_fd;
+      response->file_length = sibling_statbuf.st_size;
+      return 1;
+    }
+    close(sibling_fd);
+  } else {
+    // Only compress files that fit in the cache, so each is compressed once
+    entry->path = strdup(path);
+    if (compression_level > 0 && (size_t) statbuf->st_size <= shard_max_bytes / 2) {
+      char *data = gzcache_read(fd, statbuf->st_size);
+      if (data != NULL) {
+        entry->body = gzcache_compress(data, statbuf->st_size, &entry->body_length);
+        free(data);
+      }
+    }
+  }
+
+  /* The gzip copy is a different representation, so it gets its own ETag. */
+  char last_modified[64];
+  http_format_etag(entry->etag, sizeof(entry->etag), statbuf, "-gzip");
+  http_format_date(last_modified, sizeof(last_modified), statbuf->st_mtim.tv_sec);
+
+  char headers[512];
+  int headers_length = snprintf(headers, sizeof(headers),
+      "HTTP/1.1 200 %s\r\n"
+      "Content-Type: %s\r\n"
+      "Content-Encoding: gzip\r\n"
+      "Vary: Accept-Encoding\r\n"
+      "ETag: %s\r\n"
+      "Last-Modified: %s\r\n"
+      "Content-Length: %zu\r\n",
+      http_get_response_message(200), content_type, entry->etag, last_modified,
+      entry->body_length);
+
+  entry->key = strdup(key);
+  entry->headers = strdup(headers);
+  entry->headers_length = headers_length;
+  entry->hash = gzcache_hash(key);
+  entry->device = statbuf->st_dev;
+  entry->inode = statbuf->st_ino;
+  entry->size = statbuf->st_size;
+  entry->mtime = statbuf->st_mtim;
+  entry->validated = monotonic_seconds();
+  entry->cost = entry->body_length + headers_length + strlen(key)
+      + strlen(entry->path) + sizeof(gzcache_entry_t);
+
+  if (entry->key != NULL && entry->path != NULL && entry->headers != NULL) {
+    gzcache_insert(entry);
+  }
+  if (entry->body == NULL || entry->headers == NULL) {
+    // Sent uncompressed; if cached, the entry remembers that
+    gzcache_release(entry);
+    return 0;
+  }
+  gzcache_fill_response(entry, response);
+  return 1;
+}
@@ -0,0 +1,29 @@
+#ifndef __GZCACHE__
+#define __GZCACHE__
+
+#include <sys/stat.h>
+
+#include "libhttp.h"
+
+/* GZCACHE holds gzip-encoded copies of text files for clients that accept
+ * them. A file with a precompressed sibling (index.html.gz next to
+ * index.html) is served from that; any other file is compressed with zlib
+ * once, and the result is kept. Files that do not get smaller are remembered
+ * too, so they are not compressed again.
+ *
+ * Entries are keyed by the path of the uncompressed file and remember the
+ * inode, size and mtime of the file they were made from, so a changed file is
+ * compressed again once revalidated. Like FILECACHE, entries are spread over
+ * independently locked shards, refcounted while they are being sent, and
+ * evicted least recently used first beyond a byte budget. */
+
+#define GZCACHE_MISS 0
+#define GZCACHE_HIT 1
+#define GZCACHE_IDENTITY -1     /* Known not to be worth compressing. */
+
+void gzcache_init(size_t max_bytes, int level, int revalidate_seconds);
+int gzcache_lookup(char *key, struct http_response *response);
+int gzcache_add(char *key, char *path, int fd, struct stat *statbuf,
+    char *content_type, struct http_response *response);
+
+#endif
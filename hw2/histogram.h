@@ -0,0 +1,56 @@
+#ifndef __HISTOGRAM__
+#define __HISTOGRAM__
+
+#include <stdint.h>
+
+/* HISTOGRAM is a log-linear (HDR-style) histogram of durations in
+ * nanoseconds. Values below HISTOGRAM_SUB_BUCKETS get a bucket each; above,
+ * every power of two is split into HISTOGRAM_SUB_BUCKETS equal buckets, so
+ * any recorded value is known within 1/16 while the whole range from 1 ns to
+ * 2^40 ns (18 minutes) fits in under 600 buckets. Shared by METRICS and
+ * httpbench. */
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_EXPONENT 40     // Longer durations land in the last bucket.
+#define HISTOGRAM_BUCKETS \
+    ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+/* Returns the bucket of VALUE. */
+static inline int histogram_bucket(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS) return value;
+  int exponent = 63 - __builtin_clzll(value);
+  if (exponent >= HISTOGRAM_MAX_EXPONENT) return HISTOGRAM_BUCKETS - 1;
+  return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+      + ((value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* Returns the smallest value past bucket INDEX. */
+static inline uint64_t histogram_bucket_limit(int index) {
+  if (index < HISTOGRAM_SUB_BUCKETS) return index + 1;
+  int exponent = index / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+  uint64_t width = (uint64_t) 1 << (exponent - HISTOGRAM_SUB_BITS);
+  return (HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) * width + width;
+}
+
+/* Returns the value under which a fraction QUANTILE of HISTOGRAM falls,
+ * rounded up to the end of its bucket, or 0 if it is empty. */
+static inline uint64_t histogram_quantile(histogram_t *histogram, double quantile) {
+  if (histogram->count == 0) return 0;
+  uint64_t rank = quantile * histogram->count;
+  if (rank < quantile * histogram->count || rank == 0) rank++;
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank) return histogram_bucket_limit(i);
+  }
+  return histogram_bucket_limit(HISTOGRAM_BUCKETS - 1);
+}
+
+#endif
@@ -0,0 +1,684 @@
+/*
+ * httpbench: a load generator for httpserver.
+ *
+ * Every thread drives its share of the connections from one epoll loop. In
+ * closed-loop mode (the default) each connection sends its next request as
+ * soon as the previous response is in. In open-loop mode (--rate) requests
+ * fall due at fixed intervals whether or not the server keeps up, and their
+ * latency is counted from when they were due, not from when they could be
+ * sent, so a server that stalls is charged for every request it held up
+ * (coordinated omission). Closed-loop latencies are also reported corrected
+ * after the fact, the way HdrHistogram does it.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <ftw.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "libhttp.h"
+
+#define BENCH_MAX_EVENTS 256
+#define BENCH_READ_SIZE 65536
+
+/* How long a closed-loop connection waits after an error before it tries
+ * again, so a server that is down is not hammered with connects. */
+#define BENCH_ERROR_BACKOFF 10000000
+
+/*
+ * Global configuration variables, set up in main() from the command line.
+ */
+char *bench_host = "127.0.0.1";
+char *bench_port = "8000";
+int bench_threads = 2;
+int bench_connections = 32;
+double bench_duration = 10;
+double bench_warmup = 0;
+double bench_rate = 0;            // Requests per second in total; 0 = closed loop.
+int bench_keep_alive = 1;
+
+struct sockaddr_storage bench_address;
+socklen_t bench_address_length;
+
+/* The request mix: one preformatted request per path, picked uniformly. */
+char **bench_paths;
+char **bench_requests;
+size_t *bench_request_lengths;
+int bench_num_paths = 0;
+int bench_max_paths = 0;
+
+enum bench_state {
+  BENCH_DISCONNECTED,     // No socket; waiting for the next request.
+  BENCH_IDLE,             // Open keep-alive socket; waiting for the next request.
+  BENCH_CONNECTING,
+  BENCH_WRITING,
+  BENCH_READING,
+};
+
+typedef struct bench_thread bench_thread_t;
+
+typedef struct bench_conn {
+  bench_thread_t *thread;
+  int fd;
+  enum bench_state state;
+  int reused;                   // The socket already carried a response.
+  int request;                  // Index of the path being requested.
+  size_t written;
+  uint64_t due;                 // When the current request was due.
+  uint64_t next_due;            // When the next one is.
+
+  struct http_response_head head;
+  ssize_t head_length;          // 0 until the whole head is in.
+  size_t head_buffered;
+  size_t body_left;             // Content-Length bytes still to come.
+  struct http_chunked chunked;
+  size_t received;              // Bytes of the current response.
+  char head_buffer[LIBHTTP_REQUEST_MAX_SIZE];
+} bench_conn_t;
+
+struct bench_thread {
+  pthread_t thread;
+  int epoll_fd;
+  int timer_fd;
+  int num_conns;
+  bench_conn_t *conns;
+  uint64_t random;
+  uint64_t record_from;         // Responses before this are warmup.
+  uint64_t end;
+  uint64_t interval;            // Open loop: time between requests per connection.
+  char buffer[BENCH_READ_SIZE];
+
+  /* Results. */
+  histogram_t latency;
+  uint64_t max_latency;
+  uint64_t responses[6];        // By status class, 1xx to 5xx.
+  uint64_t errors;
+  uint64_t bytes;
+};
+
+static uint64_t bench_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Returns a pseudo-random number from THREAD's xorshift64* generator. */
+static uint64_t bench_random(bench_thread_t *thread) {
+  thread->random ^= thread->random >> 12;
+  thread->random ^= thread->random << 25;
+  thread->random ^= thread->random >> 27;
+  return thread->random * 2685821657736338717ULL;
+}
+
+static void bench_close(bench_conn_t *conn) {
+  if (conn->fd != -1) close(conn->fd);
+  conn->fd = -1;
+  conn->state = BENCH_DISCONNECTED;
+}
+
+/* Gives up on CONN's request and schedules its next one. */
+static void bench_fail(bench_conn_t *conn) {
+  bench_thread_t *thread = conn->thread;
+  uint64_t now = bench_now();
+  if (now >= thread->record_from) thread->errors++;
+  bench_close(conn);
+  if (thread->interval == 0) conn->next_due = now + BENCH_ERROR_BACKOFF;
+}
+
+/* Records the response CONN just finished reading. */
+static void bench_done(bench_conn_t *conn) {
+  bench_thread_t *thread = conn->thread;
+  uint64_t now = bench_now();
+  if (now >= thread->record_from) {
+    uint64_t latency = now - conn->due;
+    thread->latency.count++;
+    thread->latency.sum += latency;
+    thread->latency.buckets[histogram_bucket(latency)]++;
+    if (latency > thread->max_latency) thread->max_latency = latency;
+    int class = conn->head.status_code / 100;
+    thread->responses[class >= 1 && class <= 5 ? class : 0]++;
+    thread->bytes += conn->received;
+  }
+
+  if (bench_keep_alive && conn->head.keep_alive) {
+    conn->state = BENCH_IDLE;
+  } else {
+    bench_close(conn);
+  }
+  if (thread->interval == 0) conn->next_due = now;
+}
+
+/* Feeds LENGTH bytes of body to CONN. Returns 1 once the response is
+ * complete, 0 if more is to come, or -1 if the bytes make no sense. */
+static int bench_body(bench_conn_t *conn, char *data, size_t length) {
+  if (conn->head.chunked) {
+    ssize_t used = http_chunked_scan(&conn->chunked, data, length);
+    if (used < 0) return -1;
+    if (!http_chunked_done(&conn->chunked)) return 0;
+    return (size_t) used == length ? 1 : -1;
+  }
+  if (conn->head.content_length < 0) return 0;    // Ends when the server closes.
+  if (length > conn->body_left) return -1;
+  conn->body_left -= length;
+  return conn->body_left == 0;
+}
+
+/* Feeds LENGTH bytes read from CONN's socket to its response. Returns as
+ * bench_body does. */
+static int bench_consume(bench_conn_t *conn, char *data, size_t length) {
+  conn->received += length;
+  if (conn->head_length > 0) return bench_body(conn, data, length);
+
+  size_t space = sizeof(conn->head_buffer) - conn->head_buffered;
+  size_t copied = length < space ? length : space;
+  memcpy(conn->head_buffer + conn->head_buffered, data, copied);
+  conn->head_buffered += copied;
+
+  ssize_t head_length = http_response_head_parse(conn->head_buffer,
+      conn->head_buffered, &conn->head);
+  if (head_length == HTTP_PARSE_ERROR) return -1;
+  if (head_length == HTTP_PARSE_INCOMPLETE) return copied < length ? -1 : 0;
+  conn->head_length = head_length;
+
+  int status = conn->head.status_code;
+  if (status == 204 || status == 304) {
+    conn->head.chunked = 0;
+    conn->head.content_length = 0;
+  }
+  conn->body_left = conn->head.content_length > 0 ? conn->head.content_length : 0;
+  http_chunked_init(&conn->chunked);
+
+  /* The rest of what was read is body. */
+  size_t body = conn->head_buffered - head_length + (length - copied);
+  if (body == 0) {
+    if (conn->head.chunked || conn->head.content_length != 0) return 0;
+    return 1;
+  }
+  int result = bench_body(conn, conn->head_buffer + head_length,
+      conn->head_buffered - head_length);
+  if (result == 0 && copied < length) result = bench_body(conn, data + copied, length - copied);
+  return result;
+}
+
+static void bench_read(bench_conn_t *conn) {
+  bench_thread_t *thread = conn->thread;
+  while (1) {
+    ssize_t bytes_read = recv(conn->fd, thread->buffer, sizeof(thread->buffer), 0);
+    if (bytes_read < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) bench_fail(conn);
+      return;
+    }
+    if (bytes_read == 0) {
+      if (conn->head_length > 0 && !conn->head.chunked && conn->head.content_length < 0) {
+        conn->head.keep_alive = 0;
+        bench_done(conn);
+      } else if (conn->reused && conn->received == 0) {
+        /* The server closed an idle keep-alive connection just as the
+         * request went out; send it again on a new one. */
+        bench_close(conn);
+        conn->next_due = conn->due;
+      } else {
+        bench_fail(conn);
+      }
+      return;
+    }
+
+    int result = bench_consume(conn, thread->buffer, bytes_read);
+    if (result < 0) {
+      bench_fail(conn);
+      return;
+    }
+    if (result > 0) {
+      bench_done(conn);
+      return;
+    }
+  }
+}
+
+static void bench_write(bench_conn_t *conn) {
+  char *request = bench_requests[conn->request];
+  size_t length = bench_request_lengths[conn->request];
+  while (conn->written < length) {
+    ssize_t bytes_sent = send(conn->fd, request + conn->written,
+        length - conn->written, MSG_NOSIGNAL);
+    if (bytes_sent < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) bench_fail(conn);
+      return;
+    }
+    conn->written += bytes_sent;
+  }
+  conn->state = BENCH_READING;
+  bench_read(conn);
+}
+
+/* Opens a new socket for CONN. Returns 0, or -1 if that fails at once. */
+static int bench_connect(bench_conn_t *conn) {
+  conn->fd = socket(bench_address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (conn->fd == -1) return -1;
+  int one = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = conn;
+  if (epoll_ctl(conn->thread->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) return -1;
+
+  conn->reused = 0;
+  if (connect(conn->fd, (struct sockaddr *) &bench_address, bench_address_length) == 0) {
+    conn->state = BENCH_WRITING;
+  } else if (errno == EINPROGRESS) {
+    conn->state = BENCH_CONNECTING;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+/* Starts CONN's next request, due at DUE. */
+static void bench_start(bench_conn_t *conn, uint64_t due) {
+  bench_thread_t *thread = conn->thread;
+  conn->due = due;
+  conn->next_due = thread->interval > 0 ? due + thread->interval : UINT64_MAX;
+  conn->request = bench_num_paths > 1 ? bench_random(thread) % bench_num_paths : 0;
+  conn->written = 0;
+  conn->head_length = 0;
+  conn->head_buffered = 0;
+  conn->received = 0;
+
+  if (conn->state == BENCH_IDLE) {
+    conn->reused = 1;
+    conn->state = BENCH_WRITING;
+  } else if (bench_connect(conn) == -1) {
+    bench_fail(conn);
+    return;
+  }
+  if (conn->state == BENCH_WRITING) bench_write(conn);
+}
+
+/* Handles EVENTS reported for CONN's socket. */
+static void bench_event(bench_conn_t *conn, uint32_t events) {
+  if (conn->state == BENCH_CONNECTING) {
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) {
+      bench_fail(conn);
+      return;
+    }
+    conn->state = BENCH_WRITING;
+  }
+
+  switch (conn->state) {
+    case BENCH_WRITING:
+      bench_write(conn);
+      break;
+    case BENCH_READING:
+      bench_read(conn);
+      break;
+    case BENCH_IDLE:
+      /* The server closed a connection that was waiting for its next request. */
+      if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) bench_close(conn);
+      break;
+    default:
+      break;
+  }
+}
+
+/* Starts every request that is due, and sets the timer for the next one.
+ * Returns the time of the next one, or UINT64_MAX if none is waiting. */
+static uint64_t bench_schedule(bench_thread_t *thread) {
+  uint64_t now = bench_now();
+  uint64_t next = UINT64_MAX;
+  for (int i = 0; i < thread->num_conns; i++) {
+    bench_conn_t *conn = &thread->conns[i];
+    if (conn->state != BENCH_DISCONNECTED && conn->state != BENCH_IDLE) continue;
+    if (conn->next_due <= now) {
+      /* A closed-loop request is due when it is sent. */
+      bench_start(conn, thread->interval > 0 ? conn->next_due : now);
+    }
+    if ((conn->state == BENCH_DISCONNECTED || conn->state == BENCH_IDLE)
+        && conn->next_due < next) {
+      next = conn->next_due;
+    }
+  }
+
+  struct itimerspec timer;
+  memset(&timer, 0, sizeof(timer));
+  if (next != UINT64_MAX) {
+    if (next <= now) next = now + 1;
+    timer.it_value.tv_sec = next / 1000000000;
+    timer.it_value.tv_nsec = next % 1000000000;
+  }
+  timerfd_settime(thread->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+  return next;
+}
+
+static void *bench_thread_func(void *arg) {
+  bench_thread_t *thread = arg;
+
+  thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  thread->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (thread->epoll_fd == -1 || thread->timer_fd == -1) {
+    perror("Failed to create epoll instance or timer");
+    exit(errno);
+  }
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->timer_fd, &event) == -1) {
+    perror("Failed to add timer to epoll");
+    exit(errno);
+  }
+
+  /* Open-loop connections start spread over one interval. */
+  uint64_t start = bench_now();
+  for (int i = 0; i < thread->num_conns; i++) {
+    bench_conn_t *conn = &thread->conns[i];
+    conn->thread = thread;
+    conn->fd = -1;
+    conn->state = BENCH_DISCONNECTED;
+    conn->next_due = start + thread->interval * i / thread->num_conns;
+  }
+
+  struct epoll_event events[BENCH_MAX_EVENTS];
+  while (bench_now() < thread->end) {
+    bench_schedule(thread);
+    uint64_t now = bench_now();
+    int timeout = now < thread->end ? (thread->end - now) / 1000000 + 1 : 0;
+    int num_events = epoll_wait(thread->epoll_fd, events, BENCH_MAX_EVENTS, timeout);
+    if (num_events < 0) {
+      if (errno == EINTR) continue;
+      perror("Failed to wait for events");
+      exit(errno);
+    }
+
+    for (int i = 0; i < num_events; i++) {
+      if (events[i].data.ptr == NULL) {
+        uint64_t expirations;
+        if (read(thread->timer_fd, &expirations, sizeof(expirations)) < 0) continue;
+      } else {
+        bench_event(events[i].data.ptr, events[i].events);
+      }
+    }
+  }
+
+  for (int i = 0; i < thread->num_conns; i++) bench_close(&thread->conns[i]);
+  close(thread->timer_fd);
+  close(thread->epoll_fd);
+  return NULL;
+}
+
+/* Adds the request for PATH to the mix. */
+static void bench_add_path(const char *path) {
+  if (bench_num_paths == bench_max_paths) {
+    bench_max_paths = bench_max_paths ? bench_max_paths * 2 : 16;
+    bench_paths = realloc(bench_paths, bench_max_paths * sizeof(char *));
+    bench_requests = realloc(bench_requests, bench_max_paths * sizeof(char *));
+    bench_request_lengths = realloc(bench_request_lengths, bench_max_paths * sizeof(size_t));
+    if (!bench_paths || !bench_requests || !bench_request_lengths) {
+      fprintf(stderr, "Failed to allocate request mix\n");
+      exit(ENOMEM);
+    }
+  }
+
+  char *request;
+  int length = asprintf(&request,
+      "GET %s HTTP/1.1\r\n"
+      "Host: %s:%s\r\n"
+      "User-Agent: httpbench\r\n"
+      "%s"
+      "\r\n",
+      path, bench_host, bench_port, bench_keep_alive ? "" : "Connection: close\r\n");
+  if (length < 0) {
+    fprintf(stderr, "Failed to allocate request mix\n");
+    exit(ENOMEM);
+  }
+  bench_paths[bench_num_paths] = strdup(path);
+  bench_requests[bench_num_paths] = request;
+  bench_request_lengths[bench_num_paths] = length;
+  bench_num_paths++;
+}
+
+static size_t bench_files_root_length;
+
+/* Adds every file and directory under the --files root, as the server would
+ * see its path. Names that would need escaping in a URL are skipped. */
+static int bench_add_file(const char *name, const struct stat *statbuf, int type,
+    struct FTW *ftw) {
+  if (type != FTW_F && type != FTW_D) return 0;
+  const char *path = name + bench_files_root_length;
+  if (strspn(path, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+        "0123456789/-._~") != strlen(path)) {
+    return 0;
+  }
+  bench_add_path(*path == '\0' ? "/" : path);
+  return 0;
+}
+
+/*
+ * Returns the durations (nanoseconds) of MEASURED, plus the ones requests that
+ * could not be sent while a slow one was outstanding would have seen: for a
+ * response taking longer than INTERVAL, one more at each INTERVAL less down
+ * to INTERVAL, as HdrHistogram's coordinated omission correction does.
+ */
+static void bench_correct(histogram_t *measured, uint64_t interval, histogram_t *corrected) {
+  *corrected = *measured;
+  if (interval == 0) return;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    uint64_t count = measured->buckets[i];
+    uint64_t value = histogram_bucket_limit(i) - 1;
+    if (count == 0 || value <= interval) continue;
+    for (uint64_t missing = value - interval; missing >= interval; missing -= interval) {
+      corrected->buckets[histogram_bucket(missing)] += count;
+      corrected->count += count;
+      corrected->sum += missing * count;
+    }
+  }
+}
+
+static void bench_print_latency(const char *label, histogram_t *latency, uint64_t max) {
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  printf("  %-12s", label);
+  for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+    printf(" %10.1f", histogram_quantile(latency, quantiles[i]) / 1e3);
+  }
+  printf(" %10.1f %10.1f\n",
+      latency->count ? (double) latency->sum / latency->count / 1e3 : 0, max / 1e3);
+}
+
+char *USAGE =
+  "Usage: ./httpbench [--host HOST] [--port PORT] [options]\n"
+  "\n"
+  "       --threads N            threads, each running its own epoll loop (default 2)\n"
+  "       --connections N        connections in total (default 32)\n"
+  "       --duration SECONDS     how long to measure (default 10)\n"
+  "       --warmup SECONDS       run this long before measuring (default 0)\n"
+  "       --rate N               open loop: N requests per second in total, latency counted\n"
+  "                              from when each request was due (default: closed loop)\n"
+  "       --no-keep-alive        open a new connection for every request\n"
+  "       --path PATH            add PATH to the request mix; repeat to weight a path\n"
+  "       --files DIRECTORY      add every file and directory under DIRECTORY, as served by\n"
+  "                              httpserver --files DIRECTORY (default mix: /)\n";
+
+void exit_with_usage() {
+  fprintf(stderr, "%s", USAGE);
+  exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv) {
+  signal(SIGPIPE, SIG_IGN);
+
+  char **paths = calloc(argc, sizeof(char *));
+  int num_paths = 0;
+  char *files_directory = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp("--host", argv[i]) == 0) {
+      if (++i >= argc) {
+        fprintf(stderr, "Expected argument after --host\n");
+        exit_with_usage();
+      }
+      bench_host = argv[i];
+    } else if (strcmp("--port", argv[i]) == 0) {
+      if (++i >= argc) {
+        fprintf(stderr, "Expected argument after --port\n");
+        exit_with_usage();
+      }
+      bench_port = argv[i];
+    } else if (strcmp("--threads", argv[i]) == 0) {
+      if (++i >= argc || (bench_threads = atoi(argv[i])) < 1) {
+        fprintf(stderr, "Expected positive integer after --threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--connections", argv[i]) == 0) {
+      if (++i >= argc || (bench_connections = atoi(argv[i])) < 1) {
+        fprintf(stderr, "Expected positive integer after --connections\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--duration", argv[i]) == 0) {
+      if (++i >= argc || (bench_duration = atof(argv[i])) <= 0) {
+        fprintf(stderr, "Expected positive number after --duration\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--warmup", argv[i]) == 0) {
+      if (++i >= argc || (bench_warmup = atof(argv[i])) < 0) {
+        fprintf(stderr, "Expected non-negative number after --warmup\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--rate", argv[i]) == 0) {
+      if (++i >= argc || (bench_rate = atof(argv[i])) <= 0) {
+        fprintf(stderr, "Expected positive number after --rate\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--no-keep-alive", argv[i]) == 0) {
+      bench_keep_alive = 0;
+    } else if (strcmp("--path", argv[i]) == 0) {
+      if (++i >= argc || argv[i][0] != '/') {
+        fprintf(stderr, "Expected absolute path after --path\n");
+        exit_with_usage();
+      }
+      paths[num_paths++] = argv[i];
+    } else if (strcmp("--files", argv[i]) == 0) {
+      if (++i >= argc) {
+        fprintf(stderr, "Expected argument after --files\n");
+        exit_with_usage();
+      }
+      files_directory = argv[i];
+    } else if (strcmp("--help", argv[i]) == 0) {
+      exit_with_usage();
+    } else {
+      fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
+      exit_with_usage();
+    }
+  }
+
+  struct addrinfo hints, *address;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int error = getaddrinfo(bench_host, bench_port, &hints, &address);
+  if (error != 0) {
+    fprintf(stderr, "Failed to resolve %s:%s: %s\n", bench_host, bench_port, gai_strerror(error));
+    exit(EXIT_FAILURE);
+  }
+  memcpy(&bench_address, address->ai_addr, address->ai_addrlen);
+  bench_address_length = address->ai_addrlen;
+  freeaddrinfo(address);
+
+  for (int i = 0; i < num_paths; i++) bench_add_path(paths[i]);
+  if (files_directory != NULL) {
+    bench_files_root_length = strlen(files_directory);
+    while (bench_files_root_length > 1 && files_directory[bench_files_root_length - 1] == '/') {
+      files_directory[--bench_files_root_length] = '\0';
+    }
+    if (nftw(files_directory, bench_add_file, 16, FTW_PHYS) == -1) {
+      perror("Failed to walk --files directory");
+      exit(errno);
+    }
+  }
+  if (bench_num_paths == 0) bench_add_path("/");
+
+  if (bench_threads > bench_connections) bench_threads = bench_connections;
+  bench_thread_t *threads;
+  if (posix_memalign((void **) &threads, 64, bench_threads * sizeof(bench_thread_t)) != 0) {
+    fprintf(stderr, "Failed to allocate threads\n");
+    exit(ENOMEM);
+  }
+  memset(threads, 0, bench_threads * sizeof(bench_thread_t));
+
+  printf("%s loop, %s, %d threads, %d connections, %d paths, %.0fs against %s:%s\n",
+      bench_rate > 0 ? "Open" : "Closed",
+      bench_keep_alive ? "keep-alive" : "connection per request",
+      bench_threads, bench_connections, bench_num_paths, bench_duration,
+      bench_host, bench_port);
+  fflush(stdout);
+
+  uint64_t start = bench_now();
+  uint64_t record_from = start + (uint64_t) (bench_warmup * 1e9);
+  uint64_t end = record_from + (uint64_t) (bench_duration * 1e9);
+  for (int i = 0; i < bench_threads; i++) {
+    bench_thread_t *thread = &threads[i];
+    thread->num_conns = bench_connections / bench_threads + (i < bench_connections % bench_threads);
+    thread->conns = calloc(thread->num_conns, sizeof(bench_conn_t));
+    if (thread->conns == NULL) {
+      fprintf(stderr, "Failed to allocate connections\n");
+      exit(ENOMEM);
+    }
+    thread->random = 0x9e3779b97f4a7c15ULL * (i + 1);
+    thread->record_from = record_from;
+    thread->end = end;
+    thread->interval = bench_rate > 0 ? bench_connections / bench_rate * 1e9 : 0;
+    if (pthread_create(&thread->thread, NULL, bench_thread_func, thread) != 0) {
+      perror("Failed to create thread");
+      exit(errno);
+    }
+  }
+
+  histogram_t latency;
+  memset(&latency, 0, sizeof(latency));
+  uint64_t max_latency = 0, responses[6] = { 0 }, errors = 0, bytes = 0;
+  for (int i = 0; i < bench_threads; i++) {
+    bench_thread_t *thread = &threads[i];
+    pthread_join(thread->thread, NULL);
+    latency.count += thread->latency.count;
+    latency.sum += thread->latency.sum;
+    for (int j = 0; j < HISTOGRAM_BUCKETS; j++) latency.buckets[j] += thread->latency.buckets[j];
+    if (thread->max_latency > max_latency) max_latency = thread->max_latency;
+    for (int j = 0; j < 6; j++) responses[j] += thread->responses[j];
+    errors += thread->errors;
+    bytes += thread->bytes;
+  }
+
+  printf("  Requests:  %lu in %.2fs, %.1f req/s\n", latency.count, bench_duration,
+      latency.count / bench_duration);
+  printf("  Transfer:  %.1f MB, %.1f MB/s\n", bytes / 1e6, bytes / 1e6 / bench_duration);
+  printf("  Responses: 2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu, other %lu, errors %lu\n",
+      responses[2], responses[3], responses[4], responses[5], responses[0] + responses[1],
+      errors);
+  printf("  Latency (us)        p50        p90        p99       p999       mean        max\n");
+  bench_print_latency(bench_rate > 0 ? "from due" : "measured", &latency, max_latency);
+  if (bench_rate == 0 && latency.count > 0) {
+    /* Each connection would have sent a request every mean response time. */
+    uint64_t interval = latency.sum / latency.count;
+    histogram_t corrected;
+    bench_correct(&latency, interval, &corrected);
+    bench_print_latency("corrected", &corrected, max_latency);
+  }
+  return errors > 0 && latency.count == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
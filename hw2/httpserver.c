@@ -1,12 +1,15 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
-#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,10 +17,16 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <unistd.h>
 
+#include "dircache.h"
+#include "evloop.h"
+#include "filecache.h"
+#include "gzcache.h"
 #include "libhttp.h"
-#include "wq.h"
+#include "metrics.h"
+#include "pool.h"
+#include "relay.h"
+#include "upstream.h"
 
 /*
  * Global configuration variables.
@@ -25,90 +34,121 @@
  * handle_proxy_request. Their values are set up in main() using the
  * command line arguments (already implemented for you).
  */
-wq_t work_queue;
 int num_threads = -1;
+int max_threads = -1;
+int server_queue_wait_target = 10;
+int server_thread_idle_timeout = 10;
+int server_queue_limit = 1024;
+int server_shed_policy = POOL_SHED_REJECT;
+int server_codel_target = 5;
+int server_codel_interval = 100;
+int server_queue_deadline = 0;
+int num_acceptors = 1;
+int num_relay_threads = 0;
+int server_upstream_pool = 8;
+int server_upstream_idle = 4;
+int server_dns_ttl = 30;
 int server_port;
 char *server_files_directory;
-char *server_proxy_hostname;
-int server_proxy_port;
+char *server_proxy_targets;
+int server_proxy_balance = UPSTREAM_ROUND_ROBIN;
+int server_event_loop = 0;
+int server_cache_mb = 0;
+int server_cache_fds = 256;
+int server_cache_revalidate = 1;
+int server_cache_map_kb = 0;
+int server_listing_cache = 1024;
+int server_gzip_level = 6;
+int server_gzip_cache_mb = 32;
 
+typedef void (*callback)(int);
 
 /*
- * Helper function that concatenates an arbitrary number of char arrays and
- * returns the resulting array and sets the size_t length to the result length.
+ * An acceptor owns one SO_REUSEPORT listening socket and the worker group
+ * fed by it. The acceptor and its workers are pinned to the same CPU set, so
+ * a connection is accepted and served on the cores the kernel steered it to.
  */
-char *super_strcat(size_t *length, int numStrs, ...) {
-  va_list valist;
-  
-  size_t result_len = 0;
-
-  // Init valist
-  va_start(valist, numStrs);
-
-  // Iterate through char* args
-  for (int i = 0; i < numStrs; i++) {
-    char *curStr = va_arg(valist, char*);
-    result_len += strlen(curStr);
-  }
-
-  // De-allocate memory
-  va_end(valist);
-
-  char *result = malloc(result_len + 1);
+typedef struct acceptor
+{
+    int index;
+    int server_socket;
+    pool_t pool;
+    cpu_set_t cpus;
+    callback request_handler;
+} acceptor_t;
 
-  va_start(valist, numStrs);
+acceptor_t *acceptors;
 
-  strcpy(result, va_arg(valist, char*));
 
-  for (int i = 1; i < numStrs; i++) {
-    char *curStr = va_arg(valist, char*);
-    strcat(result, curStr);
+/* Returns the page number asked for by QUERY (page=N), or 1 if none is. */
+static int files_query_page(char *query, size_t length) {
+  for (size_t i = 0; i + 5 < length; i++) {
+    if ((i == 0 || query[i - 1] == '&') && strncmp(query + i, "page=", 5) == 0) {
+      return atoi(query + i + 5);
+    }
   }
-
-  *length = result_len + 1;
-
-  return result;
+  return 1;
 }
 
-
 /*
- * Reads an HTTP request from stream (fd), and writes an HTTP response
- * containing:
+ * Fills in RESPONSE with the whole resource REQUEST names, relative to
+ * server_files_directory:
  *
  *   1) If user requested an existing file, respond with the file
  *   2) If user requested a directory and index.html exists in the directory,
  *      send the index.html file.
  *   3) If user requested a directory and index.html doesn't exist, send a list
- *      of files in the directory with links to each.
+ *      of files in the directory with links to each, page by page for very
+ *      large directories (?page=N).
  *   4) Send a 404 Not Found response.
  */
-void handle_files_request(int fd) {
-
-  /*
-   * TODO: Your solution for Task 1 goes here! Feel free to delete/modify *
-   * any existing code.
-   */
+static void files_prepare_whole_response(struct http_request *request,
+    struct http_response *response) {
+
+  /* Paths are built on the stack, so a cache hit allocates nothing. */
+  char filename[PATH_MAX];
+  size_t directory_length = strlen(server_files_directory);
+
+  // The query string is not part of the file name
+  size_t path_length = request->path.length;
+  int page = 1;
+  char *query = memchr(request->path.data, '?', path_length);
+  if (query != NULL) {
+    path_length = query - request->path.data;
+    page = files_query_page(query + 1, request->path.length - path_length - 1);
+  }
 
-  struct http_request *request = http_request_parse(fd);
-
-  char *filename;
-
-  if (strcmp(request->path, "/") != 0) {
-    filename = malloc(strlen(server_files_directory) + strlen(request->path) + 1);
-    if (filename == NULL) {
-      http_start_response(fd, 200);
-      http_send_header(fd, "Content-Type", "text/html");
-      http_end_headers(fd);
-      http_send_string(fd,
-          "<center>"
-          "<h1>Error allocating memory for request.</h1>"
-          "</center>");
-      return;
-    }
-    strcpy(filename, server_files_directory);
-    strcat(filename, request->path);
+  // Leave room for a trailing "/index.html"
+  if (directory_length + path_length + sizeof("/index.html") > sizeof(filename)) {
+    http_response_error(response, 404);
+    return;
+  }
+  memcpy(filename, server_files_directory, directory_length);
+  if (path_length != 1 || request->path.data[0] != '/') {
+    memcpy(filename + directory_length, request->path.data, path_length);
+    filename[directory_length + path_length] = '\0';
   } else {
-    filename = server_files_directory;
+    filename[directory_length] = '\0';
+  }
+
+  // Text goes out gzip-encoded to clients that accept it, unless they only
+  // want part of it
+  char *content_type = http_get_mime_type(filename);
+  int gzip = http_mime_type_compressible(content_type)
+      && request->num_ranges == 0
+      && http_request_accepts_encoding(request, "gzip");
+  if (gzip) {
+    int cached = gzcache_lookup(filename, response);
+    if (cached == GZCACHE_HIT) return;
+    gzip = cached == GZCACHE_MISS;
+  }
+
+  // A gzip miss skips the identity cache, so the file gets compressed. With
+  // no gzip cache nothing compressed would be kept, so the identity cache
+  // serves what it holds; it never holds files with a .gz sibling
+  if (((!gzip || server_gzip_cache_mb == 0) && filecache_lookup(filename, response))
+      || dircache_lookup(filename, page, response)) {
+    return;
   }
 
   struct stat statbuf;
@@ -116,402 +156,808 @@ void handle_files_request(int fd) {
   if (file_exists == 0) {
     if (S_ISREG(statbuf.st_mode)) {
       // Requested file is a regular file
-      char buf[1024];
       int in_fd = open(filename, O_RDONLY);
-      
+
       if (in_fd != -1) {
         // Opened regular file successfully
-        char lenBuf[256];
-        size_t len = statbuf.st_size;
-      
-        snprintf(lenBuf, sizeof(lenBuf), "%zu", len);
-        
-        http_start_response(fd, 200);
-        http_send_header(fd, "Content-Type", http_get_mime_type(filename));
-        http_send_header(fd, "Content-Length", lenBuf);
-        http_end_headers(fd);
-
-        size_t read_len;
-        while ((read_len = read(in_fd, buf, sizeof(buf))) != 0){
-          http_send_data(fd, buf, read_len);
+        if (gzip && gzcache_add(filename, filename, in_fd, &statbuf, content_type, response)) {
+          close(in_fd);
+        } else if (filecache_add(filename, filename, in_fd, &statbuf, content_type, response)) {
+          close(in_fd);
+        } else {
+          http_response_init(response, 200, content_type);
+          http_response_set_validators(response, &statbuf, NULL);
+          response->file_fd = in_fd;
+          response->file_length = statbuf.st_size;
         }
-        close(in_fd);
-
-        return;
       } else {
         // File failed to open
-        char lenBuf[256];
-        size_t len;
-        char *response = super_strcat(&len, 1, "<h1>Unable to open file.</h1>");
-        snprintf(lenBuf, sizeof(lenBuf), "%zu", len);
-
-        http_start_response(fd, 200);
-        http_send_header(fd, "Content-Type", "text/html");
-        http_send_header(fd, "Content-Length", lenBuf);
-        http_end_headers(fd);
-        http_send_string(fd, response);
-
-        return;
+        http_response_init(response, 200, "text/html");
+        http_response_append_string(response, "<h1>Unable to open file.</h1>");
       }
     } else if (S_ISDIR(statbuf.st_mode)) {
       // Requested file is a directory
-      char *index_filename = "/index.html";
-      char *index_path = malloc(strlen(filename) + strlen(index_filename) + 1);
+      char index_path[PATH_MAX];
       strcpy(index_path, filename);
-      strcat(index_path, index_filename);
+      strcat(index_path, "/index.html");
 
       struct stat statbuf_index;
       int index_exists = stat(index_path, &statbuf_index);
 
       if (index_exists == 0) {
         // An index.html exists in the requested directory, serve it
-        char buf[1024];
         int in_fd = open(index_path, O_RDONLY);
-        
+
         if (in_fd != -1) {
           // Opened regular file successfully
-          char lenBuf[256];
-          size_t len = statbuf_index.st_size;
-        
-          snprintf(lenBuf, sizeof(lenBuf), "%zu", len);
-          
-          http_start_response(fd, 200);
-          http_send_header(fd, "Content-Type", "text/html");
-          http_send_header(fd, "Content-Length", lenBuf);
-          http_end_headers(fd);
-
-          size_t read_len;
-          while ((read_len = read(in_fd, buf, sizeof(buf))) != 0){
-            http_send_data(fd, buf, read_len);
+          if (gzip && gzcache_add(filename, index_path, in_fd, &statbuf_index,
+                "text/html", response)) {
+            close(in_fd);
+          } else if (filecache_add(filename, index_path, in_fd, &statbuf_index,
+                "text/html", response)) {
+            close(in_fd);
+          } else {
+            http_response_init(response, 200, "text/html");
+            http_response_set_validators(response, &statbuf_index, NULL);
+            response->file_fd = in_fd;
+            response->file_length = statbuf_index.st_size;
           }
-          close(in_fd);
-
-          return;
         } else {
           // File failed to open
-          char lenBuf[256];
-          size_t len;
-          char *response = super_strcat(&len, 1, "<h1>Unable to open file.</h1>");
-          snprintf(lenBuf, sizeof(lenBuf), "%zu", len);
-
-          http_start_response(fd, 200);
-          http_send_header(fd, "Content-Type", "text/html");
-          http_send_header(fd, "Content-Length", lenBuf);
-          http_end_headers(fd);
-          
-          http_send_string(fd, response);
-          return;
+          http_response_init(response, 200, "text/html");
+          http_response_append_string(response, "<h1>Unable to open file.</h1>");
         }
       } else {
         // There is no index.html in the requested directory, list the files inside it
-        DIR *dir;
-        struct dirent *ent;
-        if ((dir = opendir(filename)) != NULL) {
-          // Send HTTP headers
-          http_start_response(fd, 200);
-          http_send_header(fd, "Content-Type", "text/html");
-          http_end_headers(fd);
-
-          // Get all files inside the directory and print links
-          while ((ent = readdir(dir)) != NULL) {
-            // Don't print current (.) and parent (..) directory links
-            if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
-              http_send_string(fd, "<a href=\"");
-              http_send_string(fd, ent->d_name);
-              http_send_string(fd, "\">");
-              http_send_string(fd, ent->d_name);
-              http_send_string(fd, "</a><br>");
-            }
-          }
-          closedir(dir);
-
-          http_send_string(fd, "<a href=\"../\">Parent directory</a>");
-          return;
-        } else {
-          http_start_response(fd, 404);
-          http_send_header(fd, "Content-Type", "text/html");
-          http_end_headers(fd);
-          http_send_string(fd,
+        if (!dircache_render(filename, page, response)) {
+          http_response_init(response, 404, "text/html");
+          http_response_append_string(response,
               "<center>"
               "<h1>Error opening directory.</h1>"
               "</center>");
-          return;
         }
       }
     } else {
       // Not a file or a directory, error
-      http_start_response(fd, 404);
-      http_send_header(fd, "Content-type", "text/html");
-      http_end_headers(fd);
-      http_send_string(fd, 
+      http_response_init(response, 404, "text/html");
+      http_response_append_string(response,
                 "<center>"
                 "<h1>Error finding resource: ");
-      http_send_string(fd, filename);
-      http_send_string(fd,
+      http_response_append_string(response, filename);
+      http_response_append_string(response,
                 ". Not a file or directory</h1>"
                 "</center>");
-      return;
     }
   } else {
     // File doesn't exist
-    http_start_response(fd, 404);
-    http_send_header(fd, "Content-type", "text/html");
-    http_end_headers(fd);
-    http_send_string(fd, 
+    http_response_init(response, 404, "text/html");
+    http_response_append_string(response,
               "<center>"
               "<h1>Error finding file: ");
-    http_send_string(fd, filename);
-    http_send_string(fd,
+    http_response_append_string(response, filename);
+    http_response_append_string(response,
               ". File doesn't exist</h1>"
               "</center>");
-    return;
   }
-          
-
-  /*http_start_response(fd, 200);
-  http_send_header(fd, "Content-Type", "text/html");
-  http_end_headers(fd);
-  http_send_string(fd,
-      "<center>"
-      "<h1>Welcome to httpserver!</h1>"
-      "<hr>"
-      "<p>Nothing's here yet.</p>"
-      "</center>");*/
 }
 
-typedef struct socket_tunnel
-{
-    int in_fd;
-    int out_fd;
-} socket_tunnel;
-
-void *echo_socket_data(void *tunnel) {
-  socket_tunnel *my_tunnel = tunnel;
-  int in_fd = my_tunnel->in_fd;
-  int out_fd = my_tunnel->out_fd;
-
-  char *buf = calloc(1, sizeof(char) * 1024);
-  size_t in_len;
-  while ((in_len = recv(in_fd, buf, 1024, 0))) {
-    
-    char *sendBuf = buf;
-    size_t remain_data = in_len;
-    // Loop to make sure we send all the read data
-    while (remain_data > 0) {
-      int sent_data = send(out_fd, sendBuf, in_len, 0);
-
-      if (sent_data < 1) {
-        close(in_fd);
-        return NULL;
-      }
-
-      sendBuf += sent_data;
-      remain_data -= sent_data;
-    }
-    buf -= remain_data;
+/*
+ * Fills in RESPONSE with the /__metrics page: the counters and histograms
+ * of every thread, and the queue depth, queue wait and workers of every
+ * worker group.
+ */
+static void metrics_prepare_response(struct http_response *response) {
+  http_response_init(response, 200, "text/plain; version=0.0.4");
+  metrics_format(response);
+  if (num_threads == -1 || acceptors == NULL) return;
+
+  char line[128];
+  http_response_append_string(response,
+      "# HELP httpserver_queue_depth Accepted connections waiting for a worker.\n"
+      "# TYPE httpserver_queue_depth gauge\n");
+  for (int i = 0; i < num_acceptors; i++) {
+    int length = snprintf(line, sizeof(line), "httpserver_queue_depth{acceptor=\"%d\"} %zu\n",
+        i, pool_queued(&acceptors[i].pool));
+    http_response_append(response, line, length);
   }
-
-  if (in_len == -1) {
-    close(out_fd);
+  http_response_append_string(response,
+      "# HELP httpserver_workers_busy Workers serving a connection.\n"
+      "# TYPE httpserver_workers_busy gauge\n");
+  for (int i = 0; i < num_acceptors; i++) {
+    int length = snprintf(line, sizeof(line), "httpserver_workers_busy{acceptor=\"%d\"} %d\n",
+        i, pool_busy(&acceptors[i].pool));
+    http_response_append(response, line, length);
+  }
+  http_response_append_string(response,
+      "# HELP httpserver_workers Workers in the pool, which grows while connections wait.\n"
+      "# TYPE httpserver_workers gauge\n");
+  for (int i = 0; i < num_acceptors; i++) {
+    int length = snprintf(line, sizeof(line), "httpserver_workers{acceptor=\"%d\"} %d\n",
+        i, pool_size(&acceptors[i].pool));
+    http_response_append(response, line, length);
+  }
+  http_response_append_string(response,
+      "# HELP httpserver_queue_wait_seconds How long the oldest queued connection had waited"
+      " when last checked (the accept phase histogram has every wait).\n"
+      "# TYPE httpserver_queue_wait_seconds gauge\n");
+  for (int i = 0; i < num_acceptors; i++) {
+    int length = snprintf(line, sizeof(line),
+        "httpserver_queue_wait_seconds{acceptor=\"%d\"} %.9f\n",
+        i, pool_queue_wait(&acceptors[i].pool) / 1e9);
+    http_response_append(response, line, length);
+  }
+  http_response_append_string(response,
+      "# HELP httpserver_workers_started_total Workers started to keep up with the queue.\n"
+      "# TYPE httpserver_workers_started_total counter\n");
+  for (int i = 0; i < num_acceptors; i++) {
+    int length = snprintf(line, sizeof(line),
+        "httpserver_workers_started_total{acceptor=\"%d\"} %lu\n",
+        i, __atomic_load_n(&acceptors[i].pool.started, __ATOMIC_RELAXED));
+    http_response_append(response, line, length);
+  }
+  http_response_append_string(response,
+      "# HELP httpserver_connections_shed_total Connections turned away with a 503 because"
+      " the queue was full or they waited too long.\n"
+      "# TYPE httpserver_connections_shed_total counter\n");
+  for (int i = 0; i < num_acceptors; i++) {
+    int length = snprintf(line, sizeof(line),
+        "httpserver_connections_shed_total{acceptor=\"%d\"} %lu\n",
+        i, __atomic_load_n(&acceptors[i].pool.shed, __ATOMIC_RELAXED));
+    http_response_append(response, line, length);
+  }
+  http_response_append_string(response,
+      "# HELP httpserver_workers_retired_total Workers retired after sitting idle.\n"
+      "# TYPE httpserver_workers_retired_total counter\n");
+  for (int i = 0; i < num_acceptors; i++) {
+    int length = snprintf(line, sizeof(line),
+        "httpserver_workers_retired_total{acceptor=\"%d\"} %lu\n",
+        i, __atomic_load_n(&acceptors[i].pool.retired, __ATOMIC_RELAXED));
+    http_response_append(response, line, length);
   }
-  return NULL;
 }
 
-
 /*
- * Opens a connection to the proxy target (hostname=server_proxy_hostname and
- * port=server_proxy_port) and relays traffic to/from the stream fd and the
- * proxy target. HTTP requests from the client (fd) should be sent to the
- * proxy target, and HTTP responses from the proxy target should be sent to
- * the client (fd).
+ * Fills in RESPONSE for REQUEST: the whole resource, a 304 if the client's
+ * copy is still current, or just the byte ranges asked for with a Range
+ * header.
  *
- *   +--------+     +------------+     +--------------+
- *   | client | <-> | httpserver | <-> | proxy target |
- *   +--------+     +------------+     +--------------+
+ * The response is only built here, not sent, so it can be transmitted by
+ * either handle_files_request or the event loop.
  */
-void handle_proxy_request(int fd) {
+void files_prepare_response(struct http_request *request,
+    struct http_response *response) {
+  if (http_string_equals(&request->path, METRICS_PATH)) {
+    metrics_prepare_response(response);
+    return;
+  }
+  files_prepare_whole_response(request, response);
+  // Text may go out gzip-encoded to other clients, so caches must tell the
+  // encodings apart even when this one is sent as it is
+  if (response->status_code == 200 && response->content_type != NULL
+      && http_mime_type_compressible(response->content_type)) {
+    response->vary_encoding = 1;
+  }
+  http_response_apply_conditionals(response, request);
+  http_response_apply_ranges(response, request);
+}
 
-  /*
-  * The code below does a DNS lookup of server_proxy_hostname and 
-  * opens a connection to it. Please do not modify.
-  */
+/*
+ * Reads HTTP requests from stream (fd), and writes an HTTP response built by
+ * files_prepare_response for each. The connection is kept open between
+ * requests while the client allows it, up to http_keep_alive_max requests.
+ */
+void handle_files_request(int fd) {
+  struct http_connection connection;
+  http_connection_init(&connection, fd);
+  http_response_use_arena(&connection.arena);
 
-  struct sockaddr_in target_address;
-  memset(&target_address, 0, sizeof(target_address));
-  target_address.sin_family = AF_INET;
-  target_address.sin_port = htons(server_proxy_port);
+  int keep_alive = 1;
+  while (keep_alive) {
+    struct http_request *request = http_connection_read_request(&connection);
+    struct http_response response;
 
-  struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
+    uint64_t start;
 
-  int client_socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (client_socket_fd == -1) {
-    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
-    exit(errno);
+    if (request == NULL) {
+      if (connection.closed) break;
+      http_response_error(&response, 400);
+      start = metrics_now();
+    } else {
+      start = metrics_record(METRICS_PARSE, connection.started);
+      files_prepare_response(request, &response);
+      // Request bodies are not read, so a request with one ends the connection
+      response.keep_alive = request->keep_alive && request->content_length == 0
+          && connection.requests < http_keep_alive_max;
+      start = metrics_record(METRICS_HANDLER, start);
+    }
+
+    http_send_response(fd, &response, &connection.builder);
+    metrics_record(METRICS_SEND, start);
+    metrics_count_response(response.status_code, response.body_length + response.file_length);
+    keep_alive = response.keep_alive;
+    http_response_free(&response);
   }
 
-  if (target_dns_entry == NULL) {
-    fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
-    exit(ENXIO);
+  http_response_use_arena(NULL);
+  http_connection_free(&connection);
+}
+
+/* Bytes copied per read when a body cannot be spliced. */
+#define PROXY_BUFFER_SIZE 65536
+
+/* Writes all LENGTH bytes of DATA to FD. Returns 0 on success, -1 on error. */
+static int proxy_send_all(int fd, char *data, size_t length) {
+  while (length > 0) {
+    ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return -1;
+    data += sent;
+    length -= sent;
   }
+  return 0;
+}
 
-  char *dns_address = target_dns_entry->h_addr_list[0];
+/* Copies exactly LENGTH bytes from FROM to TO through BUFFER. Returns 0 on
+ * success, or -1 if either side fails or FROM ends early. */
+static int proxy_copy(int from, int to, size_t length, char *buffer) {
+  while (length > 0) {
+    size_t want = length < PROXY_BUFFER_SIZE ? length : PROXY_BUFFER_SIZE;
+    ssize_t bytes_read = read(from, buffer, want);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0 || proxy_send_all(to, buffer, bytes_read) < 0) return -1;
+    length -= bytes_read;
+  }
+  return 0;
+}
 
-  memcpy(&target_address.sin_addr, dns_address, sizeof(target_address.sin_addr));
-  int connection_status = connect(client_socket_fd, (struct sockaddr*) &target_address,
-      sizeof(target_address));
+/* A pipe per thread for splicing response bodies. */
+static __thread int proxy_pipe[2] = { -1, -1 };
 
-  if (connection_status < 0) {
-    /* Dummy request parsing, just to be compliant. */
-    http_request_parse(fd);
+/* Moves exactly LENGTH bytes from FROM to TO with splice, so the body never
+ * passes through user space. Falls back to proxy_copy if splice cannot be
+ * used. Returns 0 on success or -1 on failure. */
+static int proxy_splice(int from, int to, size_t length, char *buffer) {
+  if (proxy_pipe[0] == -1 && pipe2(proxy_pipe, O_CLOEXEC) == -1) {
+    return proxy_copy(from, to, length, buffer);
+  }
 
-    http_start_response(fd, 502);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
-    return;
+  while (length > 0) {
+    ssize_t moved = splice(from, NULL, proxy_pipe[1], NULL, length, SPLICE_F_MOVE);
+    if (moved < 0 && errno == EINTR) continue;
+    if (moved < 0 && errno == EINVAL) return proxy_copy(from, to, length, buffer);
+    if (moved <= 0) return -1;
+    length -= moved;
+
+    /* Drain the pipe completely, so it is empty for the next body. Only
+     * hold back a partial segment while more of the body is to come; the
+     * last one must go out now, not when the cork timer fires. */
+    int more = length > 0 ? SPLICE_F_MORE : 0;
+    while (moved > 0) {
+      ssize_t written = splice(proxy_pipe[0], NULL, to, NULL, moved, SPLICE_F_MOVE | more);
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) {
+        close(proxy_pipe[0]);
+        close(proxy_pipe[1]);
+        proxy_pipe[0] = proxy_pipe[1] = -1;
+        return -1;
+      }
+      moved -= written;
+    }
+  }
+  return 0;
+}
 
+/* Relays a chunked body from FROM to TO. The first EXTRA bytes of BUFFER have
+ * already been read. Returns 0 once the last chunk has been sent, or -1. */
+static int proxy_chunked(int from, int to, char *buffer, size_t extra) {
+  struct http_chunked chunked;
+  http_chunked_init(&chunked);
+
+  size_t length = extra;
+  while (1) {
+    ssize_t body = http_chunked_scan(&chunked, buffer, length);
+    /* Bytes past the end of the body would belong to no request. */
+    if (body < 0 || (http_chunked_done(&chunked) && (size_t) body != length)) return -1;
+    if (proxy_send_all(to, buffer, body) < 0) return -1;
+    if (http_chunked_done(&chunked)) return 0;
+
+    ssize_t bytes_read = read(from, buffer, PROXY_BUFFER_SIZE);
+    if (bytes_read < 0 && errno == EINTR) {
+      length = 0;
+      continue;
+    }
+    if (bytes_read <= 0) return -1;
+    length = bytes_read;
   }
+}
 
-  /* 
-  * TODO: Your solution for task 3 belongs here! 
-  */
+/* Reads the head of the next response on UPSTREAM into BUFFER, which holds
+ * *LENGTH bytes already. Returns the length of the head, with *LENGTH set to
+ * every byte read, or a value <= 0 if the upstream failed first. */
+static ssize_t proxy_read_head(int upstream, char *buffer, size_t *length,
+    struct http_response_head *head) {
+  while (1) {
+    ssize_t head_length = http_response_head_parse(buffer, *length, head);
+    if (head_length != HTTP_PARSE_INCOMPLETE) return head_length;
 
-  //int fd is input (client connection)
-  //int client_socket_fd is proxy server (server connection)
-  pthread_t thread_1;
-  pthread_t thread_2;
+    ssize_t bytes_read = read(upstream, buffer + *length, PROXY_BUFFER_SIZE - *length);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) return HTTP_PARSE_ERROR;
+    *length += bytes_read;
+  }
+}
 
-  socket_tunnel *tunnel_1 = (socket_tunnel*) malloc(sizeof(socket_tunnel));
-  tunnel_1->in_fd = fd;
-  tunnel_1->out_fd = client_socket_fd;
+/*
+ * Sends REQUEST, read on CONNECTION, to a backend over a pooled connection
+ * and relays the response back to the client. CLIENT_HASH picks the backend
+ * for the ip-hash policy. The upstream
+ * connection goes back to the pool if the response leaves it reusable.
+ * Returns 1 if the client connection can carry another request, or 0 if it
+ * must be closed.
+ */
+static int proxy_exchange(struct http_connection *connection,
+    struct http_request *request, unsigned int client_hash) {
+  int fd = connection->fd;
+  char *buffer = arena_alloc(&connection->arena, PROXY_BUFFER_SIZE);
+  if (buffer == NULL) return 0;
+
+  /* Part of the request body may already be buffered after the headers. */
+  size_t buffered = connection->length - connection->consumed;
+  if (buffered > request->content_length) buffered = request->content_length;
+
+  int upstream, backend;
+  size_t length;
+  ssize_t head_length;
+  struct http_response_head head;
+
+  for (int attempt = 0; ; attempt++) {
+    int reused;
+    upstream = upstream_acquire(client_hash, &backend, &reused);
+    if (upstream < 0) {
+      struct http_response response;
+      http_response_error(&response, 502);
+      http_send_response(fd, &response, &connection->builder);
+      metrics_count_response(502, response.body_length);
+      http_response_free(&response);
+      return 0;
+    }
 
-  socket_tunnel *tunnel_2 = (socket_tunnel*) malloc(sizeof(socket_tunnel));
-  tunnel_2->in_fd = client_socket_fd;
-  tunnel_2->out_fd = fd;
+    length = 0;
+    head_length = HTTP_PARSE_ERROR;
+    if (proxy_send_all(upstream, connection->buffer, connection->consumed + buffered) == 0
+        && proxy_copy(fd, upstream, request->content_length - buffered, buffer) == 0) {
+      head_length = proxy_read_head(upstream, buffer, &length, &head);
+
+      /* Pass interim responses (100 Continue) on and wait for the real one. */
+      while (head_length > 0 && head.status_code / 100 == 1 && head.status_code != 101) {
+        if (proxy_send_all(fd, buffer, head_length) < 0) break;
+        length -= head_length;
+        memmove(buffer, buffer + head_length, length);
+        head_length = proxy_read_head(upstream, buffer, &length, &head);
+      }
+    }
+    if (head_length > 0 && head.status_code != 101) break;
+
+    upstream_release(backend, upstream, 0);
+    /* The server may close a pooled connection just as it is reused; try
+     * once more on a new one if nothing was lost. */
+    if (reused && attempt == 0 && length == 0 && request->content_length == 0) continue;
+    // No response, or one whose head is malformed or cut off
+    if (head_length <= 0) {
+      struct http_response response;
+      http_response_error(&response, 502);
+      http_send_response(fd, &response, &connection->builder);
+      metrics_count_response(502, response.body_length);
+      http_response_free(&response);
+    }
+    return 0;
+  }
+  connection->consumed += buffered;
+  metrics_count_response(head.status_code, 0);
+
+  /* Find out where the body ends; without a length it ends at close. Bytes
+   * past the end were not asked for, so the connection cannot be reused. */
+  size_t extra = length - head_length;
+  int reusable = head.keep_alive;
+  int status;
+
+  if (http_string_equals(&request->method, "HEAD")
+      || head.status_code == 204 || head.status_code == 304) {
+    reusable &= extra == 0;
+    status = proxy_send_all(fd, buffer, head_length);
+  } else if (head.chunked) {
+    status = proxy_send_all(fd, buffer, head_length);
+    if (status == 0) {
+      memmove(buffer, buffer + head_length, extra);
+      status = proxy_chunked(upstream, fd, buffer, extra);
+    }
+  } else if (head.content_length >= 0) {
+    size_t content_length = head.content_length;
+    if (extra >= content_length) {
+      reusable &= extra == content_length;
+      status = proxy_send_all(fd, buffer, head_length + content_length);
+    } else {
+      status = proxy_send_all(fd, buffer, length);
+      if (status == 0) {
+        status = proxy_splice(upstream, fd, content_length - extra, buffer);
+      }
+    }
+  } else {
+    /* Close-delimited: relay until the server closes, then close too. */
+    status = proxy_send_all(fd, buffer, length);
+    while (status == 0) {
+      ssize_t bytes_read = read(upstream, buffer, PROXY_BUFFER_SIZE);
+      if (bytes_read < 0 && errno == EINTR) continue;
+      if (bytes_read <= 0) break;
+      status = proxy_send_all(fd, buffer, bytes_read);
+    }
+    status = -1;
+  }
 
-  pthread_create(&thread_1, NULL, echo_socket_data, tunnel_1);
-  pthread_create(&thread_2, NULL, echo_socket_data, tunnel_2);
+  upstream_release(backend, upstream, status == 0 && reusable);
+  return status == 0;
+}
 
-  pthread_join(thread_1, NULL);
-  pthread_join(thread_2, NULL);
+/* Called by the relay once a raw tunnel to backend ARG is closed. */
+static void proxy_relay_done(void *arg) {
+  upstream_detach((intptr_t) arg);
 }
 
-typedef void (*callback)(int);
+/* Serves the requests on CONNECTION for handle_proxy_request. */
+static void proxy_serve(struct http_connection *connection) {
+  int fd = connection->fd;
+  struct http_request *request = NULL;
+  unsigned int client_hash = upstream_client_hash(fd);
+
+  if (upstream_pool_enabled()) {
+    int keep_alive = 1;
+    while (keep_alive) {
+      request = http_connection_read_request(connection);
+      if (request == NULL) {
+        if (connection->closed) return;
+        struct http_response response;
+        http_response_error(&response, 400);
+        http_send_response(fd, &response, &connection->builder);
+        metrics_count_response(400, response.body_length);
+        http_response_free(&response);
+        return;
+      }
 
-typedef struct threadargs
-{
-    callback request_handler;
-} threadargs;
+      if (http_request_header(request, "Transfer-Encoding") != NULL
+          || http_request_header(request, "Upgrade") != NULL
+          || http_string_equals(&request->method, "CONNECT")) {
+        break;
+      }
 
-void *thread_func(void *request_handler) {
-  
-  threadargs *ta = request_handler;
+      uint64_t start = metrics_record(METRICS_PARSE, connection->started);
+      if (http_string_equals(&request->path, METRICS_PATH)) {
+        struct http_response response;
+        metrics_prepare_response(&response);
+        response.keep_alive = request->keep_alive && request->content_length == 0
+            && connection->requests < http_keep_alive_max;
+        http_send_response(fd, &response, &connection->builder);
+        metrics_count_response(response.status_code, response.body_length);
+        keep_alive = response.keep_alive;
+        http_response_free(&response);
+        continue;
+      }
 
-  while (1) {
-    //pthread_t tid = pthread_self();
-    //printf("Thread ID: %d - Blocked on wq_pop\n", (int) tid);
-    // wq_pop blocks on no work objects in queue
-    int client_fd = wq_pop(&work_queue);
+      /* The exchange sends as it goes, so its send phase is part of the
+       * handler phase. */
+      keep_alive = proxy_exchange(connection, request, client_hash) && request->keep_alive
+          && connection->requests < http_keep_alive_max;
+      metrics_record(METRICS_HANDLER, start);
+    }
+    if (keep_alive == 0) return;
+  }
 
-    //printf("Thread ID: %d - I am FREE!\n", (int) tid);
-    // Handle the request on the returned client socket
-    ta->request_handler(client_fd);
+  /* Every backend refusing the connection ends in a 502. */
+  int backend;
+  int upstream_fd = upstream_connect(client_hash, &backend);
+  if (upstream_fd < 0) {
+    /* Dummy request parsing, just to be compliant. */
+    if (request == NULL) http_connection_read_request(connection);
 
-    close(client_fd);
+    struct http_response response;
+    http_response_error(&response, 502);
+    http_send_response(fd, &response, &connection->builder);
+    metrics_count_response(502, response.body_length);
+    http_response_free(&response);
+    return;
   }
-  return NULL;
+
+  /* Whatever the client sent already goes out first. */
+  if (request != NULL && proxy_send_all(upstream_fd, connection->buffer, connection->length) < 0) {
+    upstream_release(backend, upstream_fd, 0);
+    return;
+  }
+
+  /*
+   * Hand both sockets to the relay threads, which splice bytes between them
+   * until both sides are done. The caller closes FD once we return, so the
+   * relay gets its own descriptor for the client.
+   */
+  int relay_fd = dup(fd);
+  if (relay_fd == -1) {
+    perror("Failed to duplicate client socket");
+    upstream_release(backend, upstream_fd, 0);
+    return;
+  }
+  relay_start(relay_fd, upstream_fd, proxy_relay_done, (void *) (intptr_t) backend);
 }
 
+/*
+ * Opens a connection to one of the proxy targets (server_proxy_targets, picked
+ * by server_proxy_balance) and relays traffic to/from the stream fd and the
+ * proxy target. HTTP requests from the client (fd) should be sent to the
+ * proxy target, and HTTP responses from the proxy target should be sent to
+ * the client (fd).
+ *
+ *   +--------+     +------------+     +--------------+
+ *   | client | <-> | httpserver | <-> | proxy target |
+ *   +--------+     +------------+     +--------------+
+ *
+ * With an upstream pool, each request is forwarded over a pooled keep-alive
+ * connection and the client connection is kept open like with --files.
+ * Requests whose end cannot be found (chunked request bodies, upgrades) and
+ * all traffic without a pool are relayed as raw bytes instead.
+ */
+void handle_proxy_request(int fd) {
+  struct http_connection connection;
+  http_connection_init(&connection, fd);
+  http_response_use_arena(&connection.arena);
+  proxy_serve(&connection);
+  http_response_use_arena(NULL);
+  http_connection_free(&connection);
+}
 
+/*
+ * Turns away a connection the worker pool has no room or time for, with a
+ * 503 and without reading the request. Whatever part of the request already
+ * arrived is read and dropped: closing with it unread would reset the
+ * connection, and the client might lose the 503.
+ */
+static void shed_connection(int client_socket_fd) {
+  static const char response[] =
+      "HTTP/1.1 503 Service Unavailable\r\n"
+      "Content-Length: 0\r\n"
+      "Retry-After: 1\r\n"
+      "Connection: close\r\n"
+      "\r\n";
+  if (send(client_socket_fd, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL) > 0) {
+    metrics_count_response(503, 0);
+  }
+  shutdown(client_socket_fd, SHUT_WR);
+  char discard[4096];
+  recv(client_socket_fd, discard, sizeof(discard), MSG_DONTWAIT);
+}
 
-void init_thread_pool(int num_threads, void (*request_handler)(int)) {
+/*
+ * Starts the worker pool of ACCEPTOR. The --num-threads workers, and the
+ * --max-threads the pools may grow to, are split as evenly as possible
+ * between acceptors, with at least one each.
+ */
+void init_thread_pool(acceptor_t *acceptor) {
   if (num_threads == -1) {
     return;
   }
-  wq_init(&work_queue);
 
-  pthread_t threads[num_threads];
-  // Loop to create num_threads threads
-  for (int i = 0; i < num_threads; i++) {
-    threadargs *ta = (threadargs*) malloc(sizeof(threadargs));
-    ta->request_handler = request_handler;
-    //pthread_t curr_thread = (pthread_t) malloc(sizeof(pthread_t));
-    pthread_create(&threads[i], NULL, thread_func, ta);
+  int group_threads = num_threads / num_acceptors
+      + (acceptor->index < num_threads % num_acceptors);
+  if (group_threads < 1) group_threads = 1;
+  int group_max = max_threads / num_acceptors
+      + (acceptor->index < max_threads % num_acceptors);
+
+  pool_init(&acceptor->pool, group_threads, group_max,
+      (uint64_t) server_queue_wait_target * 1000000,
+      (uint64_t) server_thread_idle_timeout * 1000000000,
+      acceptor->request_handler, num_acceptors > 1 ? &acceptor->cpus : NULL);
+
+  pool_admission_t admission;
+  admission.limit = server_queue_limit > 0 && server_queue_limit < num_acceptors
+      ? 1 : server_queue_limit / num_acceptors;
+  admission.policy = server_shed_policy;
+  admission.codel_target = (uint64_t) server_codel_target * 1000000;
+  admission.codel_interval = (uint64_t) server_codel_interval * 1000000;
+  admission.deadline = (uint64_t) server_queue_deadline * 1000000;
+  admission.shed = shed_connection;
+  pool_set_admission(&acceptor->pool, &admission);
+}
+
+/*
+ * Prints the queue depth and counters of every worker to stderr each time
+ * SIGUSR1 arrives, so load imbalance can be watched with `kill -USR1` while
+ * the server is busy. SIGUSR1 is blocked in every thread and taken here with
+ * sigwait, so the stats are formatted outside of a signal handler.
+ */
+void *pool_stats_func(void *arg) {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+
+  char buffer[4096];
+  while (1) {
+    int signum;
+    if (sigwait(&signals, &signum) != 0) continue;
+    for (int i = 0; i < num_acceptors; i++) {
+      char label[32];
+      snprintf(label, sizeof(label), "acceptor %d", i);
+      int length = pool_format_stats(&acceptors[i].pool, label, buffer, sizeof(buffer));
+      if (write(STDERR_FILENO, buffer, length) < 0) break;
+    }
   }
+  return NULL;
 }
 
 /*
- * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
- * the fd number of the server socket in *socket_number. For each accepted
- * connection, calls request_handler with the accepted fd number.
+ * Splits the CPUs this process may run on into num_acceptors contiguous sets
+ * and stores set INDEX in *CPUS. With more acceptors than CPUs, acceptors
+ * share CPUs round-robin.
  */
-void serve_forever(int *socket_number, void (*request_handler)(int)) {
+void acceptor_cpu_set(int index, cpu_set_t *cpus) {
+  cpu_set_t allowed;
+  int cpu_ids[CPU_SETSIZE];
+  int num_cpus = 0;
+
+  CPU_ZERO(cpus);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+    perror("Failed to get CPU affinity");
+    exit(errno);
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed)) cpu_ids[num_cpus++] = cpu;
+  }
 
-  struct sockaddr_in server_address, client_address;
-  size_t client_address_length = sizeof(client_address);
-  int client_socket_number;
+  if (num_cpus <= num_acceptors) {
+    CPU_SET(cpu_ids[index % num_cpus], cpus);
+    return;
+  }
+  int first = index * num_cpus / num_acceptors;
+  int last = (index + 1) * num_cpus / num_acceptors;
+  for (int i = first; i < last; i++) {
+    CPU_SET(cpu_ids[i], cpus);
+  }
+}
+
+/*
+ * Opens a TCP stream socket listening on all interfaces with port number
+ * server_port. With several acceptors, every socket sets SO_REUSEPORT so the
+ * kernel spreads incoming connections across them.
+ */
+int open_server_socket() {
+
+  struct sockaddr_in server_address;
 
-  *socket_number = socket(PF_INET, SOCK_STREAM, 0);
-  if (*socket_number == -1) {
+  int server_socket = socket(PF_INET, SOCK_STREAM, 0);
+  if (server_socket == -1) {
     perror("Failed to create a new socket");
     exit(errno);
   }
 
   int socket_option = 1;
-  if (setsockopt(*socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
+  if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &socket_option,
         sizeof(socket_option)) == -1) {
     perror("Failed to set socket options");
     exit(errno);
   }
 
+  if (num_acceptors > 1 && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT,
+        &socket_option, sizeof(socket_option)) == -1) {
+    perror("Failed to set SO_REUSEPORT");
+    exit(errno);
+  }
+
   memset(&server_address, 0, sizeof(server_address));
   server_address.sin_family = AF_INET;
   server_address.sin_addr.s_addr = INADDR_ANY;
   server_address.sin_port = htons(server_port);
 
-  if (bind(*socket_number, (struct sockaddr *) &server_address,
+  if (bind(server_socket, (struct sockaddr *) &server_address,
         sizeof(server_address)) == -1) {
     perror("Failed to bind on socket");
     exit(errno);
   }
 
-  if (listen(*socket_number, 1024) == -1) {
+  if (listen(server_socket, 1024) == -1) {
     perror("Failed to listen on socket");
     exit(errno);
   }
 
-  printf("Listening on port %d...\n", server_port);
+  return server_socket;
+}
+
+/*
+ * Accepts connections on the socket of ACCEPTOR forever, and serves them
+ * inline, through its worker group or through an event loop.
+ */
+void *acceptor_func(void *arg) {
+
+  acceptor_t *acceptor = arg;
+  int client_socket_number;
+
+  if (num_acceptors > 1) {
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &acceptor->cpus);
+  }
 
-  init_thread_pool(num_threads, request_handler);
+  if (server_event_loop) {
+    evloop_serve(acceptor->server_socket, files_prepare_response);
+    return NULL;
+  }
 
   while (1) {
-    client_socket_number = accept(*socket_number,
-        (struct sockaddr *) &client_address,
-        (socklen_t *) &client_address_length);
+    client_socket_number = accept(acceptor->server_socket, NULL, NULL);
     if (client_socket_number < 0) {
       perror("Error accepting socket");
       continue;
     }
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
-
-    // TODO: Change me?
+    metrics_accepted(client_socket_number);
     if (num_threads == -1) {
-      request_handler(client_socket_number);
+      acceptor->request_handler(client_socket_number);
       close(client_socket_number);
-    } else if (num_threads > 0) {
-      wq_push(&work_queue, client_socket_number);
+      metrics_closed();
+    } else {
+      pool_submit(&acceptor->pool, client_socket_number);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Opens num_acceptors TCP stream sockets on all interfaces with port number
+ * server_port. Saves the fd number of the first server socket in
+ * *socket_number. For each accepted connection, calls request_handler with
+ * the accepted fd number.
+ */
+void serve_forever(int *socket_number, void (*request_handler)(int)) {
+
+  acceptors = calloc(num_acceptors, sizeof(acceptor_t));
+  if (acceptors == NULL) {
+    perror("Failed to allocate acceptors");
+    exit(errno);
+  }
+
+  for (int i = 0; i < num_acceptors; i++) {
+    acceptors[i].index = i;
+    acceptors[i].server_socket = open_server_socket();
+    acceptors[i].request_handler = request_handler;
+    acceptor_cpu_set(i, &acceptors[i].cpus);
+    init_thread_pool(&acceptors[i]);
+  }
+  *socket_number = acceptors[0].server_socket;
+
+  if (num_acceptors > 1) {
+    printf("Listening on port %d with %d acceptors...\n", server_port, num_acceptors);
+  } else {
+    printf("Listening on port %d...\n", server_port);
+  }
+
+  if (num_threads != -1) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pool_stats_func, NULL) != 0) {
+      perror("Failed to create pool stats thread");
+      exit(errno);
     }
+    pthread_detach(thread);
+  }
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
+  for (int i = 1; i < num_acceptors; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, acceptor_func, &acceptors[i]) != 0) {
+      perror("Failed to create acceptor thread");
+      exit(errno);
+    }
+    pthread_detach(thread);
   }
 
-  shutdown(*socket_number, SHUT_RDWR);
-  close(*socket_number);
+  // The main thread is the first acceptor.
+  acceptor_func(&acceptors[0]);
+
+  for (int i = 0; i < num_acceptors; i++) {
+    shutdown(acceptors[i].server_socket, SHUT_RDWR);
+    close(acceptors[i].server_socket);
+  }
 }
 
 int server_fd;
@@ -524,7 +970,54 @@ void signal_callback_handler(int signum) {
 
 char *USAGE =
   "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+  "       ./httpserver --files www_directory/ --port 8000 --event-loop\n"
+  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n"
+  "       ./httpserver --proxy app1:8080,app2:8080 --balance least-conn --port 8000 [--num-threads 5]\n"
+  "\n"
+  "Options for --files:\n"
+  "       --keep-alive-timeout SECONDS   close idle connections (default 5, 0 = never)\n"
+  "       --keep-alive-max REQUESTS      requests per connection (default 100, 1 = no keep-alive)\n"
+  "       --cache-mb MEGABYTES           cache file contents in memory (default 0 = off)\n"
+  "       --cache-fds FILES              keep up to FILES larger files open (default 256, 0 = off)\n"
+  "       --cache-revalidate SECONDS     re-stat cached files this often (default 1, 0 = never)\n"
+  "       --cache-mmap KILOBYTES         map cached files up to this size instead of copying\n"
+  "                                      them (default 0 = copy all)\n"
+  "       --gzip-level LEVEL             zlib level for compressing text on the fly, 1-9\n"
+  "                                      (default 6, 0 = only serve precompressed .gz files,\n"
+  "                                      as --event-loop always does)\n"
+  "       --gzip-cache-mb MEGABYTES      keep compressed copies in memory (default 32)\n"
+  "       --listing-cache ENTRIES        directory listings kept rendered (default 1024, 0 = off)\n"
+  "\n"
+  "Options for --num-threads:\n"
+  "       --max-threads N                let the pool grow up to N threads (default 256, or\n"
+  "                                      --num-threads if that is more; equal = fixed size)\n"
+  "       --queue-wait-target MS         add a thread while a connection has waited this long\n"
+  "                                      for one (default 10)\n"
+  "       --thread-idle-timeout SECONDS  retire threads beyond --num-threads idle this long\n"
+  "                                      (default 10, 0 = never)\n"
+  "       --queue-limit N                connections queued for a thread at most; more are\n"
+  "                                      shed with a 503 (default 1024, 0 = no limit)\n"
+  "       --shed POLICY                  reject new connections while the queue is full\n"
+  "                                      (default), drop-oldest to shed the longest waiting\n"
+  "                                      instead, or codel to also shed while the queue delay\n"
+  "                                      stays above --codel-target for --codel-interval\n"
+  "       --codel-target MS              (default 5)\n"
+  "       --codel-interval MS            (default 100)\n"
+  "       --queue-deadline MS            shed connections that waited this long for a thread\n"
+  "                                      (default 0 = never)\n"
+  "\n"
+  "Options for both:\n"
+  "       --acceptors N                  listen on N SO_REUSEPORT sockets, each with its own\n"
+  "                                      worker group (or event loop) pinned to a CPU set\n"
+  "\n"
+  "Options for --proxy:\n"
+  "       --balance POLICY               spread connections over the backends by round-robin\n"
+  "                                      (default), least-conn or ip-hash\n"
+  "       --relay-threads N              threads relaying proxied bytes (default: one per acceptor)\n"
+  "       --upstream-pool N              idle upstream connections kept per worker (default 8,\n"
+  "                                      0 = relay every connection as raw bytes)\n"
+  "       --upstream-idle SECONDS        close pooled connections idle this long (default 4)\n"
+  "       --dns-ttl SECONDS              re-resolve the proxy target this often (default 30)\n";
 
 void exit_with_usage() {
   fprintf(stderr, "%s", USAGE);
@@ -533,6 +1026,14 @@ void exit_with_usage() {
 
 int main(int argc, char **argv) {
   signal(SIGINT, signal_callback_handler);
+  /* Clients may hang up mid-response; let the write fail instead. */
+  signal(SIGPIPE, SIG_IGN);
+  /* Pool stats are printed by a thread that waits for SIGUSR1; every thread
+   * started from here on inherits the mask. */
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
 
   /* Default settings */
   server_port = 8000;
@@ -551,20 +1052,22 @@ int main(int argc, char **argv) {
     } else if (strcmp("--proxy", argv[i]) == 0) {
       request_handler = handle_proxy_request;
 
-      char *proxy_target = argv[++i];
-      if (!proxy_target) {
+      server_proxy_targets = argv[++i];
+      if (!server_proxy_targets) {
         fprintf(stderr, "Expected argument after --proxy\n");
         exit_with_usage();
       }
-
-      char *colon_pointer = strchr(proxy_target, ':');
-      if (colon_pointer != NULL) {
-        *colon_pointer = '\0';
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = atoi(colon_pointer + 1);
+    } else if (strcmp("--balance", argv[i]) == 0) {
+      char *policy = argv[++i];
+      if (policy && strcmp(policy, "round-robin") == 0) {
+        server_proxy_balance = UPSTREAM_ROUND_ROBIN;
+      } else if (policy && strcmp(policy, "least-conn") == 0) {
+        server_proxy_balance = UPSTREAM_LEAST_CONN;
+      } else if (policy && strcmp(policy, "ip-hash") == 0) {
+        server_proxy_balance = UPSTREAM_IP_HASH;
       } else {
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = 80;
+        fprintf(stderr, "Expected round-robin, least-conn or ip-hash after --balance\n");
+        exit_with_usage();
       }
     } else if (strcmp("--port", argv[i]) == 0) {
       char *server_port_string = argv[++i];
@@ -579,6 +1082,146 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected positive integer after --num-threads\n");
         exit_with_usage();
       }
+    } else if (strcmp("--max-threads", argv[i]) == 0) {
+      char *max_threads_str = argv[++i];
+      if (!max_threads_str || (max_threads = atoi(max_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--queue-wait-target", argv[i]) == 0) {
+      char *target_str = argv[++i];
+      if (!target_str || (server_queue_wait_target = atoi(target_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --queue-wait-target\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--thread-idle-timeout", argv[i]) == 0) {
+      char *idle_str = argv[++i];
+      if (!idle_str || (server_thread_idle_timeout = atoi(idle_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --thread-idle-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--queue-limit", argv[i]) == 0) {
+      char *limit_str = argv[++i];
+      if (!limit_str || (server_queue_limit = atoi(limit_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --queue-limit\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--shed", argv[i]) == 0) {
+      char *policy = argv[++i];
+      if (policy && strcmp(policy, "reject") == 0) {
+        server_shed_policy = POOL_SHED_REJECT;
+      } else if (policy && strcmp(policy, "drop-oldest") == 0) {
+        server_shed_policy = POOL_SHED_DROP_OLDEST;
+      } else if (policy && strcmp(policy, "codel") == 0) {
+        server_shed_policy = POOL_SHED_CODEL;
+      } else {
+        fprintf(stderr, "Expected reject, drop-oldest or codel after --shed\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--codel-target", argv[i]) == 0) {
+      char *target_str = argv[++i];
+      if (!target_str || (server_codel_target = atoi(target_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --codel-target\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--codel-interval", argv[i]) == 0) {
+      char *interval_str = argv[++i];
+      if (!interval_str || (server_codel_interval = atoi(interval_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --codel-interval\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--queue-deadline", argv[i]) == 0) {
+      char *deadline_str = argv[++i];
+      if (!deadline_str || (server_queue_deadline = atoi(deadline_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --queue-deadline\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--acceptors", argv[i]) == 0) {
+      char *acceptors_str = argv[++i];
+      if (!acceptors_str || (num_acceptors = atoi(acceptors_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --acceptors\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--relay-threads", argv[i]) == 0) {
+      char *relay_threads_str = argv[++i];
+      if (!relay_threads_str || (num_relay_threads = atoi(relay_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --relay-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--upstream-pool", argv[i]) == 0) {
+      char *pool_str = argv[++i];
+      if (!pool_str || (server_upstream_pool = atoi(pool_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --upstream-pool\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--upstream-idle", argv[i]) == 0) {
+      char *idle_str = argv[++i];
+      if (!idle_str || (server_upstream_idle = atoi(idle_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --upstream-idle\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--dns-ttl", argv[i]) == 0) {
+      char *ttl_str = argv[++i];
+      if (!ttl_str || (server_dns_ttl = atoi(ttl_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --dns-ttl\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--keep-alive-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (http_keep_alive_timeout = atoi(timeout_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --keep-alive-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--keep-alive-max", argv[i]) == 0) {
+      char *max_str = argv[++i];
+      if (!max_str || (http_keep_alive_max = atoi(max_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --keep-alive-max\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-mb", argv[i]) == 0) {
+      char *cache_mb_str = argv[++i];
+      if (!cache_mb_str || (server_cache_mb = atoi(cache_mb_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --cache-mb\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-fds", argv[i]) == 0) {
+      char *cache_fds_str = argv[++i];
+      if (!cache_fds_str || (server_cache_fds = atoi(cache_fds_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --cache-fds\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-mmap", argv[i]) == 0) {
+      char *cache_map_str = argv[++i];
+      if (!cache_map_str || (server_cache_map_kb = atoi(cache_map_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --cache-mmap\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--gzip-level", argv[i]) == 0) {
+      char *level_str = argv[++i];
+      if (!level_str || (server_gzip_level = atoi(level_str)) < 0 || server_gzip_level > 9) {
+        fprintf(stderr, "Expected integer from 0 to 9 after --gzip-level\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--gzip-cache-mb", argv[i]) == 0) {
+      char *gzip_cache_str = argv[++i];
+      if (!gzip_cache_str || (server_gzip_cache_mb = atoi(gzip_cache_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --gzip-cache-mb\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--listing-cache", argv[i]) == 0) {
+      char *listing_str = argv[++i];
+      if (!listing_str || (server_listing_cache = atoi(listing_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --listing-cache\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-revalidate", argv[i]) == 0) {
+      char *revalidate_str = argv[++i];
+      if (!revalidate_str || (server_cache_revalidate = atoi(revalidate_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --cache-revalidate\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--event-loop", argv[i]) == 0) {
+      server_event_loop = 1;
     } else if (strcmp("--help", argv[i]) == 0) {
       exit_with_usage();
     } else {
@@ -587,12 +1230,38 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (server_files_directory == NULL && server_proxy_hostname == NULL) {
+  if (server_files_directory == NULL && server_proxy_targets == NULL) {
     fprintf(stderr, "Please specify either \"--files [DIRECTORY]\" or \n"
-                    "                      \"--proxy [HOSTNAME:PORT]\"\n");
+                    "                      \"--proxy [HOSTNAME:PORT,...]\"\n");
     exit_with_usage();
   }
 
+  if (server_event_loop && (request_handler != handle_files_request || num_threads != -1)) {
+    fprintf(stderr, "--event-loop only supports --files without --num-threads\n");
+    exit_with_usage();
+  }
+
+  if (max_threads == -1) max_threads = num_threads > 256 ? num_threads : 256;
+
+  metrics_init();
+  filecache_init((size_t) server_cache_mb << 20, server_cache_fds, server_cache_revalidate,
+      (size_t) server_cache_map_kb << 10);
+  if (request_handler == handle_files_request) {
+    // Compressing a miss would stall every connection of the event loop, so
+    // it only serves precompressed .gz siblings
+    gzcache_init((size_t) server_gzip_cache_mb << 20, server_event_loop ? 0 : server_gzip_level,
+        server_cache_revalidate);
+    dircache_init(server_listing_cache);
+  }
+  if (request_handler == handle_proxy_request) {
+    relay_init(num_relay_threads > 0 ? num_relay_threads : num_acceptors);
+    if (upstream_init(server_proxy_targets, server_proxy_balance, server_dns_ttl,
+          server_upstream_pool, server_upstream_idle) == -1) {
+      fprintf(stderr, "Expected HOSTNAME[:PORT][,HOSTNAME[:PORT]...] after --proxy\n");
+      exit_with_usage();
+    }
+  }
+
   serve_forever(&server_fd, request_handler);
 
   return EXIT_SUCCESS;
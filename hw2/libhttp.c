@@ -1,70 +1,604 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "libhttp.h"
+#include "metrics.h"
 
-#define LIBHTTP_REQUEST_MAX_SIZE 8192
+int http_keep_alive_timeout = 5;
+int http_keep_alive_max = 100;
 
 void http_fatal_error(char *message) {
   fprintf(stderr, "%s\n", message);
   exit(ENOBUFS);
 }
 
-struct http_request *http_request_parse(int fd) {
-  struct http_request *request = malloc(sizeof(struct http_request));
-  if (!request) http_fatal_error("Malloc failed");
-
-  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
-  if (!read_buffer) http_fatal_error("Malloc failed");
-
-  int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
-
-  char *read_start, *read_end;
-  size_t read_size;
-
-  do {
-    /* Read in the HTTP method: "[A-Z]*" */
-    read_start = read_end = read_buffer;
-    while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->method = malloc(read_size + 1);
-    memcpy(request->method, read_start, read_size);
-    request->method[read_size] = '\0';
-
-    /* Read in a space character. */
-    read_start = read_end;
-    if (*read_end != ' ') break;
-    read_end++;
-
-    /* Read in the path: "[^ \n]*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->path = malloc(read_size + 1);
-    memcpy(request->path, read_start, read_size);
-    request->path[read_size] = '\0';
-
-    /* Read in HTTP version and rest of request line: ".*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != '\n') read_end++;
-    if (*read_end != '\n') break;
-    read_end++;
-
-    free(read_buffer);
-    return request;
-  } while (0);
-
-  /* An error occurred. */
-  free(request);
-  free(read_buffer);
+enum http_parser_state {
+  HTTP_PARSER_METHOD,
+  HTTP_PARSER_PATH,
+  HTTP_PARSER_VERSION,
+  HTTP_PARSER_LINE_LF,          /* Expecting the \n of a \r\n line ending. */
+  HTTP_PARSER_HEADER_START,
+  HTTP_PARSER_HEADER_NAME,
+  HTTP_PARSER_HEADER_VALUE_START,
+  HTTP_PARSER_HEADER_VALUE,
+  HTTP_PARSER_END_LF,           /* Expecting the \n of the final blank line. */
+  HTTP_PARSER_DONE,
+};
+
+static struct http_string http_string_view(char *buffer, size_t start, size_t end) {
+  struct http_string string = { buffer + start, end - start };
+  return string;
+}
+
+/* Bytes allowed inside a header value: anything but control characters,
+ * except for tab. */
+static const char http_value_chars[256] = {
+  ['\t'] = 1, [0x20 ... 0x7e] = 1, [0x80 ... 0xff] = 1,
+};
+
+/* Bytes allowed in the path and version: no whitespace or control
+ * characters. */
+static const char http_path_chars[256] = {
+  [0x21 ... 0x7e] = 1, [0x80 ... 0xff] = 1,
+};
+
+/* Bytes allowed in a header name. */
+static const char http_name_chars[256] = {
+  [0x21 ... 0x39] = 1, [0x3b ... 0x7e] = 1, [0x80 ... 0xff] = 1,
+};
+
+/* Returns 1 if the LENGTH bytes at NAME spell out header name EXPECTED. */
+static int http_name_equals(char *name, size_t length, char *expected) {
+  return strlen(expected) == length && strncasecmp(name, expected, length) == 0;
+}
+
+/*
+ * Parses VALUE, a Content-Length header, into *LENGTH. Only digits are
+ * allowed, and the length may be at most LIMIT. Returns -1 otherwise: a
+ * peer that reads "12abc" or "0, 50" some other way would frame the body
+ * differently, and could take the rest for another request.
+ */
+static int http_parse_content_length(struct http_string *value, size_t limit,
+    size_t *length) {
+  if (value->length == 0) return -1;
+  size_t parsed = 0;
+  for (size_t i = 0; i < value->length; i++) {
+    char c = value->data[i];
+    if (c < '0' || c > '9') return -1;
+    if (parsed > (limit - (c - '0')) / 10) return -1;
+    parsed = parsed * 10 + (c - '0');
+  }
+  *length = parsed;
+  return 0;
+}
+
+/* Returns 1 if the comma-separated header VALUE contains TOKEN. */
+static int http_header_has_token(struct http_string *value, char *token) {
+  size_t token_length = strlen(token);
+  char *start = value->data;
+  char *end = value->data + value->length;
+
+  while (start < end) {
+    while (start < end && (*start == ' ' || *start == '\t' || *start == ',')) start++;
+    char *token_end = start;
+    while (token_end < end && *token_end != ',') token_end++;
+    char *trimmed_end = token_end;
+    while (trimmed_end > start && (trimmed_end[-1] == ' ' || trimmed_end[-1] == '\t'))
+      trimmed_end--;
+    if ((size_t) (trimmed_end - start) == token_length
+        && strncasecmp(start, token, token_length) == 0) return 1;
+    start = token_end;
+  }
+  return 0;
+}
+
+/* Parses the decimal number in [*P, END), advancing *P past it. Returns -1
+ * if there are no digits or the number does not fit in an off_t. */
+static off_t http_parse_offset(char **p, char *end) {
+  off_t value = 0;
+  char *start = *p;
+  for (; *p < end && **p >= '0' && **p <= '9'; (*p)++) {
+    if (value > (INT64_MAX - 9) / 10) return -1;
+    value = value * 10 + (**p - '0');
+  }
+  return *p > start ? value : -1;
+}
+
+/*
+ * Parses a Range header VALUE ("bytes=0-99,200-,-50") into REQUEST. A header
+ * that is malformed, uses another unit or lists too many ranges is ignored,
+ * as if it were not there.
+ */
+static void http_parse_ranges(struct http_request *request, struct http_string *value) {
+  char *p = value->data;
+  char *end = value->data + value->length;
+  if (end - p < 6 || strncasecmp(p, "bytes=", 6) != 0) return;
+  p += 6;
+
+  int num_ranges = 0;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    if (p == end) break;
+    if (num_ranges == LIBHTTP_MAX_RANGES) return;
+
+    struct http_byte_range *range = &request->ranges[num_ranges];
+    range->first = range->last = -1;
+    if (*p != '-') {
+      if ((range->first = http_parse_offset(&p, end)) == -1) return;
+    }
+    if (p == end || *p++ != '-') return;
+    if (p < end && *p >= '0' && *p <= '9') {
+      if ((range->last = http_parse_offset(&p, end)) == -1) return;
+    }
+    if (range->first == -1 && range->last == -1) return;
+    if (range->first != -1 && range->last != -1 && range->last < range->first) return;
+
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p < end && *p != ',') return;
+    num_ranges++;
+  }
+  request->num_ranges = num_ranges;
+}
+
+/* Derives the fields computed from headers once REQUEST is complete.
+ * Returns -1 if they are malformed. */
+static int http_request_finish(struct http_request *request) {
+  request->keep_alive = http_string_equals(&request->version, "HTTP/1.1");
+
+  struct http_string *connection = http_request_header(request, "Connection");
+  if (connection != NULL) {
+    if (http_header_has_token(connection, "close")) {
+      request->keep_alive = 0;
+    } else if (http_header_has_token(connection, "keep-alive")) {
+      request->keep_alive = 1;
+    }
+  }
+
+  /* Repeated Content-Length headers must agree. */
+  int content_lengths = 0;
+  for (int i = 0; i < request->num_headers; i++) {
+    struct http_header *header = &request->headers[i];
+    if (!http_name_equals(header->name.data, header->name.length, "Content-Length")) continue;
+    size_t content_length;
+    if (http_parse_content_length(&header->value, SSIZE_MAX, &content_length) == -1
+        || (content_lengths++ > 0 && content_length != request->content_length)) {
+      return -1;
+    }
+    request->content_length = content_length;
+  }
+
+  struct http_string *range = http_request_header(request, "Range");
+  if (range != NULL) http_parse_ranges(request, range);
+  return 0;
+}
+
+/* Resets PARSER and REQUEST to parse a new request. */
+void http_parser_init(struct http_parser *parser, struct http_request *request) {
+  parser->state = HTTP_PARSER_METHOD;
+  parser->offset = 0;
+  parser->mark = 0;
+  request->num_headers = 0;
+  request->keep_alive = 0;
+  request->content_length = 0;
+  request->num_ranges = 0;
+  request->method = request->path = request->version = http_string_view(NULL, 0, 0);
+}
+
+/*
+ * Parses the first LENGTH bytes of BUFFER into REQUEST, picking up where the
+ * previous call on PARSER left off. BUFFER must hold the same bytes at the same
+ * address on every call for one request. Returns the length of the request
+ * (request line and headers) once it is complete, HTTP_PARSE_INCOMPLETE if
+ * more bytes are needed, or HTTP_PARSE_ERROR on a malformed request.
+ */
+ssize_t http_parser_execute(struct http_parser *parser, struct http_request *request,
+    char *buffer, size_t length) {
+  char *p = buffer + parser->offset;
+  char *end = buffer + length;
+
+  /* Each state consumes as many bytes as it can in a tight loop, and only
+   * moves on once it has seen the byte that ends its token. */
+  while (p < end) {
+    switch (parser->state) {
+      case HTTP_PARSER_METHOD:
+        /* "[A-Z]+ " */
+        while (p < end && *p >= 'A' && *p <= 'Z') p++;
+        if (p == end) break;
+        if (*p != ' ' || p == buffer + parser->mark) return HTTP_PARSE_ERROR;
+        request->method = http_string_view(buffer, parser->mark, p - buffer);
+        parser->mark = ++p - buffer;
+        parser->state = HTTP_PARSER_PATH;
+        break;
+
+      case HTTP_PARSER_PATH:
+        /* "[^ \r\n]+", optionally followed by " " and the version. */
+        while (p < end && http_path_chars[(unsigned char) *p]) p++;
+        if (p == end) break;
+        if ((*p != ' ' && *p != '\r' && *p != '\n') || p == buffer + parser->mark)
+          return HTTP_PARSE_ERROR;
+        request->path = http_string_view(buffer, parser->mark, p - buffer);
+        if (*p == ' ') {
+          parser->state = HTTP_PARSER_VERSION;
+        } else {
+          parser->state = *p == '\r' ? HTTP_PARSER_LINE_LF : HTTP_PARSER_HEADER_START;
+        }
+        parser->mark = ++p - buffer;
+        break;
+
+      case HTTP_PARSER_VERSION:
+        while (p < end && http_path_chars[(unsigned char) *p]) p++;
+        if (p == end) break;
+        if (*p != '\r' && *p != '\n') return HTTP_PARSE_ERROR;
+        request->version = http_string_view(buffer, parser->mark, p - buffer);
+        parser->state = *p == '\r' ? HTTP_PARSER_LINE_LF : HTTP_PARSER_HEADER_START;
+        p++;
+        break;
+
+      case HTTP_PARSER_LINE_LF:
+        if (*p++ != '\n') return HTTP_PARSE_ERROR;
+        parser->state = HTTP_PARSER_HEADER_START;
+        break;
+
+      case HTTP_PARSER_HEADER_START:
+        if (*p == '\r') {
+          parser->state = HTTP_PARSER_END_LF;
+          p++;
+          break;
+        }
+        if (*p == '\n') {
+          parser->state = HTTP_PARSER_DONE;
+          break;
+        }
+        /* Folded (obsolete multi-line) headers are not supported. */
+        if (*p == ' ' || *p == '\t' || request->num_headers == LIBHTTP_MAX_HEADERS)
+          return HTTP_PARSE_ERROR;
+        parser->mark = p - buffer;
+        parser->state = HTTP_PARSER_HEADER_NAME;
+        break;
+
+      case HTTP_PARSER_HEADER_NAME:
+        while (p < end && http_name_chars[(unsigned char) *p]) p++;
+        if (p == end) break;
+        if (*p != ':' || p == buffer + parser->mark) return HTTP_PARSE_ERROR;
+        request->headers[request->num_headers].name =
+            http_string_view(buffer, parser->mark, p - buffer);
+        parser->state = HTTP_PARSER_HEADER_VALUE_START;
+        p++;
+        break;
+
+      case HTTP_PARSER_HEADER_VALUE_START:
+        /* Skip leading whitespace, then read the value. */
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p == end) break;
+        parser->mark = p - buffer;
+        parser->state = HTTP_PARSER_HEADER_VALUE;
+        break;
+
+      case HTTP_PARSER_HEADER_VALUE:
+        while (p < end && http_value_chars[(unsigned char) *p]) p++;
+        if (p == end) break;
+        if (*p != '\r' && *p != '\n') return HTTP_PARSE_ERROR;
+        {
+          char *value_end = p;
+          while (value_end > buffer + parser->mark
+              && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+          request->headers[request->num_headers++].value =
+              http_string_view(buffer, parser->mark, value_end - buffer);
+        }
+        parser->state = *p == '\r' ? HTTP_PARSER_LINE_LF : HTTP_PARSER_HEADER_START;
+        p++;
+        break;
+
+      case HTTP_PARSER_END_LF:
+        if (*p != '\n') return HTTP_PARSE_ERROR;
+        parser->state = HTTP_PARSER_DONE;
+        break;
+
+      case HTTP_PARSER_DONE:
+        /* P is at the final \n. */
+        parser->offset = p + 1 - buffer;
+        if (http_request_finish(request) == -1) return HTTP_PARSE_ERROR;
+        return parser->offset;
+    }
+  }
+
+  parser->offset = p - buffer;
+  return HTTP_PARSE_INCOMPLETE;
+}
+
+/* Returns 1 if STRING holds exactly the characters of LITERAL. */
+int http_string_equals(struct http_string *string, char *literal) {
+  size_t length = strlen(literal);
+  return string->length == length && memcmp(string->data, literal, length) == 0;
+}
+
+/* Returns the value of the first header called NAME (any case), or NULL. */
+struct http_string *http_request_header(struct http_request *request, char *name) {
+  size_t length = strlen(name);
+  for (int i = 0; i < request->num_headers; i++) {
+    struct http_header *header = &request->headers[i];
+    if (header->name.length == length && strncasecmp(header->name.data, name, length) == 0)
+      return &header->value;
+  }
   return NULL;
+}
+
+/* Returns 1 if the parameters in [START, END) give a weight of zero (q=0). */
+static int http_weight_is_zero(char *start, char *end) {
+  while (start < end) {
+    while (start < end && (*start == ';' || *start == ' ' || *start == '\t')) start++;
+    if (end - start >= 2 && (*start == 'q' || *start == 'Q') && start[1] == '=') {
+      char *p = start + 2;
+      if (p == end || *p != '0') return 0;
+      for (p++; p < end && (*p == '.' || *p == '0'); p++);
+      return p == end || *p == ';' || *p == ' ' || *p == '\t';
+    }
+    while (start < end && *start != ';') start++;
+  }
+  return 0;
+}
+
+/*
+ * Returns 1 if the Accept-Encoding header of REQUEST allows content coding
+ * CODING, either by name or through "*", and does not give it q=0.
+ */
+int http_request_accepts_encoding(struct http_request *request, char *coding) {
+  struct http_string *accept = http_request_header(request, "Accept-Encoding");
+  if (accept == NULL) return 0;
+
+  size_t coding_length = strlen(coding);
+  int accepted = 0;
+  char *start = accept->data;
+  char *end = accept->data + accept->length;
+
+  while (start < end) {
+    while (start < end && (*start == ' ' || *start == '\t' || *start == ',')) start++;
+    char *item_end = start;
+    while (item_end < end && *item_end != ',') item_end++;
+    char *name_end = start;
+    while (name_end < item_end && *name_end != ';' && *name_end != ' ' && *name_end != '\t')
+      name_end++;
+
+    int allowed = !http_weight_is_zero(name_end, item_end);
+    if ((size_t) (name_end - start) == coding_length
+        && strncasecmp(start, coding, coding_length) == 0) {
+      // An explicit entry overrides "*"
+      return allowed;
+    }
+    if (name_end - start == 1 && *start == '*') accepted = allowed;
+    start = item_end;
+  }
+  return accepted;
+}
+
+/*
+ * Prepares CONNECTION for reading requests from FD. Reads give up once the
+ * client has been idle for http_keep_alive_timeout seconds.
+ */
+void http_connection_init(struct http_connection *connection, int fd) {
+  connection->fd = fd;
+  connection->closed = 0;
+  connection->requests = 0;
+  connection->length = 0;
+  connection->consumed = 0;
+  arena_init(&connection->arena);
+
+  if (http_keep_alive_timeout > 0) {
+    struct timeval timeout = { .tv_sec = http_keep_alive_timeout, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  }
+}
+
+/*
+ * Reads the next request on CONNECTION. The returned request points into the
+ * connection's buffer and stays valid until the next call. Bytes past the end
+ * of the request stay buffered, so requests pipelined into a single read are
+ * not lost. Memory allocated from the connection's arena for the previous
+ * request is released. Returns NULL on a malformed request, or with
+ * CONNECTION->closed set once the client closed, timed out or failed.
+ */
+struct http_request *http_connection_read_request(struct http_connection *connection) {
+  /* Drop the previous request, keeping any pipelined bytes after it. */
+  connection->length -= connection->consumed;
+  memmove(connection->buffer, connection->buffer + connection->consumed,
+      connection->length);
+  connection->consumed = 0;
+  connection->started = connection->length > 0 ? metrics_now() : 0;
+  arena_reset(&connection->arena);
+
+  http_parser_init(&connection->parser, &connection->request);
+
+  while (1) {
+    ssize_t request_length = http_parser_execute(&connection->parser,
+        &connection->request, connection->buffer, connection->length);
+
+    if (request_length > 0) {
+      connection->consumed = request_length;
+      connection->requests++;
+      return &connection->request;
+    }
+    if (request_length == HTTP_PARSE_ERROR || connection->length == sizeof(connection->buffer)) {
+      /* The end of a malformed request cannot be found, so drop everything. */
+      connection->consumed = connection->length;
+      connection->requests++;
+      return NULL;
+    }
+
+    ssize_t bytes_read = read(connection->fd, connection->buffer + connection->length,
+        sizeof(connection->buffer) - connection->length);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) {
+      connection->closed = 1;
+      return NULL;
+    }
+    if (connection->started == 0) connection->started = metrics_now();
+    connection->length += bytes_read;
+  }
+}
+
+/* Frees what CONNECTION allocated. The socket is left open. */
+void http_connection_free(struct http_connection *connection) {
+  arena_free(&connection->arena);
+}
+
+/*
+ * Parses the status line and headers at the start of BUFFER. Returns the
+ * length of the head once it is complete, HTTP_PARSE_INCOMPLETE if more bytes
+ * are needed, or HTTP_PARSE_ERROR if it is malformed or does not fit in
+ * LIBHTTP_REQUEST_MAX_SIZE bytes.
+ */
+ssize_t http_response_head_parse(char *buffer, size_t length,
+    struct http_response_head *head) {
+  char *end = memmem(buffer, length, "\r\n\r\n", 4);
+  if (end == NULL) {
+    return length >= LIBHTTP_REQUEST_MAX_SIZE ? HTTP_PARSE_ERROR : HTTP_PARSE_INCOMPLETE;
+  }
+  end += 2;
+
+  /* "HTTP/1.x NNN Reason" */
+  if (end - buffer < 12 || strncmp(buffer, "HTTP/1.", 7) != 0 || buffer[8] != ' ') {
+    return HTTP_PARSE_ERROR;
+  }
+  head->status_code = 0;
+  for (int i = 9; i < 12; i++) {
+    if (buffer[i] < '0' || buffer[i] > '9') return HTTP_PARSE_ERROR;
+    head->status_code = head->status_code * 10 + (buffer[i] - '0');
+  }
+  head->keep_alive = buffer[7] == '1';
+  head->chunked = 0;
+  head->content_length = -1;
+
+  char *line = memchr(buffer, '\n', end - buffer) + 1;
+  while (line < end) {
+    char *line_end = memchr(line, '\n', end - line);
+    char *colon = memchr(line, ':', line_end - line);
+    if (colon != NULL) {
+      struct http_string value = { colon + 1, line_end - colon - 1 };
+      while (value.length > 0 && (value.data[0] == ' ' || value.data[0] == '\t')) {
+        value.data++;
+        value.length--;
+      }
+      while (value.length > 0 && (value.data[value.length - 1] == '\r'
+            || value.data[value.length - 1] == ' ')) {
+        value.length--;
+      }
+
+      if (http_name_equals(line, colon - line, "Content-Length")) {
+        size_t content_length;
+        if (http_parse_content_length(&value, SSIZE_MAX, &content_length) == -1
+            || (head->content_length != -1
+              && (size_t) head->content_length != content_length)) {
+          return HTTP_PARSE_ERROR;
+        }
+        head->content_length = content_length;
+      } else if (http_name_equals(line, colon - line, "Transfer-Encoding")) {
+        head->chunked = http_header_has_token(&value, "chunked");
+      } else if (http_name_equals(line, colon - line, "Connection")) {
+        if (http_header_has_token(&value, "close")) {
+          head->keep_alive = 0;
+        } else if (http_header_has_token(&value, "keep-alive")) {
+          head->keep_alive = 1;
+        }
+      }
+    }
+    line = line_end + 1;
+  }
+
+  return end + 2 - buffer;
+}
+
+enum http_chunked_state {
+  HTTP_CHUNKED_SIZE,
+  HTTP_CHUNKED_EXTENSION,       /* Rest of the size line. */
+  HTTP_CHUNKED_DATA,
+  HTTP_CHUNKED_DATA_END,        /* The \r\n after the chunk's data. */
+  HTTP_CHUNKED_TRAILER_START,
+  HTTP_CHUNKED_TRAILER,
+  HTTP_CHUNKED_DONE,
+};
 
+void http_chunked_init(struct http_chunked *chunked) {
+  chunked->state = HTTP_CHUNKED_SIZE;
+  chunked->remaining = 0;
+}
+
+/*
+ * Scans the next LENGTH bytes of a chunked body. Returns how many of them
+ * belong to the body: LENGTH if the body goes on, fewer once its last byte
+ * has been seen, or HTTP_PARSE_ERROR on a malformed body. Once the end has
+ * been found, every call returns 0.
+ */
+ssize_t http_chunked_scan(struct http_chunked *chunked, char *data, size_t length) {
+  size_t i = 0;
+
+  while (i < length && chunked->state != HTTP_CHUNKED_DONE) {
+    char c = data[i];
+    switch (chunked->state) {
+      case HTTP_CHUNKED_SIZE:
+      case HTTP_CHUNKED_EXTENSION:
+        if (c == '\n') {
+          chunked->state = chunked->remaining > 0
+              ? HTTP_CHUNKED_DATA : HTTP_CHUNKED_TRAILER_START;
+        } else if (chunked->state == HTTP_CHUNKED_EXTENSION) {
+          /* Skip chunk extensions. */
+        } else if (c >= '0' && c <= '9') {
+          chunked->remaining = chunked->remaining * 16 + (c - '0');
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+          chunked->remaining = chunked->remaining * 16 + ((c | 0x20) - 'a' + 10);
+        } else if (c == ';' || c == ' ' || c == '\t' || c == '\r') {
+          chunked->state = HTTP_CHUNKED_EXTENSION;
+        } else {
+          return HTTP_PARSE_ERROR;
+        }
+        i++;
+        break;
+
+      case HTTP_CHUNKED_DATA: {
+        size_t available = length - i;
+        size_t skip = available < chunked->remaining ? available : chunked->remaining;
+        i += skip;
+        chunked->remaining -= skip;
+        if (chunked->remaining == 0) chunked->state = HTTP_CHUNKED_DATA_END;
+        break;
+      }
+
+      case HTTP_CHUNKED_DATA_END:
+        if (c == '\n') chunked->state = HTTP_CHUNKED_SIZE;
+        else if (c != '\r') return HTTP_PARSE_ERROR;
+        i++;
+        break;
+
+      case HTTP_CHUNKED_TRAILER_START:
+        /* An empty line ends the body; anything else is a trailer field. */
+        if (c == '\n') chunked->state = HTTP_CHUNKED_DONE;
+        else if (c != '\r') chunked->state = HTTP_CHUNKED_TRAILER;
+        i++;
+        break;
+
+      case HTTP_CHUNKED_TRAILER:
+        if (c == '\n') chunked->state = HTTP_CHUNKED_TRAILER_START;
+        i++;
+        break;
+    }
+  }
+  return i;
+}
+
+/* Returns 1 once the whole chunked body has been scanned. */
+int http_chunked_done(struct http_chunked *chunked) {
+  return chunked->state == HTTP_CHUNKED_DONE;
 }
 
 char* http_get_response_message(int status_code) {
@@ -73,6 +607,8 @@ char* http_get_response_message(int status_code) {
       return "Continue";
     case 200:
       return "OK";
+    case 206:
+      return "Partial Content";
     case 301:
       return "Moved Permanently";
     case 302:
@@ -89,13 +625,19 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
+    case 416:
+      return "Range Not Satisfiable";
+    case 502:
+      return "Bad Gateway";
+    case 503:
+      return "Service Unavailable";
     default:
       return "Internal Server Error";
   }
 }
 
 void http_start_response(int fd, int status_code) {
-  dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code,
+  dprintf(fd, "HTTP/1.1 %d %s\r\n", status_code,
       http_get_response_message(status_code));
 }
 
@@ -122,6 +664,505 @@ void http_send_data(int fd, char *data, size_t size) {
   }
 }
 
+/* Empties BUILDER so it can be reused for the next response. */
+void http_builder_reset(struct http_builder *builder) {
+  builder->length = 0;
+  builder->overflow = 0;
+}
+
+/* Appends SIZE bytes of DATA to BUILDER, or marks it overflowed. */
+void http_builder_append(struct http_builder *builder, char *data, size_t size) {
+  if (builder->overflow || size > sizeof(builder->buffer) - builder->length) {
+    builder->overflow = 1;
+    return;
+  }
+  memcpy(builder->buffer + builder->length, data, size);
+  builder->length += size;
+}
+
+void http_builder_start(struct http_builder *builder, int status_code) {
+  char status_line[64];
+  int length = snprintf(status_line, sizeof(status_line), "HTTP/1.1 %d %s\r\n",
+      status_code, http_get_response_message(status_code));
+  http_builder_reset(builder);
+  http_builder_append(builder, status_line, length);
+}
+
+void http_builder_header(struct http_builder *builder, char *key, char *value) {
+  http_builder_append(builder, key, strlen(key));
+  http_builder_append(builder, ": ", 2);
+  http_builder_append(builder, value, strlen(value));
+  http_builder_append(builder, "\r\n", 2);
+}
+
+void http_builder_end(struct http_builder *builder) {
+  http_builder_append(builder, "\r\n", 2);
+}
+
+/* Arena for the bodies of responses initialized on this thread. */
+static __thread struct arena *http_arena;
+
+void http_response_use_arena(struct arena *arena) {
+  http_arena = arena;
+}
+
+void http_response_init(struct http_response *response, int status_code,
+    char *content_type) {
+  memset(response, 0, sizeof(*response));
+  response->status_code = status_code;
+  response->content_type = content_type;
+  response->body_fd = -1;
+  response->file_fd = -1;
+  response->arena = http_arena;
+}
+
+void http_response_append(struct http_response *response, char *data, size_t size) {
+  if (response->body_length + size > response->body_capacity) {
+    size_t capacity = response->body_capacity ? response->body_capacity : 1024;
+    while (capacity < response->body_length + size) capacity *= 2;
+    if (response->arena != NULL) {
+      response->body = arena_grow(response->arena, response->body,
+          response->body_length, capacity);
+    } else {
+      response->body = realloc(response->body, capacity);
+    }
+    if (!response->body) http_fatal_error("Malloc failed");
+    response->body_capacity = capacity;
+  }
+  memcpy(response->body + response->body_length, data, size);
+  response->body_length += size;
+}
+
+void http_response_append_string(struct http_response *response, char *data) {
+  http_response_append(response, data, strlen(data));
+}
+
+/* Fills in RESPONSE with a short HTML page describing STATUS_CODE. */
+void http_response_error(struct http_response *response, int status_code) {
+  char message[128];
+  snprintf(message, sizeof(message), "<center><h1>%d %s</h1></center>",
+      status_code, http_get_response_message(status_code));
+  http_response_init(response, status_code, "text/html");
+  http_response_append_string(response, message);
+}
+
+/*
+ * Writes the ETag of a file described by STATBUF into ETAG: its inode, size
+ * and modification time, plus SUFFIX (or NULL) to tell apart other encodings
+ * of the same file.
+ */
+void http_format_etag(char *etag, size_t size, struct stat *statbuf, char *suffix) {
+  snprintf(etag, size, "\"%llx-%llx-%llx%s\"", (unsigned long long) statbuf->st_ino,
+      (unsigned long long) statbuf->st_size,
+      (unsigned long long) statbuf->st_mtim.tv_sec * 1000000000ULL + statbuf->st_mtim.tv_nsec,
+      suffix != NULL ? suffix : "");
+}
+
+/* Writes TIME into DATE as an HTTP date ("Sun, 06 Nov 1994 08:49:37 GMT"). */
+void http_format_date(char *date, size_t size, time_t time) {
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  strftime(date, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* Parses an HTTP date in any of the three formats HTTP/1.1 allows. Returns
+ * -1 if VALUE is not one. */
+static time_t http_parse_date(struct http_string *value) {
+  static const char *formats[] = {
+    "%a, %d %b %Y %H:%M:%S GMT",  /* IMF-fixdate */
+    "%A, %d-%b-%y %H:%M:%S GMT",  /* RFC 850 */
+    "%a %b %e %H:%M:%S %Y",       /* asctime */
+  };
+
+  char date[64];
+  if (value->length >= sizeof(date)) return -1;
+  memcpy(date, value->data, value->length);
+  date[value->length] = '\0';
+
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char *end = strptime(date, formats[i], &tm);
+    if (end != NULL && *end == '\0') return timegm(&tm);
+  }
+  return -1;
+}
+
+/* Sets the ETag and Last-Modified of RESPONSE from the file described by
+ * STATBUF. See http_format_etag for SUFFIX. */
+void http_response_set_validators(struct http_response *response,
+    struct stat *statbuf, char *suffix) {
+  http_format_etag(response->etag, sizeof(response->etag), statbuf, suffix);
+  response->last_modified = statbuf->st_mtim.tv_sec;
+}
+
+/*
+ * Returns 1 if the If-None-Match list VALUE holds ETAG or "*". Weak
+ * comparison is used, as for GET, so a W/ prefix on either side is ignored.
+ */
+static int http_etag_list_matches(struct http_string *value, char *etag) {
+  if (strncmp(etag, "W/", 2) == 0) etag += 2;
+  size_t etag_length = strlen(etag);
+  char *start = value->data;
+  char *end = value->data + value->length;
+
+  while (start < end) {
+    while (start < end && (*start == ' ' || *start == '\t' || *start == ',')) start++;
+    if (end - start >= 2 && strncmp(start, "W/", 2) == 0) start += 2;
+
+    // Commas may appear inside an entity tag, so it ends at its closing quote
+    char *item_end = start;
+    if (item_end < end && *item_end == '"') {
+      item_end = memchr(start + 1, '"', end - start - 1);
+      item_end = item_end != NULL ? item_end + 1 : end;
+    } else {
+      while (item_end < end && *item_end != ',' && *item_end != ' ' && *item_end != '\t')
+        item_end++;
+    }
+
+    if (item_end - start == 1 && *start == '*') return 1;
+    if ((size_t) (item_end - start) == etag_length
+        && strncmp(start, etag, etag_length) == 0) return 1;
+    start = item_end;
+  }
+  return 0;
+}
+
+/*
+ * Replaces RESPONSE, a 200 with validators, by a header-only 304 if REQUEST
+ * shows that the client's copy is current: one of its If-None-Match tags
+ * matches, or, without If-None-Match, the file has not been modified since
+ * its If-Modified-Since date.
+ */
+void http_response_apply_conditionals(struct http_response *response,
+    struct http_request *request) {
+  if (response->status_code != 200) return;
+
+  int not_modified = 0;
+  struct http_string *if_none_match = http_request_header(request, "If-None-Match");
+  if (if_none_match != NULL) {
+    not_modified = response->etag[0] != '\0'
+        && http_etag_list_matches(if_none_match, response->etag);
+  } else if (response->last_modified != 0) {
+    struct http_string *if_modified_since = http_request_header(request, "If-Modified-Since");
+    if (if_modified_since != NULL) {
+      time_t since = http_parse_date(if_modified_since);
+      not_modified = since != -1 && response->last_modified <= since;
+    }
+  }
+  if (!not_modified) return;
+
+  char etag[sizeof(response->etag)];
+  strcpy(etag, response->etag);
+  time_t last_modified = response->last_modified;
+  char *content_encoding = response->content_encoding;
+  int vary_encoding = response->vary_encoding;
+
+  http_response_free(response);
+  http_response_init(response, 304, NULL);
+  strcpy(response->etag, etag);
+  response->last_modified = last_modified;
+  response->content_encoding = content_encoding;
+  response->vary_encoding = vary_encoding;
+}
+
+/*
+ * Returns 1 if the If-Range header of REQUEST, if any, still matches
+ * RESPONSE, so its ranges may be served. An entity tag must match exactly
+ * (strong comparison); a date must equal Last-Modified.
+ */
+static int http_if_range_matches(struct http_response *response,
+    struct http_request *request) {
+  struct http_string *if_range = http_request_header(request, "If-Range");
+  if (if_range == NULL) return 1;
+
+  if (if_range->length > 0 && (if_range->data[0] == '"' || if_range->data[0] == 'W')) {
+    return response->etag[0] == '"' && if_range->length == strlen(response->etag)
+        && strncmp(if_range->data, response->etag, if_range->length) == 0;
+  }
+  time_t date = http_parse_date(if_range);
+  return date != -1 && response->last_modified != 0 && date == response->last_modified;
+}
+
+/*
+ * Resolves the ranges of REQUEST against a body of SIZE bytes into RESOLVED,
+ * with both ends given as offsets. Ranges that start past the end are
+ * dropped. Returns how many are left.
+ */
+static int http_ranges_resolve(struct http_request *request, off_t size,
+    struct http_byte_range *resolved) {
+  int count = 0;
+  for (int i = 0; i < request->num_ranges; i++) {
+    struct http_byte_range range = request->ranges[i];
+    if (range.first == -1) {
+      // The last LAST bytes
+      if (range.last == 0 || size == 0) continue;
+      range.first = range.last < size ? size - range.last : 0;
+      range.last = size - 1;
+    } else {
+      if (range.first >= size) continue;
+      if (range.last == -1 || range.last >= size) range.last = size - 1;
+    }
+    resolved[count++] = range;
+  }
+  return count;
+}
+
+/* Copies LENGTH bytes at OFFSET of RESPONSE's body or file into RESULT. A
+ * mapped body is read from its file. */
+static int http_response_copy_slice(struct http_response *response, off_t offset,
+    size_t length, struct http_response *result) {
+  int fd = response->file_fd != -1 ? response->file_fd : response->body_fd;
+  if (fd == -1) {
+    http_response_append(result, response->body + offset, length);
+    return 0;
+  }
+
+  char buf[8192];
+  offset += response->file_offset;
+  while (length > 0) {
+    ssize_t read_len = pread(fd, buf,
+        length < sizeof(buf) ? length : sizeof(buf), offset);
+    if (read_len < 0 && errno == EINTR) continue;
+    if (read_len <= 0) return -1;
+    http_response_append(result, buf, read_len);
+    offset += read_len;
+    length -= read_len;
+  }
+  return 0;
+}
+
+/*
+ * Narrows RESPONSE, a 200 carrying a whole file either in its body or as its
+ * file, to the byte ranges REQUEST asks for:
+ *
+ *   1) No Range header, one this cannot honour, or an If-Range naming an
+ *      older version: RESPONSE is left as it is.
+ *   2) One range: a 206 sending just that slice, still from the same buffer
+ *      or file, so nothing is copied.
+ *   3) Several ranges: a 206 with a multipart/byteranges body, assembled in
+ *      memory, up to LIBHTTP_MULTIPART_MAX bytes of data.
+ *   4) Only ranges past the end: a 416.
+ */
+void http_response_apply_ranges(struct http_response *response,
+    struct http_request *request) {
+  if (request->num_ranges == 0 || response->status_code != 200
+      || response->content_encoding != NULL || response->content_type == NULL
+      || !http_if_range_matches(response, request)) {
+    return;
+  }
+
+  off_t size = response->file_fd != -1 ? response->file_length : response->body_length;
+  struct http_byte_range ranges[LIBHTTP_MAX_RANGES];
+  int num_ranges = http_ranges_resolve(request, size, ranges);
+
+  if (num_ranges == 0) {
+    http_response_free(response);
+    http_response_error(response, 416);
+    snprintf(response->content_range, sizeof(response->content_range),
+        "bytes */%lld", (long long) size);
+    return;
+  }
+
+  if (num_ranges == 1) {
+    size_t length = ranges[0].last - ranges[0].first + 1;
+    if (response->file_fd != -1) {
+      response->file_offset += ranges[0].first;
+      response->file_length = length;
+    } else if (response->release != NULL) {
+      response->body += ranges[0].first;
+      response->body_length = length;
+    } else {
+      memmove(response->body, response->body + ranges[0].first, length);
+      response->body_length = length;
+    }
+    response->status_code = 206;
+    response->headers = NULL;
+    snprintf(response->content_range, sizeof(response->content_range),
+        "bytes %lld-%lld/%lld", (long long) ranges[0].first,
+        (long long) ranges[0].last, (long long) size);
+    return;
+  }
+
+  size_t total = 0;
+  for (int i = 0; i < num_ranges; i++) total += ranges[i].last - ranges[i].first + 1;
+  if (total > LIBHTTP_MULTIPART_MAX) return;
+
+  struct http_response multipart;
+  http_response_init(&multipart, 206,
+      "multipart/byteranges; boundary=" LIBHTTP_MULTIPART_BOUNDARY);
+  for (int i = 0; i < num_ranges; i++) {
+    char part_headers[256];
+    int length = snprintf(part_headers, sizeof(part_headers),
+        "\r\n--" LIBHTTP_MULTIPART_BOUNDARY "\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+        response->content_type, (long long) ranges[i].first,
+        (long long) ranges[i].last, (long long) size);
+    http_response_append(&multipart, part_headers, length);
+    if (http_response_copy_slice(response, ranges[i].first,
+          ranges[i].last - ranges[i].first + 1, &multipart) < 0) {
+      // Send the whole file rather than a broken part
+      http_response_free(&multipart);
+      return;
+    }
+  }
+  http_response_append_string(&multipart,
+      "\r\n--" LIBHTTP_MULTIPART_BOUNDARY "--\r\n");
+
+  http_response_free(response);
+  *response = multipart;
+}
+
+/*
+ * Writes the status line and headers for RESPONSE into BUILDER, including the
+ * blank line that ends them. Returns their length, or 0 if they did not fit.
+ */
+size_t http_response_format_headers(struct http_response *response,
+    struct http_builder *builder) {
+  if (response->headers != NULL) {
+    http_builder_reset(builder);
+    http_builder_append(builder, response->headers, response->headers_length);
+  } else {
+    char content_length[32];
+    snprintf(content_length, sizeof(content_length), "%zu",
+        response->body_length + response->file_length);
+
+    http_builder_start(builder, response->status_code);
+    if (response->content_type != NULL) {
+      http_builder_header(builder, "Content-Type", response->content_type);
+    }
+    if (response->content_encoding != NULL) {
+      if (response->status_code != 304) {
+        http_builder_header(builder, "Content-Encoding", response->content_encoding);
+      }
+    }
+    if (response->content_encoding != NULL || response->vary_encoding) {
+      http_builder_header(builder, "Vary", "Accept-Encoding");
+    }
+    if (response->etag[0] != '\0') http_builder_header(builder, "ETag", response->etag);
+    if (response->last_modified != 0) {
+      char date[64];
+      http_format_date(date, sizeof(date), response->last_modified);
+      http_builder_header(builder, "Last-Modified", date);
+    }
+    if (response->content_range[0] != '\0') {
+      http_builder_header(builder, "Content-Range", response->content_range);
+    } else if (response->status_code == 200 && response->file_fd != -1
+        && response->content_encoding == NULL) {
+      http_builder_header(builder, "Accept-Ranges", "bytes");
+    }
+    // A 304 has no body, and its length would be that of the full response
+    if (response->status_code != 304) {
+      http_builder_header(builder, "Content-Length", content_length);
+    }
+  }
+  http_builder_header(builder, "Connection", response->keep_alive ? "keep-alive" : "close");
+  http_builder_end(builder);
+
+  return builder->overflow ? 0 : builder->length;
+}
+
+/*
+ * Writes all of IOV to FD with sendmsg FLAGS, blocking until done or the
+ * write fails.
+ */
+static void http_send_vector(int fd, struct iovec *iov, int iovcnt, int flags) {
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+
+  while (iovcnt > 0) {
+    message.msg_iov = iov;
+    message.msg_iovlen = iovcnt;
+    ssize_t bytes_sent = sendmsg(fd, &message, flags | MSG_NOSIGNAL);
+    if (bytes_sent < 0 && errno == EINTR) continue;
+    if (bytes_sent < 0) return;
+
+    while (iovcnt > 0 && (size_t) bytes_sent >= iov->iov_len) {
+      bytes_sent -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + bytes_sent;
+      iov->iov_len -= bytes_sent;
+    }
+  }
+}
+
+/*
+ * Sends RESPONSE on FD, blocking until it has been written completely. The
+ * headers are built in BUILDER and go out in the same sendmsg as the
+ * in-memory body. If a file follows, that sendmsg carries MSG_MORE so the
+ * kernel can fill the first segment with file data too.
+ */
+void http_send_response(int fd, struct http_response *response,
+    struct http_builder *builder) {
+  size_t headers_length = http_response_format_headers(response, builder);
+  if (headers_length == 0) return;
+
+  struct iovec iov[2];
+  iov[0].iov_base = builder->buffer;
+  iov[0].iov_len = headers_length;
+  iov[1].iov_base = response->body;
+  iov[1].iov_len = response->body_length;
+  http_send_vector(fd, iov, response->body_length > 0 ? 2 : 1,
+      response->file_fd != -1 ? MSG_MORE : 0);
+
+  if (response->file_fd != -1) {
+    http_send_file(fd, response->file_fd, response->file_offset, response->file_length);
+  }
+}
+
+/* Releases the body buffer and closes the body file of RESPONSE. A body from
+ * an arena is left for the arena to reclaim. */
+void http_response_free(struct http_response *response) {
+  if (response->release != NULL) {
+    response->release(response->release_arg);
+    response->release = NULL;
+    response->headers = NULL;
+  } else {
+    if (response->arena == NULL) free(response->body);
+    if (response->file_fd != -1) close(response->file_fd);
+  }
+  response->body = NULL;
+  response->body_length = response->body_capacity = 0;
+  response->body_fd = -1;
+  response->file_fd = -1;
+}
+
+/*
+ * Sends LENGTH bytes of FILE_FD, starting at OFFSET, on FD. The data goes out
+ * with sendfile so it is never copied through user space. Files that sendfile
+ * cannot read from fall back to a pread/write loop. The file position of
+ * FILE_FD is never used, so the same file may be sent on several sockets at
+ * once.
+ */
+void http_send_file(int fd, int file_fd, off_t offset, size_t length) {
+  while (length > 0) {
+    ssize_t bytes_sent = sendfile(fd, file_fd, &offset, length);
+    if (bytes_sent > 0) {
+      length -= bytes_sent;
+    } else if (bytes_sent < 0 && errno == EINTR) {
+      continue;
+    } else if (bytes_sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+      break;
+    } else {
+      return;
+    }
+  }
+
+  char buf[8192];
+  while (length > 0) {
+    ssize_t read_len = pread(file_fd, buf, length < sizeof(buf) ? length : sizeof(buf), offset);
+    if (read_len < 0 && errno == EINTR) continue;
+    if (read_len <= 0) return;
+    http_send_data(fd, buf, read_len);
+    offset += read_len;
+    length -= read_len;
+  }
+}
+
 char *http_get_mime_type(char *file_name) {
   char *file_extension = strrchr(file_name, '.');
   if (file_extension == NULL) {
@@ -144,3 +1185,9 @@ char *http_get_mime_type(char *file_name) {
     return "text/plain";
   }
 }
+
+/* Returns 1 if bodies of CONTENT_TYPE are text, worth compressing. */
+int http_mime_type_compressible(char *content_type) {
+  return strncmp(content_type, "text/", 5) == 0
+      || strcmp(content_type, "application/javascript") == 0;
+}
@@ -3,16 +3,22 @@
  *
  * Usage example:
  *
+ *     struct http_connection connection;
+ *     http_connection_init(&connection, fd);
+ *
  *     // Returns NULL if an error was encountered.
- *     struct http_request *request = http_request_parse(fd);
+ *     struct http_request *request = http_connection_read_request(&connection);
  *
  *     ...
  *
- *     http_start_response(fd, 200);
- *     http_send_header(fd, "Content-type", http_get_mime_type("index.html"));
- *     http_send_header(fd, "Server", "httpserver/1.0");
- *     http_end_headers(fd);
- *     http_send_string(fd, "<html><body><a href='/'>Home</a></body></html>");
+ *     struct http_response response;
+ *     http_response_init(&response, 200, http_get_mime_type("index.html"));
+ *     http_response_append_string(&response,
+ *         "<html><body><a href='/'>Home</a></body></html>");
+ *
+ *     // Status line, headers and body go out in a single syscall.
+ *     http_send_response(fd, &response, &connection.builder);
+ *     http_response_free(&response);
  *
  *     close(fd);
  */
@@ -20,28 +26,234 @@
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "arena.h"
+
+#define LIBHTTP_REQUEST_MAX_SIZE 8192
+
 /*
  * Functions for parsing an HTTP request.
+ *
+ * The parser never allocates. Every field of a parsed request is a view
+ * (pointer and length, not null-terminated) into the caller's buffer, so the
+ * request is only valid while those bytes stay in place.
  */
+#define LIBHTTP_MAX_HEADERS 64
+
+struct http_string {
+  char *data;
+  size_t length;
+};
+
+struct http_header {
+  struct http_string name;
+  struct http_string value;
+};
+
+/* One range of a Range: bytes= header, as sent. */
+#define LIBHTTP_MAX_RANGES 16
+
+struct http_byte_range {
+  off_t first;                  /* -1 for a suffix range: the last LAST bytes. */
+  off_t last;                   /* -1 if the range runs to the end. */
+};
+
 struct http_request {
-  char *method;
-  char *path;
+  struct http_string method;
+  struct http_string path;
+  struct http_string version;   /* Empty for a bare "GET /path" request. */
+  struct http_header headers[LIBHTTP_MAX_HEADERS];
+  int num_headers;
+  int keep_alive;               /* Client allows the connection to be reused. */
+  size_t content_length;
+  struct http_byte_range ranges[LIBHTTP_MAX_RANGES];
+  int num_ranges;               /* 0 without a valid Range header. */
+};
+
+/*
+ * A resumable request parser. Feed it the same buffer, growing, until it
+ * reports a complete request; bytes examined on earlier calls are not
+ * scanned again.
+ */
+struct http_parser {
+  int state;
+  size_t offset;                /* Bytes of the buffer already examined. */
+  size_t mark;                  /* Start of the token being read. */
+};
+
+#define HTTP_PARSE_ERROR -1
+#define HTTP_PARSE_INCOMPLETE 0
+
+void http_parser_init(struct http_parser *parser, struct http_request *request);
+ssize_t http_parser_execute(struct http_parser *parser, struct http_request *request,
+    char *buffer, size_t length);
+
+int http_string_equals(struct http_string *string, char *literal);
+struct http_string *http_request_header(struct http_request *request, char *name);
+int http_request_accepts_encoding(struct http_request *request, char *coding);
+
+/*
+ * Persistent (keep-alive) connections. A connection is closed after
+ * http_keep_alive_max requests, or once it has been idle for
+ * http_keep_alive_timeout seconds.
+ */
+extern int http_keep_alive_timeout;
+extern int http_keep_alive_max;
+
+/*
+ * Accumulates a status line and headers in memory, so they can be sent in the
+ * same syscall as the start of the body instead of one write per line. Each
+ * connection keeps one and reuses it for every response.
+ */
+#define LIBHTTP_HEADERS_MAX_SIZE 1024
+
+struct http_builder {
+  size_t length;
+  int overflow;           /* Set if the headers did not fit. */
+  char buffer[LIBHTTP_HEADERS_MAX_SIZE];
 };
 
-struct http_request *http_request_parse(int fd);
+void http_builder_reset(struct http_builder *builder);
+void http_builder_append(struct http_builder *builder, char *data, size_t size);
+void http_builder_start(struct http_builder *builder, int status_code);
+void http_builder_header(struct http_builder *builder, char *key, char *value);
+void http_builder_end(struct http_builder *builder);
+
+/*
+ * A client connection. Response bodies and other memory needed for one
+ * request come from the connection's arena (see http_response_use_arena),
+ * which is reset as the next request is read.
+ */
+struct http_connection {
+  int fd;
+  int closed;             /* Client closed, timed out or failed. */
+  int requests;           /* Requests read so far. */
+  size_t length;          /* Bytes buffered. */
+  size_t consumed;        /* Bytes of the buffer used by the last request. */
+  uint64_t started;       /* When the first byte of the request was read. */
+  struct http_parser parser;
+  struct http_request request;
+  struct http_builder builder;
+  struct arena arena;
+  char buffer[LIBHTTP_REQUEST_MAX_SIZE];
+};
+
+void http_connection_init(struct http_connection *connection, int fd);
+struct http_request *http_connection_read_request(struct http_connection *connection);
+void http_connection_free(struct http_connection *connection);
+
+/*
+ * Reading a response from an upstream server, for proxying. Only the status
+ * and the headers that decide where the body ends are parsed; the response is
+ * forwarded as received.
+ */
+struct http_response_head {
+  int status_code;
+  int keep_alive;               /* Server allows the connection to be reused. */
+  int chunked;                  /* Body uses chunked transfer coding. */
+  ssize_t content_length;       /* -1 if absent. */
+};
+
+ssize_t http_response_head_parse(char *buffer, size_t length,
+    struct http_response_head *head);
+
+/* Finds the end of a chunked body as its bytes stream past. */
+struct http_chunked {
+  int state;
+  size_t remaining;             /* Bytes left in the current chunk. */
+};
+
+void http_chunked_init(struct http_chunked *chunked);
+ssize_t http_chunked_scan(struct http_chunked *chunked, char *data, size_t length);
+int http_chunked_done(struct http_chunked *chunked);
 
 /*
  * Functions for sending an HTTP response.
  */
+char *http_get_response_message(int status_code);
 void http_start_response(int fd, int status_code);
 void http_send_header(int fd, char *key, char *value);
 void http_end_headers(int fd);
 void http_send_string(int fd, char *data);
 void http_send_data(int fd, char *data, size_t size);
+void http_send_file(int fd, int file_fd, off_t offset, size_t length);
+
+/*
+ * A complete response: a status code and content type, followed by a body
+ * that is an in-memory buffer, a slice of an open file, or both. Request
+ * handlers fill one of these in so the same response can be sent by either
+ * the blocking path (http_send_response) or the event loop.
+ *
+ * A response may also borrow preformatted headers, its body and its file from
+ * a cache. In that case RELEASE is set, and is called with RELEASE_ARG instead
+ * of freeing the body and closing the file once the response has been sent.
+ * A borrowed file may be sent by several responses at once, so it is always
+ * read at explicit offsets, never through its file position. A borrowed body
+ * may map a file that has since shrunk, so ranges are copied from BODY_FD
+ * when it is set, where reading past the end fails instead of faulting.
+ */
+struct http_response {
+  int status_code;
+  char *content_type;
+  char *body;             /* Body allocated from ARENA or the heap, or NULL. */
+  size_t body_length;
+  size_t body_capacity;
+  struct arena *arena;    /* Arena the body grows in, or NULL for the heap. */
+  char *content_encoding; /* Content-Encoding of the body, or NULL. */
+  int vary_encoding;      /* Another encoding may be sent: add Vary anyway. */
+  char content_range[64]; /* Content-Range of a partial response, or "". */
+  char etag[48];          /* ETag of the body, or "". */
+  time_t last_modified;   /* Last-Modified of the body, or 0. */
+  int body_fd;            /* File a borrowed BODY maps, or -1. */
+  int file_fd;            /* File to send after the body, or -1. */
+  off_t file_offset;
+  size_t file_length;
+  int keep_alive;         /* Keep the connection open after this response. */
+
+  char *headers;          /* Status line and headers, without Connection. */
+  size_t headers_length;
+  void (*release)(void *release_arg);
+  void *release_arg;
+};
+
+/* Ranges of a multi-range request are copied into one multipart body, so
+ * their total size is limited. */
+#define LIBHTTP_MULTIPART_MAX (8 << 20)
+#define LIBHTTP_MULTIPART_BOUNDARY "7f3a9c1e5b2d4086"
+
+/* A response takes its body from the arena last given to
+ * http_response_use_arena on the thread that initializes it, so the body is
+ * freed with the arena instead of on its own. Bodies that outlive the request
+ * must be built with no arena in use. */
+void http_response_use_arena(struct arena *arena);
+void http_response_init(struct http_response *response, int status_code,
+    char *content_type);
+void http_response_append(struct http_response *response, char *data, size_t size);
+void http_response_append_string(struct http_response *response, char *data);
+void http_response_error(struct http_response *response, int status_code);
+void http_response_set_validators(struct http_response *response,
+    struct stat *statbuf, char *suffix);
+void http_response_apply_conditionals(struct http_response *response,
+    struct http_request *request);
+void http_response_apply_ranges(struct http_response *response,
+    struct http_request *request);
+void http_format_etag(char *etag, size_t size, struct stat *statbuf, char *suffix);
+void http_format_date(char *date, size_t size, time_t time);
+size_t http_response_format_headers(struct http_response *response,
+    struct http_builder *builder);
+void http_send_response(int fd, struct http_response *response,
+    struct http_builder *builder);
+void http_response_free(struct http_response *response);
 
 /*
  * Helper function: gets the Content-Type based on a file name.
  */
 char *http_get_mime_type(char *file_name);
+int http_mime_type_compressible(char *content_type);
 
 #endif
@@ -0,0 +1,239 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "libhttp.h"
+#include "metrics.h"
+
+#define METRICS_MAX_THREADS 1024
+#define METRICS_CACHE_LINE 64
+
+/* Histogram buckets exported to Prometheus: every power of two nanoseconds
+ * from 2^METRICS_EXPORT_FIRST up. */
+#define METRICS_EXPORT_FIRST 10
+
+typedef struct metrics_slot {
+  int owned;                    // 1 while a live thread records into it.
+  uint64_t accepted;
+  uint64_t closed;
+  uint64_t responses[6];        // By status class, 1xx to 5xx; anything else in [0].
+  uint64_t bytes;
+  histogram_t phases[METRICS_NUM_PHASES];
+} __attribute__((aligned(METRICS_CACHE_LINE))) metrics_slot_t;
+
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static metrics_slot_t *slots[METRICS_MAX_THREADS];
+static int num_slots = 0;
+static pthread_key_t slot_key;
+static __thread metrics_slot_t *slot;
+
+/* Shared by threads beyond METRICS_MAX_THREADS, which may lose counts. */
+static metrics_slot_t overflow_slot;
+
+/* When each open client socket was accepted, indexed by fd. */
+static uint64_t *accept_times;
+static size_t accept_times_length = 0;
+
+static char *phase_names[METRICS_NUM_PHASES] = { "accept", "parse", "handler", "send" };
+
+static void metrics_release_slot(void *arg) {
+  pthread_mutex_lock(&slots_mutex);
+  ((metrics_slot_t *) arg)->owned = 0;
+  pthread_mutex_unlock(&slots_mutex);
+}
+
+/* Returns the calling thread's slot, claiming one on first use. */
+static metrics_slot_t *metrics_slot() {
+  if (slot != NULL) return slot;
+
+  pthread_mutex_lock(&slots_mutex);
+  for (int i = 0; i < num_slots && slot == NULL; i++) {
+    if (!slots[i]->owned) slot = slots[i];
+  }
+  if (slot == NULL && num_slots < METRICS_MAX_THREADS
+      && posix_memalign((void **) &slot, METRICS_CACHE_LINE, sizeof(metrics_slot_t)) == 0) {
+    memset(slot, 0, sizeof(metrics_slot_t));
+    slots[num_slots++] = slot;
+  }
+  if (slot != NULL) slot->owned = 1;
+  pthread_mutex_unlock(&slots_mutex);
+
+  if (slot == NULL) {
+    slot = &overflow_slot;
+  } else {
+    pthread_setspecific(slot_key, slot);
+  }
+  return slot;
+}
+
+/* Adds N to a counter that only the calling thread writes: a plain add, but
+ * never torn for a concurrent reader. */
+static inline void metrics_add(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void metrics_init() {
+  int error = pthread_key_create(&slot_key, metrics_release_slot);
+  if (error != 0) {
+    errno = error;
+    perror("Failed to create metrics key");
+    exit(errno);
+  }
+
+  struct rlimit limit;
+  size_t length = 65536;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+    length = limit.rlim_cur;
+  }
+  if (length > (1 << 20)) length = 1 << 20;
+  accept_times = calloc(length, sizeof(uint64_t));
+  if (accept_times != NULL) accept_times_length = length;
+}
+
+/* Counts a connection accepted on CLIENT_SOCKET_FD, and remembers when. */
+void metrics_accepted(int client_socket_fd) {
+  metrics_add(&metrics_slot()->accepted, 1);
+  if (client_socket_fd >= 0 && (size_t) client_socket_fd < accept_times_length) {
+    accept_times[client_socket_fd] = metrics_now();
+  }
+}
+
+/* Records how long CLIENT_SOCKET_FD waited to be served since it was
+ * accepted. */
+void metrics_serving(int client_socket_fd) {
+  if (client_socket_fd >= 0 && (size_t) client_socket_fd < accept_times_length) {
+    metrics_record(METRICS_ACCEPT, accept_times[client_socket_fd]);
+  }
+}
+
+void metrics_closed() {
+  metrics_add(&metrics_slot()->closed, 1);
+}
+
+/* Records PHASE as having run from START until now. Returns now, so it can
+ * start the next phase. */
+uint64_t metrics_record(enum metrics_phase phase, uint64_t start) {
+  uint64_t now = metrics_now();
+  uint64_t duration = now > start ? now - start : 0;
+  histogram_t *histogram = &metrics_slot()->phases[phase];
+  metrics_add(&histogram->count, 1);
+  metrics_add(&histogram->sum, duration);
+  metrics_add(&histogram->buckets[histogram_bucket(duration)], 1);
+  return now;
+}
+
+void metrics_count_response(int status_code, size_t bytes) {
+  metrics_slot_t *own = metrics_slot();
+  int class = status_code / 100;
+  metrics_add(&own->responses[class >= 1 && class <= 5 ? class : 0], 1);
+  metrics_add(&own->bytes, bytes);
+}
+
+static inline void metrics_sum_counter(uint64_t *total, uint64_t *counter) {
+  *total += __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* Adds every counter of FROM to TOTAL. */
+static void metrics_sum(metrics_slot_t *total, metrics_slot_t *from) {
+  metrics_sum_counter(&total->accepted, &from->accepted);
+  metrics_sum_counter(&total->closed, &from->closed);
+  for (int i = 0; i < 6; i++) metrics_sum_counter(&total->responses[i], &from->responses[i]);
+  metrics_sum_counter(&total->bytes, &from->bytes);
+  for (int phase = 0; phase < METRICS_NUM_PHASES; phase++) {
+    histogram_t *sum = &total->phases[phase], *histogram = &from->phases[phase];
+    metrics_sum_counter(&sum->count, &histogram->count);
+    metrics_sum_counter(&sum->sum, &histogram->sum);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      metrics_sum_counter(&sum->buckets[i], &histogram->buckets[i]);
+    }
+  }
+}
+
+/* Appends printf-style FORMAT to RESPONSE. */
+__attribute__((format(printf, 2, 3)))
+static void metrics_line(struct http_response *response, const char *format, ...) {
+  char line[512];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (length < 0) return;
+  if ((size_t) length >= sizeof(line)) length = sizeof(line) - 1;
+  http_response_append(response, line, length);
+}
+
+/* Appends the totals of every thread to RESPONSE, in the Prometheus text
+ * format. */
+void metrics_format(struct http_response *response) {
+  metrics_slot_t total;
+  memset(&total, 0, sizeof(total));
+
+  pthread_mutex_lock(&slots_mutex);
+  for (int i = 0; i < num_slots; i++) metrics_sum(&total, slots[i]);
+  pthread_mutex_unlock(&slots_mutex);
+  metrics_sum(&total, &overflow_slot);
+
+  metrics_line(response,
+      "# HELP httpserver_connections_accepted_total Connections accepted.\n"
+      "# TYPE httpserver_connections_accepted_total counter\n"
+      "httpserver_connections_accepted_total %lu\n", total.accepted);
+  metrics_line(response,
+      "# HELP httpserver_connections_active Connections accepted and not yet done with.\n"
+      "# TYPE httpserver_connections_active gauge\n"
+      "httpserver_connections_active %ld\n", (long) (total.accepted - total.closed));
+
+  metrics_line(response,
+      "# HELP httpserver_responses_total Responses sent, by status class.\n"
+      "# TYPE httpserver_responses_total counter\n");
+  for (int class = 1; class <= 5; class++) {
+    metrics_line(response, "httpserver_responses_total{code=\"%dxx\"} %lu\n",
+        class, total.responses[class]);
+  }
+  metrics_line(response, "httpserver_responses_total{code=\"other\"} %lu\n",
+      total.responses[0]);
+  metrics_line(response,
+      "# HELP httpserver_response_body_bytes_total Body bytes of responses built by this"
+      " server (proxied responses are not counted).\n"
+      "# TYPE httpserver_response_body_bytes_total counter\n"
+      "httpserver_response_body_bytes_total %lu\n", total.bytes);
+
+  metrics_line(response,
+      "# HELP httpserver_phase_seconds Time spent in each phase of serving a request.\n"
+      "# TYPE httpserver_phase_seconds histogram\n");
+  for (int phase = 0; phase < METRICS_NUM_PHASES; phase++) {
+    histogram_t *histogram = &total.phases[phase];
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    for (int exponent = METRICS_EXPORT_FIRST; exponent < HISTOGRAM_MAX_EXPONENT; exponent++) {
+      int limit = histogram_bucket((uint64_t) 1 << exponent);
+      for (; bucket < limit; bucket++) cumulative += histogram->buckets[bucket];
+      metrics_line(response, "httpserver_phase_seconds_bucket{phase=\"%s\",le=\"%.9g\"} %lu\n",
+          phase_names[phase], (double) ((uint64_t) 1 << exponent) / 1e9, cumulative);
+    }
+    metrics_line(response,
+        "httpserver_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n"
+        "httpserver_phase_seconds_sum{phase=\"%s\"} %.9f\n"
+        "httpserver_phase_seconds_count{phase=\"%s\"} %lu\n",
+        phase_names[phase], histogram->count, phase_names[phase],
+        (double) histogram->sum / 1e9, phase_names[phase], histogram->count);
+  }
+
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  metrics_line(response,
+      "# HELP httpserver_phase_quantile_seconds Phase durations since start at each quantile,"
+      " from the full resolution histograms.\n"
+      "# TYPE httpserver_phase_quantile_seconds gauge\n");
+  for (int phase = 0; phase < METRICS_NUM_PHASES; phase++) {
+    if (total.phases[phase].count == 0) continue;
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+      metrics_line(response,
+          "httpserver_phase_quantile_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+          phase_names[phase], quantiles[i],
+          (double) histogram_quantile(&total.phases[phase], quantiles[i]) / 1e9);
+    }
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef __METRICS__
+#define __METRICS__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "histogram.h"
+
+/* METRICS counts connections, responses and bytes, and records how long each
+ * phase of serving a request takes, for the /__metrics endpoint.
+ *
+ * Every thread records into a slot of its own, padded to a cache line, so
+ * recording is a plain add with no lock, no atomic read-modify-write and no
+ * cache line shared between threads. Slots are only added up when metrics
+ * are read. A thread that exits hands its slot, counts and all, on to the
+ * next thread that starts.
+ *
+ * Durations go into log-linear histograms (see HISTOGRAM), so any recorded
+ * value is known within 1/16. */
+
+enum metrics_phase {
+  METRICS_ACCEPT,       // From accept() until a thread starts serving.
+  METRICS_PARSE,        // From the first byte of a request until it is parsed.
+  METRICS_HANDLER,      // Building the response (or proxying the request).
+  METRICS_SEND,         // Sending the response.
+  METRICS_NUM_PHASES,
+};
+
+/* Path that serves the metrics, in the Prometheus text format. */
+#define METRICS_PATH "/__metrics"
+
+struct http_response;
+
+static inline uint64_t metrics_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void metrics_init();
+void metrics_accepted(int client_socket_fd);
+void metrics_serving(int client_socket_fd);
+void metrics_closed();
+uint64_t metrics_record(enum metrics_phase phase, uint64_t start);
+void metrics_count_response(int status_code, size_t bytes);
+void metrics_format(struct http_response *response);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * parserbench: a microbenchmark for the request parser in libhttp.
+ *
+ * Parses one browser-style request over and over on a single thread, either
+ * whole or fed to the parser in pieces the way a request split across TCP
+ * segments arrives, and reports requests parsed per second.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libhttp.h"
+
+/* A 330-byte request with 7 headers, as a browser sends it. */
+char *bench_request =
+  "GET /my_documents/credit.txt HTTP/1.1\r\n"
+  "Host: localhost:8000\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Connection: keep-alive\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "\r\n";
+
+long bench_iterations = 5000000;
+int bench_pieces = 1;
+
+static uint64_t bench_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+char *USAGE =
+  "Usage: ./parserbench [--iterations N] [--pieces N]\n"
+  "\n"
+  "       --iterations N         requests to parse (default 5000000)\n"
+  "       --pieces N             feed each request to the parser in N pieces (default 1)\n";
+
+void exit_with_usage() {
+  fprintf(stderr, "%s", USAGE);
+  exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp("--iterations", argv[i]) == 0) {
+      if (++i >= argc || (bench_iterations = atol(argv[i])) < 1) {
+        fprintf(stderr, "Expected positive integer after --iterations\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--pieces", argv[i]) == 0) {
+      if (++i >= argc || (bench_pieces = atoi(argv[i])) < 1) {
+        fprintf(stderr, "Expected positive integer after --pieces\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--help", argv[i]) == 0) {
+      exit_with_usage();
+    } else {
+      fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
+      exit_with_usage();
+    }
+  }
+
+  size_t length = strlen(bench_request);
+  if ((size_t) bench_pieces > length) bench_pieces = length;
+  char *buffer = malloc(length);
+  memcpy(buffer, bench_request, length);
+
+  static struct http_request request;
+  struct http_parser parser;
+  long num_headers = 0;
+
+  uint64_t start = bench_now();
+  for (long i = 0; i < bench_iterations; i++) {
+    http_parser_init(&parser, &request);
+    ssize_t parsed = HTTP_PARSE_INCOMPLETE;
+    for (int piece = 1; piece <= bench_pieces && parsed == HTTP_PARSE_INCOMPLETE; piece++) {
+      parsed = http_parser_execute(&parser, &request, buffer, length * piece / bench_pieces);
+    }
+    if (parsed != (ssize_t) length) {
+      fprintf(stderr, "Failed to parse the request\n");
+      exit(EXIT_FAILURE);
+    }
+    num_headers += request.num_headers;
+  }
+  double seconds = (bench_now() - start) / 1e9;
+
+  printf("%ld requests (%d headers each) in %d piece%s, %.2fs: %.2f M req/s, %.1f ns/req\n",
+      bench_iterations, (int) (num_headers / bench_iterations), bench_pieces,
+      bench_pieces == 1 ? "" : "s", seconds, bench_iterations / seconds / 1e6,
+      seconds * 1e9 / bench_iterations);
+  free(buffer);
+  return 0;
+}
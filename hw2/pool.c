@@ -0,0 +1,401 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "pool.h"
+
+/* Returns the number of connections queued at or being served by WORKER. */
+static size_t pool_worker_load(pool_worker_t *worker) {
+  return wq_size(&worker->queue) + __atomic_load_n(&worker->busy, __ATOMIC_RELAXED);
+}
+
+/* Takes a connection queued at another worker of the pool. Returns 1 and
+ * stores it in *CLIENT_SOCKET_FD, and when it was queued in *PUSHED, on
+ * success, or 0 if every queue is empty. */
+static int pool_steal(pool_worker_t *thief, int *client_socket_fd, uint64_t *pushed) {
+  pool_t *pool = thief->pool;
+  int num_workers = __atomic_load_n(&pool->num_workers, __ATOMIC_ACQUIRE);
+  for (int i = 1; i < num_workers; i++) {
+    pool_worker_t *victim = &pool->workers[(thief->index + i) % num_workers];
+    if (wq_size(&victim->queue) > 0 && wq_try_pop(&victim->queue, client_socket_fd, pushed)) {
+      __atomic_add_fetch(&thief->stolen, 1, __ATOMIC_RELAXED);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Turns CLIENT_SOCKET_FD away: tells the client, if POOL has a way to, and
+ * closes it. */
+static void pool_shed(pool_t *pool, int client_socket_fd) {
+  if (pool->admission.shed != NULL) pool->admission.shed(client_socket_fd);
+  close(client_socket_fd);
+  metrics_closed();
+  __atomic_add_fetch(&pool->shed, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns 1 if CoDel sheds a connection dequeued at NOW after waiting WAIT
+ * nanoseconds. A queue whose shortest wait over the last interval was above
+ * target is standing, not absorbing a burst: until that changes, connections
+ * that waited longer than the target are shed. Otherwise only those that
+ * waited longer than a whole interval are. Clients do not back off the way
+ * TCP senders do, so this sheds the standing queue at once rather than at
+ * CoDel's slowly rising packet drop rate.
+ */
+static int pool_codel_shed(pool_t *pool, uint64_t wait, uint64_t now) {
+  pool_admission_t *admission = &pool->admission;
+
+  uint64_t end = __atomic_load_n(&pool->codel_interval_end, __ATOMIC_ACQUIRE);
+  if (now >= end && __atomic_compare_exchange_n(&pool->codel_interval_end, &end,
+        now + admission->codel_interval, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    uint64_t min_wait = __atomic_exchange_n(&pool->codel_min_wait, UINT64_MAX, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&pool->codel_standing,
+        min_wait != UINT64_MAX && min_wait > admission->codel_target, __ATOMIC_RELEASE);
+  }
+
+  uint64_t min_wait = __atomic_load_n(&pool->codel_min_wait, __ATOMIC_RELAXED);
+  while (wait < min_wait && !__atomic_compare_exchange_n(&pool->codel_min_wait, &min_wait,
+        wait, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+
+  int standing = __atomic_load_n(&pool->codel_standing, __ATOMIC_ACQUIRE);
+  return wait > (standing ? admission->codel_target : admission->codel_interval);
+}
+
+/* Returns 1 if a connection queued at PUSHED is to be shed rather than
+ * served: it is past the deadline, or CoDel says so. */
+static int pool_late(pool_t *pool, uint64_t pushed) {
+  pool_admission_t *admission = &pool->admission;
+  if (admission->deadline == 0 && admission->policy != POOL_SHED_CODEL) return 0;
+
+  uint64_t now = metrics_now();
+  uint64_t wait = now > pushed ? now - pushed : 0;
+  if (admission->deadline > 0 && wait > admission->deadline) return 1;
+  return admission->policy == POOL_SHED_CODEL && pool_codel_shed(pool, wait, now);
+}
+
+static void pool_serve(pool_worker_t *worker, int client_socket_fd) {
+  __atomic_store_n(&worker->busy, 1, __ATOMIC_RELAXED);
+  metrics_serving(client_socket_fd);
+  worker->pool->handler(client_socket_fd);
+  close(client_socket_fd);
+  metrics_closed();
+  __atomic_store_n(&worker->busy, 0, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&worker->served, 1, __ATOMIC_RELAXED);
+}
+
+/* Serves or sheds a connection WORKER took off a queue, where it was queued
+ * at PUSHED. */
+static void pool_take(pool_worker_t *worker, int client_socket_fd, uint64_t pushed) {
+  pool_t *pool = worker->pool;
+  __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+  if (pool_late(pool, pushed)) {
+    pool_shed(pool, client_socket_fd);
+  } else {
+    pool_serve(worker, client_socket_fd);
+  }
+}
+
+/*
+ * Takes WORKER out of use if it is the last worker and the pool is above its
+ * minimum size. Returns 1 if it was, once every connection handed to it has
+ * been served; its thread must then exit.
+ */
+static int pool_retire(pool_worker_t *worker) {
+  pool_t *pool = worker->pool;
+  pthread_mutex_lock(&pool->mutex);
+  int last = worker->index == pool->num_workers - 1 && pool->num_workers > pool->min_workers;
+  if (last) __atomic_store_n(&pool->num_workers, worker->index, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&pool->mutex);
+  if (!last) return 0;
+
+  /* A submit that read the old size may still push to this worker's queue;
+   * wait until it is done, then serve whatever was left. */
+  while (__atomic_load_n(&pool->submitting, __ATOMIC_SEQ_CST)) usleep(100);
+  int client_socket_fd;
+  uint64_t pushed;
+  while (wq_try_pop(&worker->queue, &client_socket_fd, &pushed)) {
+    pool_take(worker, client_socket_fd, pushed);
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  worker->running = 0;
+  pool->retired++;
+  pthread_mutex_unlock(&pool->mutex);
+
+  /* The worker before this one is now last, and may have been idle long
+   * enough to retire too. */
+  if (worker->index > pool->min_workers) wq_interrupt(&pool->workers[worker->index - 1].queue);
+  return 1;
+}
+
+static void *pool_worker_func(void *arg) {
+  pool_worker_t *worker = arg;
+  pool_t *pool = worker->pool;
+  int retires = pool->idle_timeout > 0 && worker->index >= pool->min_workers;
+
+  if (pool->pinned) {
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &pool->cpus);
+  }
+
+  uint64_t idle_since = metrics_now();
+  while (1) {
+    int client_socket_fd;
+    uint64_t pushed;
+    if (!wq_try_pop(&worker->queue, &client_socket_fd, &pushed)
+        && !pool_steal(worker, &client_socket_fd, &pushed)) {
+      // Nothing to do anywhere; wait for the acceptor.
+      if (!retires) {
+        client_socket_fd = wq_pop_stamped(&worker->queue, &pushed);
+      } else {
+        uint64_t idle = metrics_now() - idle_since;
+        if (idle >= pool->idle_timeout && pool_retire(worker)) break;
+        uint64_t wait = idle < pool->idle_timeout ? pool->idle_timeout - idle : pool->idle_timeout;
+        if (!wq_pop_timeout(&worker->queue, &client_socket_fd, &pushed, wait)) continue;
+      }
+    }
+    pool_take(worker, client_socket_fd, pushed);
+    idle_since = metrics_now();
+  }
+  return NULL;
+}
+
+/* Starts the thread of worker INDEX of POOL. pool->mutex must be held, or
+ * the pool not yet shared. */
+static void pool_start_worker(pool_t *pool, int index) {
+  pool_worker_t *worker = &pool->workers[index];
+  if (!worker->initialized) {
+    worker->index = index;
+    worker->pool = pool;
+    worker->busy = 0;
+    worker->served = 0;
+    worker->stolen = 0;
+    wq_init(&worker->queue);
+    worker->initialized = 1;
+  }
+  worker->running = 1;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, pool_worker_func, worker) != 0) {
+    perror("Failed to create worker thread");
+    exit(errno);
+  }
+  pthread_detach(thread);
+}
+
+/* Adds a worker to POOL unless it is at its maximum size, or the last worker
+ * to retire has not finished yet. */
+static void pool_grow(pool_t *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  int index = pool->num_workers;
+  if (index < pool->max_workers && !pool->workers[index].running) {
+    pool_start_worker(pool, index);
+    pool->started++;
+    __atomic_store_n(&pool->num_workers, index + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Samples the wait of the oldest queued connection four times per wait
+ * target, and grows the pool by a worker each time it is over the target. */
+static void *pool_manager_func(void *arg) {
+  pool_t *pool = arg;
+  uint64_t interval = pool->wait_target / 4;
+  struct timespec tick = {
+    .tv_sec = interval / 1000000000,
+    .tv_nsec = interval % 1000000000,
+  };
+
+  while (1) {
+    nanosleep(&tick, NULL);
+
+    uint64_t now = metrics_now(), wait = 0;
+    int num_workers = __atomic_load_n(&pool->num_workers, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < num_workers; i++) {
+      uint64_t pushed = wq_oldest(&pool->workers[i].queue);
+      if (pushed != 0 && pushed < now && now - pushed > wait) wait = now - pushed;
+    }
+    __atomic_store_n(&pool->queue_wait, wait, __ATOMIC_RELAXED);
+    if (wait > pool->wait_target) pool_grow(pool);
+  }
+  return NULL;
+}
+
+/*
+ * Starts MIN_WORKERS threads that call HANDLER for every submitted socket and
+ * then close it. While connections wait longer than WAIT_TARGET nanoseconds
+ * for a worker, more are started, up to MAX_WORKERS; those retire again after
+ * IDLE_TIMEOUT nanoseconds without work (0 = never). If CPUS is not NULL, the
+ * workers are pinned to it.
+ */
+void pool_init(pool_t *pool, int min_workers, int max_workers, uint64_t wait_target,
+    uint64_t idle_timeout, pool_handler handler, cpu_set_t *cpus) {
+  if (max_workers < min_workers) max_workers = min_workers;
+  pool->num_workers = 0;
+  pool->next = 0;
+  pool->submitting = 0;
+  pool->handler = handler;
+  pool->pinned = cpus != NULL;
+  if (cpus != NULL) pool->cpus = *cpus;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pool->min_workers = min_workers;
+  pool->max_workers = max_workers;
+  pool->wait_target = wait_target;
+  pool->idle_timeout = idle_timeout;
+  pool->queue_wait = 0;
+  pool->started = 0;
+  pool->retired = 0;
+  memset(&pool->admission, 0, sizeof(pool->admission));
+  pool->queued = 0;
+  pool->shed = 0;
+  pool->codel_interval_end = 0;
+  pool->codel_min_wait = UINT64_MAX;
+  pool->codel_standing = 0;
+
+  /* Queues are only set up when a worker first starts. */
+  if (posix_memalign((void **) &pool->workers, WQ_CACHE_LINE,
+        max_workers * sizeof(pool_worker_t)) != 0) {
+    fprintf(stderr, "Failed to allocate thread pool\n");
+    exit(ENOMEM);
+  }
+  memset(pool->workers, 0, max_workers * sizeof(pool_worker_t));
+
+  for (int i = 0; i < min_workers; i++) pool_start_worker(pool, i);
+  pool->num_workers = min_workers;
+
+  if (max_workers > min_workers && wait_target > 0) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pool_manager_func, pool) != 0) {
+      perror("Failed to create thread pool manager");
+      exit(errno);
+    }
+    pthread_detach(thread);
+  }
+}
+
+/* Sets how POOL bounds its queue and sheds load. Must be called before the
+ * first submit. */
+void pool_set_admission(pool_t *pool, pool_admission_t *admission) {
+  pool->admission = *admission;
+}
+
+/* Sheds the connection that has been queued at POOL the longest. Returns 1,
+ * or 0 if the queues are empty. */
+static int pool_drop_oldest(pool_t *pool) {
+  int num_workers = __atomic_load_n(&pool->num_workers, __ATOMIC_ACQUIRE);
+  int oldest = -1;
+  uint64_t oldest_pushed = UINT64_MAX;
+  for (int i = 0; i < num_workers; i++) {
+    uint64_t pushed = wq_oldest(&pool->workers[i].queue);
+    if (pushed != 0 && pushed < oldest_pushed) {
+      oldest = i;
+      oldest_pushed = pushed;
+    }
+  }
+
+  int client_socket_fd;
+  if (oldest == -1 || !wq_try_pop(&pool->workers[oldest].queue, &client_socket_fd, NULL)) {
+    return 0;
+  }
+  __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+  pool_shed(pool, client_socket_fd);
+  return 1;
+}
+
+/*
+ * Hands CLIENT_SOCKET_FD to the least loaded worker of POOL, or sheds it if
+ * the queue is at its limit. Blocks only if every worker's queue is full.
+ * Must be called from a single thread.
+ */
+void pool_submit(pool_t *pool, int client_socket_fd) {
+  pool_admission_t *admission = &pool->admission;
+  if (admission->limit > 0 && __atomic_load_n(&pool->queued, __ATOMIC_RELAXED) >= admission->limit
+      && (admission->policy != POOL_SHED_DROP_OLDEST || !pool_drop_oldest(pool))) {
+    pool_shed(pool, client_socket_fd);
+    return;
+  }
+  __atomic_add_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+
+  /* Tells a retiring worker to wait until its queue can no longer be picked. */
+  __atomic_store_n(&pool->submitting, 1, __ATOMIC_SEQ_CST);
+  int num_workers = __atomic_load_n(&pool->num_workers, __ATOMIC_SEQ_CST);
+
+  int start = pool->next++ % num_workers;
+  int best = start;
+  size_t best_load = pool_worker_load(&pool->workers[start]);
+
+  for (int i = 1; i < num_workers && best_load > 0; i++) {
+    int index = (start + i) % num_workers;
+    size_t load = pool_worker_load(&pool->workers[index]);
+    if (load < best_load) {
+      best = index;
+      best_load = load;
+    }
+  }
+
+  int pushed = 0;
+  for (int i = 0; i < num_workers && !pushed; i++) {
+    pool_worker_t *worker = &pool->workers[(best + i) % num_workers];
+    pushed = wq_try_push(&worker->queue, client_socket_fd);
+  }
+  if (!pushed) wq_push(&pool->workers[best].queue, client_socket_fd);
+  __atomic_store_n(&pool->submitting, 0, __ATOMIC_RELEASE);
+}
+
+/* Returns the number of connections queued at the workers of POOL. */
+size_t pool_queued(pool_t *pool) {
+  int num_workers = __atomic_load_n(&pool->num_workers, __ATOMIC_ACQUIRE);
+  size_t queued = 0;
+  for (int i = 0; i < num_workers; i++) queued += wq_size(&pool->workers[i].queue);
+  return queued;
+}
+
+/* Returns the number of workers of POOL serving a connection. */
+int pool_busy(pool_t *pool) {
+  int num_workers = __atomic_load_n(&pool->num_workers, __ATOMIC_ACQUIRE);
+  int busy = 0;
+  for (int i = 0; i < num_workers; i++) {
+    busy += __atomic_load_n(&pool->workers[i].busy, __ATOMIC_RELAXED);
+  }
+  return busy;
+}
+
+/* Returns the number of workers POOL has in use. */
+int pool_size(pool_t *pool) {
+  return __atomic_load_n(&pool->num_workers, __ATOMIC_ACQUIRE);
+}
+
+/* Returns how long, in nanoseconds, the oldest connection queued at POOL had
+ * waited when last checked. Always 0 for a pool of fixed size. */
+uint64_t pool_queue_wait(pool_t *pool) {
+  return __atomic_load_n(&pool->queue_wait, __ATOMIC_RELAXED);
+}
+
+/*
+ * Writes one line per worker of POOL, prefixed with LABEL, into BUFFER: its
+ * queue depth, whether it is busy, and how many connections it has served
+ * and stolen. Returns the number of bytes written.
+ */
+int pool_format_stats(pool_t *pool, const char *label, char *buffer, size_t size) {
+  int num_workers = __atomic_load_n(&pool->num_workers, __ATOMIC_ACQUIRE);
+  size_t length = 0;
+  for (int i = 0; i < num_workers && length < size; i++) {
+    pool_worker_t *worker = &pool->workers[i];
+    int written = snprintf(buffer + length, size - length,
+        "%s worker %d: depth %zu busy %d served %lu stolen %lu\n", label, i,
+        wq_size(&worker->queue), __atomic_load_n(&worker->busy, __ATOMIC_RELAXED),
+        __atomic_load_n(&worker->served, __ATOMIC_RELAXED),
+        __atomic_load_n(&worker->stolen, __ATOMIC_RELAXED));
+    if (written < 0) break;
+    length += written;
+  }
+  return length < size ? length : size;
+}
@@ -0,0 +1,99 @@
+#ifndef __POOL__
+#define __POOL__
+
+#include <pthread.h>
+#include <sched.h>  // cpu_set_t; includers define _GNU_SOURCE.
+#include <stdint.h>
+
+#include "wq.h"
+
+/* POOL is a group of worker threads that serve accepted client sockets.
+ *
+ * Every worker has its own queue. The acceptor hands each connection to the
+ * least loaded worker (queued plus in service), starting from a round-robin
+ * position so ties are spread out. A worker whose own queue is empty steals
+ * from the other workers' queues before it goes to sleep, so one slow
+ * connection does not hold up the ones queued behind it.
+ *
+ * The pool grows and shrinks between its minimum and maximum size. A manager
+ * thread watches how long the oldest queued connection has waited, and adds
+ * a worker whenever that exceeds the target wait, so connections are not
+ * starved by workers stuck on slow disks, slow upstreams or keep-alive
+ * clients. Workers above the minimum retire after sitting idle for the idle
+ * timeout; only the last one may retire, so the workers in use stay at the
+ * front of the array where the acceptor and thieves look for them.
+ *
+ * Admission control keeps overload from making every connection slow: the
+ * queue is bounded, and connections the pool has no room or no time for are
+ * turned away (shed) rather than served late. */
+
+typedef void (*pool_handler)(int client_socket_fd);
+
+/* What a pool does when it cannot serve connections in time. */
+enum pool_shed_policy {
+  POOL_SHED_REJECT,             // Turn new connections away while the queue is full.
+  POOL_SHED_DROP_OLDEST,        // Make room by turning away the longest waiting one.
+  POOL_SHED_CODEL,              // Also turn connections away as they are dequeued
+                                // while a standing queue keeps every wait above
+                                // target (CoDel).
+};
+
+typedef struct pool_admission {
+  int limit;                    // Connections queued at most; 0 = no limit.
+  enum pool_shed_policy policy;
+  uint64_t codel_target;        // Queue delay CoDel tolerates, in nanoseconds.
+  uint64_t codel_interval;      // How long it may be exceeded before CoDel sheds.
+  uint64_t deadline;            // Shed connections queued longer; 0 = never.
+  pool_handler shed;            // Tells a shed client, if set; the pool closes it.
+} pool_admission_t;
+
+typedef struct pool_worker {
+  int index;
+  struct pool *pool;
+  wq_t queue;
+  int busy;                     // 1 while serving a connection.
+  int running;                  // 1 while its thread exists.
+  int initialized;              // Its queue has been set up.
+  unsigned long served;         // Connections served, including stolen ones.
+  unsigned long stolen;         // Connections taken from other workers.
+} __attribute__((aligned(WQ_CACHE_LINE))) pool_worker_t;
+
+typedef struct pool {
+  int num_workers;              // Workers in use, at the front of the array.
+  int min_workers;
+  int max_workers;
+  pool_worker_t *workers;       // Room for max_workers.
+  unsigned int next;            // Round-robin start for the next submit.
+  int submitting;               // 1 while the acceptor is handing out a socket.
+  pool_handler handler;
+  cpu_set_t cpus;
+  int pinned;
+
+  pthread_mutex_t mutex;        // Serializes growing and retiring.
+  uint64_t wait_target;         // Nanoseconds.
+  uint64_t idle_timeout;        // Nanoseconds; 0 = never retire.
+  uint64_t queue_wait;          // Wait of the oldest queued connection, last checked.
+  unsigned long started;        // Workers started beyond the minimum.
+  unsigned long retired;
+
+  pool_admission_t admission;
+  int queued;                   // Connections submitted and not yet taken.
+  unsigned long shed;           // Connections turned away.
+
+  /* CoDel state. */
+  uint64_t codel_interval_end;
+  uint64_t codel_min_wait;      // Shortest wait dequeued in this interval.
+  int codel_standing;           // The last interval's shortest wait was above target.
+} pool_t;
+
+void pool_init(pool_t *pool, int min_workers, int max_workers, uint64_t wait_target,
+    uint64_t idle_timeout, pool_handler handler, cpu_set_t *cpus);
+void pool_set_admission(pool_t *pool, pool_admission_t *admission);
+void pool_submit(pool_t *pool, int client_socket_fd);
+size_t pool_queued(pool_t *pool);
+int pool_busy(pool_t *pool);
+int pool_size(pool_t *pool);
+uint64_t pool_queue_wait(pool_t *pool);
+int pool_format_stats(pool_t *pool, const char *label, char *buffer, size_t size);
+
+#endif
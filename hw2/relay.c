@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "relay.h"
+
+#define RELAY_MAX_EVENTS 256
+#define RELAY_PIPE_SIZE (256 * 1024)
+
+/* One direction of a tunnel: bytes read from IN_FD wait in PIPE until they
+ * can be written to OUT_FD. */
+typedef struct relay_half {
+  int in_fd;
+  int out_fd;
+  int pipe[2];
+  size_t pending;               /* Bytes in the pipe not yet written. */
+  int eof;                      /* IN_FD has no more data. */
+  int done;                     /* Everything was written and OUT_FD shut. */
+} relay_half_t;
+
+typedef struct relay_tunnel {
+  int client_fd;
+  int upstream_fd;
+  relay_half_t halves[2];       /* Client to upstream, upstream to client. */
+  int closed;
+  void (*release)(void *);      /* Called once the tunnel is closed. */
+  void *release_arg;
+  struct relay_tunnel *next_dead;
+} relay_tunnel_t;
+
+typedef struct relay_loop {
+  int epoll_fd;
+  relay_tunnel_t *dead;         /* Closed this round, freed after it. */
+} relay_loop_t;
+
+static relay_loop_t *loops;
+static int num_loops;
+static unsigned int next_loop;
+
+/* Result of pumping one half. */
+#define RELAY_ERROR -1
+#define RELAY_BLOCKED 0
+#define RELAY_DONE 1
+
+/* Moves as much data as possible from HALF's input to its output. */
+static int relay_pump(relay_half_t *half) {
+  while (!half->done) {
+    if (half->pending > 0) {
+      ssize_t moved = splice(half->pipe[0], NULL, half->out_fd, NULL,
+          half->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (moved < 0) {
+        if (errno == EINTR) continue;
+        return errno == EAGAIN ? RELAY_BLOCKED : RELAY_ERROR;
+      }
+      half->pending -= moved;
+    } else if (half->eof) {
+      shutdown(half->out_fd, SHUT_WR);
+      half->done = 1;
+    } else {
+      ssize_t moved = splice(half->in_fd, NULL, half->pipe[1], NULL,
+          RELAY_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (moved < 0) {
+        if (errno == EINTR) continue;
+        return errno == EAGAIN ? RELAY_BLOCKED : RELAY_ERROR;
+      }
+      if (moved == 0) half->eof = 1;
+      half->pending += moved;
+    }
+  }
+  return RELAY_DONE;
+}
+
+static void relay_close(relay_loop_t *loop, relay_tunnel_t *tunnel) {
+  tunnel->closed = 1;
+  close(tunnel->client_fd);
+  close(tunnel->upstream_fd);
+  for (int i = 0; i < 2; i++) {
+    close(tunnel->halves[i].pipe[0]);
+    close(tunnel->halves[i].pipe[1]);
+  }
+  if (tunnel->release != NULL) tunnel->release(tunnel->release_arg);
+  /* Later events in this round may still point at the tunnel. */
+  tunnel->next_dead = loop->dead;
+  loop->dead = tunnel;
+}
+
+static void relay_process(relay_loop_t *loop, relay_tunnel_t *tunnel) {
+  if (tunnel->closed) return;
+
+  int finished = 1;
+  for (int i = 0; i < 2; i++) {
+    int status = relay_pump(&tunnel->halves[i]);
+    if (status == RELAY_ERROR) {
+      relay_close(loop, tunnel);
+      return;
+    }
+    finished &= status == RELAY_DONE;
+  }
+  if (finished) relay_close(loop, tunnel);
+}
+
+static void *relay_thread(void *arg) {
+  relay_loop_t *loop = arg;
+  struct epoll_event events[RELAY_MAX_EVENTS];
+
+  while (1) {
+    int num_events = epoll_wait(loop->epoll_fd, events, RELAY_MAX_EVENTS, -1);
+    if (num_events < 0) {
+      if (errno == EINTR) continue;
+      perror("Failed to wait for relay events");
+      exit(errno);
+    }
+
+    for (int i = 0; i < num_events; i++) {
+      relay_process(loop, events[i].data.ptr);
+    }
+
+    while (loop->dead != NULL) {
+      relay_tunnel_t *tunnel = loop->dead;
+      loop->dead = tunnel->next_dead;
+      free(tunnel);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Starts NUM_THREADS relay threads. Every tunnel holds six descriptors, so
+ * the open file limit is also raised as far as allowed.
+ */
+void relay_init(int num_threads) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  loops = calloc(num_threads, sizeof(relay_loop_t));
+  if (loops == NULL) {
+    fprintf(stderr, "Failed to allocate relay threads\n");
+    exit(ENOMEM);
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    loops[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loops[i].epoll_fd == -1) {
+      perror("Failed to create epoll instance");
+      exit(errno);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, relay_thread, &loops[i]) != 0) {
+      perror("Failed to create relay thread");
+      exit(errno);
+    }
+    pthread_detach(thread);
+  }
+  num_loops = num_threads;
+}
+
+/*
+ * Relays CLIENT_SOCKET_FD and UPSTREAM_SOCKET_FD until both sides are done.
+ * Takes ownership of both sockets, and closes them right away if the tunnel
+ * cannot be set up. RELEASE, if not NULL, is called with RELEASE_ARG once
+ * both are closed. Safe to call from any thread.
+ */
+void relay_start(int client_socket_fd, int upstream_socket_fd,
+    void (*release)(void *), void *release_arg) {
+  relay_tunnel_t *tunnel = calloc(1, sizeof(relay_tunnel_t));
+  if (tunnel == NULL) goto fail;
+
+  tunnel->release = release;
+  tunnel->release_arg = release_arg;
+  tunnel->client_fd = client_socket_fd;
+  tunnel->upstream_fd = upstream_socket_fd;
+  tunnel->halves[0].in_fd = tunnel->halves[1].out_fd = client_socket_fd;
+  tunnel->halves[1].in_fd = tunnel->halves[0].out_fd = upstream_socket_fd;
+
+  if (pipe2(tunnel->halves[0].pipe, O_NONBLOCK | O_CLOEXEC) == -1) goto fail_tunnel;
+  if (pipe2(tunnel->halves[1].pipe, O_NONBLOCK | O_CLOEXEC) == -1) goto fail_pipe;
+
+  /* Larger pipes mean fewer splices per byte; the kernel may refuse. */
+  for (int i = 0; i < 2; i++) {
+    fcntl(tunnel->halves[i].pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+  }
+
+  fcntl(client_socket_fd, F_SETFL, fcntl(client_socket_fd, F_GETFL) | O_NONBLOCK);
+  fcntl(upstream_socket_fd, F_SETFL, fcntl(upstream_socket_fd, F_GETFL) | O_NONBLOCK);
+
+  relay_loop_t *loop = &loops[__atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED)
+      % num_loops];
+
+  /* From the first epoll_ctl on, the tunnel belongs to the relay thread. */
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = tunnel;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, upstream_socket_fd, &event) == -1) {
+    goto fail_pipes;
+  }
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_socket_fd, &event) == -1) {
+    /* Too late to free the tunnel; make the relay thread wind it down. */
+    shutdown(upstream_socket_fd, SHUT_RDWR);
+    shutdown(client_socket_fd, SHUT_RDWR);
+    perror("Failed to add socket to relay");
+    return;
+  }
+  return;
+
+fail_pipes:
+  close(tunnel->halves[1].pipe[0]);
+  close(tunnel->halves[1].pipe[1]);
+fail_pipe:
+  close(tunnel->halves[0].pipe[0]);
+  close(tunnel->halves[0].pipe[1]);
+fail_tunnel:
+  free(tunnel);
+fail:
+  perror("Failed to start relay");
+  close(client_socket_fd);
+  close(upstream_socket_fd);
+  if (release != NULL) release(release_arg);
+}
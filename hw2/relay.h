@@ -0,0 +1,15 @@
+#ifndef __RELAY__
+#define __RELAY__
+
+/* RELAY moves bytes between proxied clients and their upstream servers
+ * without a thread per connection. Each tunnel is owned by one of a few relay
+ * threads, each running an edge-triggered epoll loop. Each direction of a
+ * tunnel splices data through its own pipe, so the bytes are never copied
+ * through user space. When one side finishes sending, the other side's write
+ * half is shut down, and the tunnel is closed once both directions are done. */
+
+void relay_init(int num_threads);
+void relay_start(int client_socket_fd, int upstream_socket_fd,
+    void (*release)(void *), void *release_arg);
+
+#endif
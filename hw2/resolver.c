@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "resolver.h"
+
+typedef struct resolver_snapshot {
+  int count;
+  struct sockaddr_storage addresses[];
+} resolver_snapshot_t;
+
+struct resolver {
+  char *hostname;
+  char port[16];
+  int ttl;
+  time_t expires;
+
+  resolver_snapshot_t *current;     /* Read without locking. */
+  resolver_snapshot_t *retired;     /* Replaced by the previous refresh. */
+  unsigned int next;                /* Round-robin position. */
+
+  struct resolver *next_resolver;
+};
+
+static pthread_mutex_t resolvers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static resolver_t *resolvers;
+static pthread_once_t refresh_once = PTHREAD_ONCE_INIT;
+
+static time_t monotonic_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+/* Resolves RESOLVER's name into a new snapshot. Returns NULL on failure. */
+static resolver_snapshot_t *resolver_lookup(resolver_t *resolver) {
+  struct addrinfo hints, *addresses;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+
+  int status = getaddrinfo(resolver->hostname, resolver->port, &hints, &addresses);
+  if (status != 0) {
+    fprintf(stderr, "Cannot find host: %s: %s\n", resolver->hostname, gai_strerror(status));
+    return NULL;
+  }
+
+  int count = 0;
+  for (struct addrinfo *address = addresses; address != NULL; address = address->ai_next) {
+    count++;
+  }
+
+  resolver_snapshot_t *snapshot = malloc(sizeof(resolver_snapshot_t)
+      + count * sizeof(struct sockaddr_storage));
+  if (snapshot != NULL) {
+    snapshot->count = 0;
+    for (struct addrinfo *address = addresses; address != NULL; address = address->ai_next) {
+      memset(&snapshot->addresses[snapshot->count], 0, sizeof(struct sockaddr_storage));
+      memcpy(&snapshot->addresses[snapshot->count++], address->ai_addr, address->ai_addrlen);
+    }
+  }
+
+  freeaddrinfo(addresses);
+  return snapshot;
+}
+
+/*
+ * Replaces RESOLVER's snapshot if the name resolves. Lookups may still be
+ * reading the old snapshot, so it is only freed on the refresh after this
+ * one, at least a second later; a lookup only holds it for a memcpy.
+ */
+static void resolver_refresh(resolver_t *resolver) {
+  resolver_snapshot_t *snapshot = resolver_lookup(resolver);
+  resolver->expires = monotonic_seconds() + resolver->ttl;
+  if (snapshot == NULL) return;
+
+  free(resolver->retired);
+  resolver->retired = __atomic_exchange_n(&resolver->current, snapshot, __ATOMIC_ACQ_REL);
+}
+
+static void *resolver_refresh_thread(void *arg) {
+  while (1) {
+    sleep(1);
+    time_t now = monotonic_seconds();
+
+    pthread_mutex_lock(&resolvers_mutex);
+    for (resolver_t *resolver = resolvers; resolver != NULL;
+        resolver = resolver->next_resolver) {
+      if (now >= resolver->expires) resolver_refresh(resolver);
+    }
+    pthread_mutex_unlock(&resolvers_mutex);
+  }
+  return NULL;
+}
+
+static void resolver_start_refresh() {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, resolver_refresh_thread, NULL) != 0) {
+    perror("Failed to create resolver thread");
+    exit(errno);
+  }
+  pthread_detach(thread);
+}
+
+/*
+ * Returns a resolver for HOSTNAME:PORT, re-resolved every TTL seconds (at
+ * least 1). The first lookup happens here; if it fails, lookups find no
+ * address until a refresh succeeds.
+ */
+resolver_t *resolver_create(char *hostname, int port, int ttl) {
+  resolver_t *resolver = calloc(1, sizeof(resolver_t));
+  if (resolver == NULL) {
+    fprintf(stderr, "Failed to allocate resolver\n");
+    exit(ENOMEM);
+  }
+  resolver->hostname = strdup(hostname);
+  snprintf(resolver->port, sizeof(resolver->port), "%d", port);
+  resolver->ttl = ttl > 0 ? ttl : 1;
+  resolver->current = resolver_lookup(resolver);
+  resolver->expires = monotonic_seconds() + (resolver->current ? resolver->ttl : 1);
+
+  pthread_mutex_lock(&resolvers_mutex);
+  resolver->next_resolver = resolvers;
+  resolvers = resolver;
+  pthread_mutex_unlock(&resolvers_mutex);
+
+  pthread_once(&refresh_once, resolver_start_refresh);
+  return resolver;
+}
+
+/*
+ * Stores the next address of RESOLVER, round-robin, in *ADDRESS. Returns 0,
+ * or -1 if the name has not resolved yet.
+ */
+int resolver_next(resolver_t *resolver, struct sockaddr_storage *address,
+    socklen_t *address_length) {
+  resolver_snapshot_t *snapshot = __atomic_load_n(&resolver->current, __ATOMIC_ACQUIRE);
+  if (snapshot == NULL || snapshot->count == 0) return -1;
+
+  unsigned int index = __atomic_fetch_add(&resolver->next, 1, __ATOMIC_RELAXED);
+  *address = snapshot->addresses[index % snapshot->count];
+  *address_length = address->ss_family == AF_INET6
+      ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+  return 0;
+}
+
+/* Returns how many addresses RESOLVER currently has. */
+int resolver_count(resolver_t *resolver) {
+  resolver_snapshot_t *snapshot = __atomic_load_n(&resolver->current, __ATOMIC_ACQUIRE);
+  return snapshot != NULL ? snapshot->count : 0;
+}
@@ -0,0 +1,20 @@
+#ifndef __RESOLVER__
+#define __RESOLVER__
+
+#include <sys/socket.h>
+
+/* RESOLVER keeps the addresses of a host name in memory, so connecting to it
+ * never waits on DNS. Names are resolved with getaddrinfo (IPv4 and IPv6,
+ * every address returned) and re-resolved by a background thread once their
+ * TTL has passed; if that fails, the old addresses stay in use. Lookups read
+ * an immutable snapshot without taking a lock, and rotate round-robin through
+ * its addresses. */
+
+typedef struct resolver resolver_t;
+
+resolver_t *resolver_create(char *hostname, int port, int ttl);
+int resolver_next(resolver_t *resolver, struct sockaddr_storage *address,
+    socklen_t *address_length);
+int resolver_count(resolver_t *resolver);
+
+#endif
@@ -0,0 +1,476 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "resolver.h"
+#include "upstream.h"
+
+/* How long a backend that refused a connection is left out. */
+#define UPSTREAM_EJECT_SECONDS 10
+
+/* Points per backend on the consistent hash ring. More points spread the
+ * clients of an ejected backend more evenly over the others. */
+#define UPSTREAM_RING_POINTS 160
+
+typedef struct upstream_backend {
+  char *hostname;
+  int port;
+  resolver_t *resolver;
+  int active;                   /* Connections in use, for least-conn. */
+  time_t ejected_until;
+} upstream_backend_t;
+
+typedef struct upstream_point {
+  unsigned int hash;
+  int backend;
+} upstream_point_t;
+
+typedef struct upstream_idle {
+  int fd;
+  time_t since;                 /* When the connection was returned. */
+} upstream_idle_t;
+
+/* The idle connections of one worker thread to one backend. Only its owner
+ * and the reaper ever take the mutex, so it is almost never contended. */
+typedef struct upstream_pool {
+  pthread_mutex_t mutex;
+  upstream_idle_t *idle;        /* Oldest first. */
+  int count;
+  struct upstream_pool *next;
+} upstream_pool_t;
+
+static upstream_backend_t *backends;
+static int num_backends;
+static int balance_policy;
+static unsigned int next_backend;
+static upstream_point_t *ring;  /* Sorted by hash. */
+static int ring_size;
+
+static int pool_size = 0;
+static int idle_timeout = 0;
+
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+static upstream_pool_t *pools;
+static __thread upstream_pool_t **local_pools;
+static pthread_key_t local_pools_key;   /* Frees a thread's pools when it exits. */
+
+static time_t monotonic_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+static unsigned int upstream_hash(void *data, size_t length) {
+  /* FNV-1a, then a finalizer so that nearby inputs land far apart. */
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= ((unsigned char *) data)[i];
+    hash *= 16777619u;
+  }
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+static int upstream_point_compare(const void *a, const void *b) {
+  unsigned int x = ((upstream_point_t *) a)->hash;
+  unsigned int y = ((upstream_point_t *) b)->hash;
+  return x < y ? -1 : x > y;
+}
+
+/* Places every backend on the consistent hash ring. */
+static void upstream_build_ring() {
+  ring_size = num_backends * UPSTREAM_RING_POINTS;
+  ring = malloc(ring_size * sizeof(upstream_point_t));
+  if (ring == NULL) {
+    fprintf(stderr, "Failed to allocate hash ring\n");
+    exit(ENOMEM);
+  }
+
+  for (int i = 0; i < num_backends; i++) {
+    for (int j = 0; j < UPSTREAM_RING_POINTS; j++) {
+      char name[300];
+      int length = snprintf(name, sizeof(name), "%s:%d#%d", backends[i].hostname,
+          backends[i].port, j);
+      ring[i * UPSTREAM_RING_POINTS + j].hash = upstream_hash(name, length);
+      ring[i * UPSTREAM_RING_POINTS + j].backend = i;
+    }
+  }
+  qsort(ring, ring_size, sizeof(upstream_point_t), upstream_point_compare);
+}
+
+/* Returns 1 if BACKEND may be chosen: not tried yet for this request and, if
+ * CHECK_EJECTED is set, not ejected. */
+static int upstream_eligible(int backend, char *tried, int check_ejected, time_t now) {
+  if (tried[backend]) return 0;
+  return !check_ejected
+      || __atomic_load_n(&backends[backend].ejected_until, __ATOMIC_RELAXED) <= now;
+}
+
+/* Picks a backend by the balancing policy among the eligible ones. Returns
+ * -1 if there is none. */
+static int upstream_pick(unsigned int client_hash, char *tried, int check_ejected,
+    time_t now) {
+  if (balance_policy == UPSTREAM_IP_HASH) {
+    /* The first point at or after the hash, walking on past ineligible
+     * backends, so only the clients of those backends move. */
+    int low = 0, high = ring_size;
+    while (low < high) {
+      int middle = (low + high) / 2;
+      if (ring[middle].hash < client_hash) low = middle + 1;
+      else high = middle;
+    }
+    for (int i = 0; i < ring_size; i++) {
+      int backend = ring[(low + i) % ring_size].backend;
+      if (upstream_eligible(backend, tried, check_ejected, now)) return backend;
+    }
+    return -1;
+  }
+
+  int start = __atomic_fetch_add(&next_backend, 1, __ATOMIC_RELAXED) % num_backends;
+  int best = -1;
+  int best_active = 0;
+  for (int i = 0; i < num_backends; i++) {
+    int backend = (start + i) % num_backends;
+    if (!upstream_eligible(backend, tried, check_ejected, now)) continue;
+    if (balance_policy == UPSTREAM_ROUND_ROBIN) return backend;
+
+    int active = __atomic_load_n(&backends[backend].active, __ATOMIC_RELAXED);
+    if (best == -1 || active < best_active) {
+      best = backend;
+      best_active = active;
+    }
+  }
+  return best;
+}
+
+/* Picks the backend for the next connection attempt. Ejected backends are
+ * only used when every backend not tried yet is ejected. */
+static int upstream_choose(unsigned int client_hash, char *tried) {
+  time_t now = monotonic_seconds();
+  int backend = upstream_pick(client_hash, tried, 1, now);
+  if (backend == -1) backend = upstream_pick(client_hash, tried, 0, now);
+  return backend;
+}
+
+/* Leaves BACKEND out of new connections for UPSTREAM_EJECT_SECONDS. */
+static void upstream_eject(int backend) {
+  time_t now = monotonic_seconds();
+  time_t ejected_until = __atomic_load_n(&backends[backend].ejected_until, __ATOMIC_RELAXED);
+  if (ejected_until > now) return;
+
+  if (__atomic_compare_exchange_n(&backends[backend].ejected_until, &ejected_until,
+        now + UPSTREAM_EJECT_SECONDS, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    fprintf(stderr, "Ejecting backend %s:%d for %d seconds\n", backends[backend].hostname,
+        backends[backend].port, UPSTREAM_EJECT_SECONDS);
+  }
+}
+
+/* Returns 1 if the idle connection FD is still open and has nothing to read.
+ * A server that closed it, or sent something unasked, makes it unusable. */
+static int upstream_healthy(int fd) {
+  char byte;
+  ssize_t peeked = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Returns the calling thread's pool for BACKEND, creating it on first use. */
+static upstream_pool_t *upstream_local_pool(int backend) {
+  if (local_pools == NULL) {
+    local_pools = calloc(num_backends, sizeof(upstream_pool_t *));
+    if (local_pools == NULL) return NULL;
+    pthread_setspecific(local_pools_key, local_pools);
+  }
+  if (local_pools[backend] != NULL) return local_pools[backend];
+
+  upstream_pool_t *pool = calloc(1, sizeof(upstream_pool_t));
+  if (pool == NULL) return NULL;
+  pool->idle = calloc(pool_size, sizeof(upstream_idle_t));
+  if (pool->idle == NULL) {
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->mutex, NULL);
+
+  pthread_mutex_lock(&pools_mutex);
+  pool->next = pools;
+  pools = pool;
+  pthread_mutex_unlock(&pools_mutex);
+
+  local_pools[backend] = pool;
+  return pool;
+}
+
+/* Closes the idle connections of an exiting thread and frees its pools, ARG
+ * (one per backend, or NULL if never used). Worker threads come and go
+ * as the pool grows and shrinks, so they must not be left behind. */
+static void upstream_free_local_pools(void *arg) {
+  upstream_pool_t **thread_pools = arg;
+
+  pthread_mutex_lock(&pools_mutex);
+  for (upstream_pool_t **link = &pools; *link != NULL;) {
+    upstream_pool_t *pool = *link;
+    int owned = 0;
+    for (int i = 0; i < num_backends && !owned; i++) owned = thread_pools[i] == pool;
+    if (!owned) {
+      link = &pool->next;
+      continue;
+    }
+
+    *link = pool->next;
+    for (int i = 0; i < pool->count; i++) close(pool->idle[i].fd);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->idle);
+    free(pool);
+  }
+  pthread_mutex_unlock(&pools_mutex);
+  free(thread_pools);
+}
+
+/* Closes the connections of POOL that are idle for too long or unhealthy. */
+static void upstream_evict(upstream_pool_t *pool, time_t now) {
+  pthread_mutex_lock(&pool->mutex);
+  int kept = 0;
+  for (int i = 0; i < pool->count; i++) {
+    upstream_idle_t *entry = &pool->idle[i];
+    if (now - entry->since >= idle_timeout || !upstream_healthy(entry->fd)) {
+      close(entry->fd);
+    } else {
+      pool->idle[kept++] = *entry;
+    }
+  }
+  pool->count = kept;
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+static void *upstream_reaper(void *arg) {
+  while (1) {
+    sleep(1);
+    time_t now = monotonic_seconds();
+
+    pthread_mutex_lock(&pools_mutex);
+    for (upstream_pool_t *pool = pools; pool != NULL; pool = pool->next) {
+      upstream_evict(pool, now);
+    }
+    pthread_mutex_unlock(&pools_mutex);
+  }
+  return NULL;
+}
+
+/* Takes a healthy idle connection to BACKEND from the calling thread's pool.
+ * Returns -1 if there is none. */
+static int upstream_take_idle(int backend) {
+  upstream_pool_t *pool = pool_size > 0 ? upstream_local_pool(backend) : NULL;
+
+  while (pool != NULL) {
+    pthread_mutex_lock(&pool->mutex);
+    int fd = pool->count > 0 ? pool->idle[--pool->count].fd : -1;
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (fd == -1) break;
+    if (upstream_healthy(fd)) return fd;
+    close(fd);
+  }
+  return -1;
+}
+
+/*
+ * Opens a new blocking connection to BACKEND, at the next of its cached
+ * addresses. If that address refuses, the others are tried in turn. Returns
+ * the socket, or -1 if no address is known or none accepts.
+ */
+static int upstream_open(int backend) {
+  resolver_t *resolver = backends[backend].resolver;
+  int attempts = resolver_count(resolver);
+
+  for (int i = 0; i < attempts; i++) {
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    if (resolver_next(resolver, &address, &address_length) == -1) break;
+
+    int fd = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+      perror("Failed to create a new socket");
+      return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &address, address_length) == 0) {
+      /* Requests are written whole; do not hold back the tail of a body. */
+      int option = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+      return fd;
+    }
+    close(fd);
+  }
+  return -1;
+}
+
+/* Returns a connection to a backend chosen for CLIENT_HASH and stores the
+ * backend in *BACKEND. Backends that cannot be connected to are ejected and
+ * the next choice is tried. Pooled connections are used if USE_POOL is set,
+ * and *REUSED tells whether one was. Returns -1 if every backend failed. */
+static int upstream_get(unsigned int client_hash, int *backend, int use_pool,
+    int *reused) {
+  char tried[num_backends];
+  memset(tried, 0, sizeof(tried));
+
+  int choice;
+  while ((choice = upstream_choose(client_hash, tried)) != -1) {
+    tried[choice] = 1;
+
+    int fd = use_pool ? upstream_take_idle(choice) : -1;
+    *reused = fd != -1;
+    if (fd == -1) fd = upstream_open(choice);
+    if (fd != -1) {
+      __atomic_add_fetch(&backends[choice].active, 1, __ATOMIC_RELAXED);
+      *backend = choice;
+      return fd;
+    }
+    upstream_eject(choice);
+  }
+  return -1;
+}
+
+/*
+ * Sets the backends to TARGETS, a comma-separated list of host[:port]
+ * (port 80 if left out), chosen by POLICY. Backend addresses are cached for
+ * DNS_TTL seconds. Each worker thread keeps up to SIZE idle connections per
+ * backend (0 disables pooling), and closes them after TIMEOUT seconds without
+ * use. Returns -1 if TARGETS is malformed.
+ */
+int upstream_init(char *targets, int policy, int dns_ttl, int size, int timeout) {
+  num_backends = 1;
+  for (char *c = targets; *c != '\0'; c++) {
+    if (*c == ',') num_backends++;
+  }
+  backends = calloc(num_backends, sizeof(upstream_backend_t));
+  if (backends == NULL) {
+    fprintf(stderr, "Failed to allocate backends\n");
+    exit(ENOMEM);
+  }
+
+  char *list = strdup(targets);
+  char *save;
+  int count = 0;
+  for (char *target = strtok_r(list, ",", &save); target != NULL;
+      target = strtok_r(NULL, ",", &save)) {
+    char *colon = strrchr(target, ':');
+    int port = 80;
+    if (colon != NULL) {
+      *colon = '\0';
+      port = atoi(colon + 1);
+    }
+    if (*target == '\0' || port <= 0 || port > 65535) break;
+
+    backends[count].hostname = strdup(target);
+    backends[count].port = port;
+    backends[count].resolver = resolver_create(target, port, dns_ttl);
+    count++;
+  }
+  free(list);
+  if (count != num_backends) return -1;
+
+  balance_policy = policy;
+  if (balance_policy == UPSTREAM_IP_HASH) upstream_build_ring();
+
+  pool_size = size;
+  idle_timeout = timeout;
+  if (pool_size > 0) {
+    if (pthread_key_create(&local_pools_key, upstream_free_local_pools) != 0) {
+      perror("Failed to create upstream pool key");
+      exit(errno);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, upstream_reaper, NULL) != 0) {
+      perror("Failed to create upstream reaper thread");
+      exit(errno);
+    }
+    pthread_detach(thread);
+  }
+  return 0;
+}
+
+int upstream_pool_enabled() {
+  return pool_size > 0;
+}
+
+/* Returns the hash of the address of the client on CLIENT_SOCKET_FD, for the
+ * ip-hash policy. Other policies do not need it and always get 0. */
+unsigned int upstream_client_hash(int client_socket_fd) {
+  if (balance_policy != UPSTREAM_IP_HASH) return 0;
+
+  struct sockaddr_storage address;
+  socklen_t address_length = sizeof(address);
+  if (getpeername(client_socket_fd, (struct sockaddr *) &address, &address_length) == -1) {
+    return 0;
+  }
+  if (address.ss_family == AF_INET6) {
+    return upstream_hash(&((struct sockaddr_in6 *) &address)->sin6_addr,
+        sizeof(struct in6_addr));
+  }
+  return upstream_hash(&((struct sockaddr_in *) &address)->sin_addr, sizeof(struct in_addr));
+}
+
+/*
+ * Opens a new connection to the backend for CLIENT_HASH, for a connection
+ * that is relayed as raw bytes, and stores the backend in *BACKEND. Call
+ * upstream_detach once the connection is closed. Returns -1 if every backend
+ * failed.
+ */
+int upstream_connect(unsigned int client_hash, int *backend) {
+  int reused;
+  return upstream_get(client_hash, backend, 0, &reused);
+}
+
+/*
+ * Returns a connection to the backend for CLIENT_HASH, from the calling
+ * thread's pool if it has a healthy one, or else a new one. Stores the
+ * backend in *BACKEND and sets *REUSED if the connection came from the pool.
+ * Returns -1 if every backend failed.
+ */
+int upstream_acquire(unsigned int client_hash, int *backend, int *reused) {
+  return upstream_get(client_hash, backend, 1, reused);
+}
+
+/*
+ * Gives FD, a connection to BACKEND, back after a request. It is kept for the
+ * next request of the calling thread if REUSABLE is set, or closed otherwise.
+ * A full pool makes room by closing its oldest connection.
+ */
+void upstream_release(int backend, int fd, int reusable) {
+  upstream_detach(backend);
+
+  upstream_pool_t *pool = reusable && pool_size > 0 ? upstream_local_pool(backend) : NULL;
+  if (pool == NULL) {
+    close(fd);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->count == pool_size) {
+    close(pool->idle[0].fd);
+    memmove(pool->idle, pool->idle + 1, (pool->count - 1) * sizeof(upstream_idle_t));
+    pool->count--;
+  }
+  pool->idle[pool->count].fd = fd;
+  pool->idle[pool->count].since = monotonic_seconds();
+  pool->count++;
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Records that a connection to BACKEND is no longer in use. */
+void upstream_detach(int backend) {
+  __atomic_sub_fetch(&backends[backend].active, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,32 @@
+#ifndef __UPSTREAM__
+#define __UPSTREAM__
+
+/* UPSTREAM opens connections to the proxy's backends and keeps the ones that
+ * can be reused. Each connection goes to a backend chosen by the balancing
+ * policy: round-robin, fewest connections in use, or a consistent hash of the
+ * client's IP address, so a client sticks to one backend while the set of
+ * healthy backends stays the same.
+ *
+ * A backend's addresses come from a RESOLVER cache, and new connections
+ * rotate through them. A backend that cannot be connected to is ejected for a
+ * while, and its requests go to the policy's next choice instead.
+ *
+ * Every worker thread has its own small pool of idle keep-alive connections
+ * per backend, most recently used first, so a request usually skips the TCP
+ * handshake and slow start too. Pooled connections are checked before they
+ * are handed out, and a background thread closes the ones that the server
+ * has closed or that have been idle for too long. */
+
+#define UPSTREAM_ROUND_ROBIN 0
+#define UPSTREAM_LEAST_CONN 1
+#define UPSTREAM_IP_HASH 2
+
+int upstream_init(char *targets, int policy, int dns_ttl, int size, int timeout);
+int upstream_pool_enabled();
+unsigned int upstream_client_hash(int client_socket_fd);
+int upstream_connect(unsigned int client_hash, int *backend);
+int upstream_acquire(unsigned int client_hash, int *backend, int *reused);
+void upstream_release(int backend, int fd, int reusable);
+void upstream_detach(int backend);
+
+#endif
@@ -1,60 +1,250 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include "wq.h"
-#include "utlist.h"
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
-/* Initializes a work queue WQ. */
-void wq_init(wq_t *wq) {
+#include "wq.h"
 
-  /* TODO: Make me thread-safe! */
-  wq = (wq_t*) calloc(1, sizeof(wq_t));
+/* Number of attempts before a thread goes to sleep on a futex. Under load
+ * the ring rarely stays empty (or full) for long. */
+#define WQ_SPIN 64
 
-  wq->size = 0;
-  wq->head = NULL;
+static void futex_wait(int *futex, int value, const struct timespec *timeout) {
+  syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
 
-  pthread_mutex_t mutex;
-  pthread_cond_t has_jobs;
+static void futex_wake(int *futex, int count) {
+  syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
 
-  wq->mutex = mutex;
-  wq->has_jobs = has_jobs;
+static uint64_t wq_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-  pthread_mutex_init(&(wq->mutex), NULL);
-  pthread_cond_init(&(wq->has_jobs), NULL);
+/* Wakes one thread sleeping on WAITERS, if there is any and none has been
+ * woken already. Callers have just published a change that the sleeper is
+ * waiting for. */
+static void wq_wake(wq_waiters_t *waiters) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&waiters->count, __ATOMIC_RELAXED) == 0) return;
+  if (__atomic_load_n(&waiters->pending, __ATOMIC_RELAXED)) return;
+  if (__atomic_exchange_n(&waiters->pending, 1, __ATOMIC_ACQ_REL)) return;
+
+  __atomic_add_fetch(&waiters->futex, 1, __ATOMIC_SEQ_CST);
+  futex_wake(&waiters->futex, 1);
 }
 
-/* Remove an item from the WQ. This function should block until there
- * is at least one item on the queue. */
-int wq_pop(wq_t *wq) {
+/* Sleeps on WAITERS until woken or TIMEOUT (if not NULL) passes, unless READY
+ * succeeds after registering as a sleeper. Registering first means a
+ * concurrent change either sees the sleeper and wakes it, or is seen by
+ * READY. Returns READY's result.
+ *
+ * A sleep can end without taking the pending wakeup: on a timeout or
+ * wq_interrupt, or while a waker that counted it is about to claim one. The
+ * pending flag may then be left set with nobody asleep, so a new sleeper
+ * clears it when it registers, or it would hold off every later wakeup. A
+ * wakeup claimed before that is still seen: it bumps the futex after the
+ * sleeper read it, or its change is seen by READY. At worst one spare
+ * wakeup is sent. */
+static int wq_sleep(wq_waiters_t *waiters, int (*ready)(wq_t *, int *, uint64_t *),
+    wq_t *wq, int *client_socket_fd, uint64_t *pushed, const struct timespec *timeout) {
+  int futex = __atomic_load_n(&waiters->futex, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&waiters->count, 1, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&waiters->pending, 0, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  int done = ready(wq, client_socket_fd, pushed);
+  if (!done) futex_wait(&waiters->futex, futex, timeout);
+
+  __atomic_sub_fetch(&waiters->count, 1, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&waiters->pending, 0, __ATOMIC_RELEASE);
+  return done;
+}
 
-  /* TODO: Make me blocking and thread-safe! */
-  pthread_mutex_lock(&(wq->mutex));
-  pthread_cond_wait(&(wq->has_jobs), &(wq->mutex));
+static int wq_try_push_ptr(wq_t *wq, int *client_socket_fd, uint64_t *pushed) {
+  return wq_try_push(wq, *client_socket_fd);
+}
 
-  wq_item_t *wq_item = wq->head;
-  int client_socket_fd = wq->head->client_socket_fd;
-  wq->size--;
-  DL_DELETE(wq->head, wq->head);
+/* Initializes a work queue WQ with the default capacity. */
+void wq_init(wq_t *wq) {
+  wq_init_capacity(wq, WQ_DEFAULT_CAPACITY);
+}
 
-  free(wq_item);
+/* Initializes a work queue WQ holding at least CAPACITY sockets. */
+void wq_init_capacity(wq_t *wq, size_t capacity) {
+  size_t size = 2;
+  while (size < capacity) size <<= 1;
+
+  wq->cells = calloc(size, sizeof(wq_cell_t));
+  if (wq->cells == NULL) {
+    fprintf(stderr, "Failed to allocate work queue\n");
+    exit(ENOMEM);
+  }
+  for (size_t i = 0; i < size; i++) {
+    wq->cells[i].sequence = i;
+  }
+
+  wq->mask = size - 1;
+  wq->head = 0;
+  wq->tail = 0;
+  wq->not_empty.futex = wq->not_empty.count = wq->not_empty.pending = 0;
+  wq->not_full.futex = wq->not_full.count = wq->not_full.pending = 0;
+}
 
-  pthread_mutex_unlock(&(wq->mutex));
+/* Adds ITEM to WQ without blocking. Returns 1 on success, or 0 if the queue
+ * is full. */
+int wq_try_push(wq_t *wq, int client_socket_fd) {
+  size_t pos = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+
+  while (1) {
+    wq_cell_t *cell = &wq->cells[pos & wq->mask];
+    size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+
+    if (diff == 0) {
+      // The cell is free for this lap; claim it by advancing head.
+      if (__atomic_compare_exchange_n(&wq->head, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->client_socket_fd = client_socket_fd;
+        __atomic_store_n(&cell->pushed, wq_now(), __ATOMIC_RELAXED);
+        __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+        wq_wake(&wq->not_empty);
+        return 1;
+      }
+    } else if (diff < 0) {
+      // The cell still holds an item from the previous lap.
+      return 0;
+    } else {
+      pos = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+    }
+  }
+}
 
-  return client_socket_fd;
+/* Removes an item from WQ without blocking. Returns 1 and stores the item in
+ * *CLIENT_SOCKET_FD, and when it was queued in *PUSHED (if not NULL), on
+ * success, or returns 0 if the queue is empty. */
+int wq_try_pop(wq_t *wq, int *client_socket_fd, uint64_t *pushed) {
+  size_t pos = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+
+  while (1) {
+    wq_cell_t *cell = &wq->cells[pos & wq->mask];
+    size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t) sequence - (intptr_t) (pos + 1);
+
+    if (diff == 0) {
+      // The cell has been filled for this lap; claim it by advancing tail.
+      if (__atomic_compare_exchange_n(&wq->tail, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *client_socket_fd = cell->client_socket_fd;
+        if (pushed != NULL) *pushed = cell->pushed;
+        __atomic_store_n(&cell->sequence, pos + wq->mask + 1, __ATOMIC_RELEASE);
+        wq_wake(&wq->not_full);
+        return 1;
+      }
+    } else if (diff < 0) {
+      // Nothing has been pushed into this cell yet.
+      return 0;
+    } else {
+      pos = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+    }
+  }
 }
 
-/* Add ITEM to WQ. */
-void wq_push(wq_t *wq, int client_socket_fd) {
+/* Remove an item from the WQ. This function blocks until there is at least
+ * one item on the queue. */
+int wq_pop(wq_t *wq) {
+  return wq_pop_stamped(wq, NULL);
+}
 
-  /* TODO: Make me thread-safe! */
-  pthread_mutex_lock(&(wq->mutex));
+/* Like wq_pop, but also stores when the item was queued in *PUSHED (if not
+ * NULL). */
+int wq_pop_stamped(wq_t *wq, uint64_t *pushed) {
+  int client_socket_fd;
+
+  while (1) {
+    int popped = 0;
+    for (int i = 0; i < WQ_SPIN && !popped; i++) {
+      popped = wq_try_pop(wq, &client_socket_fd, pushed);
+    }
+    if (!popped) {
+      popped = wq_sleep(&wq->not_empty, wq_try_pop, wq, &client_socket_fd, pushed, NULL);
+    }
+
+    if (popped) {
+      // Only one sleeper is woken per burst; pass the wakeup on if there is
+      // more work left.
+      if (wq_size(wq) > 0) wq_wake(&wq->not_empty);
+      return client_socket_fd;
+    }
+  }
+}
 
-  wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
+/* Removes an item from WQ, waiting up to TIMEOUT nanoseconds for one. Returns
+ * 1 and stores it as wq_try_pop does on success, or 0 if none came: on
+ * timeout, on wq_interrupt, or when another thread took the item it was
+ * woken for. */
+int wq_pop_timeout(wq_t *wq, int *client_socket_fd, uint64_t *pushed, uint64_t timeout) {
+  int popped = 0;
+  for (int i = 0; i < WQ_SPIN && !popped; i++) {
+    popped = wq_try_pop(wq, client_socket_fd, pushed);
+  }
+  if (!popped) {
+    struct timespec wait = {
+      .tv_sec = timeout / 1000000000,
+      .tv_nsec = timeout % 1000000000,
+    };
+    popped = wq_sleep(&wq->not_empty, wq_try_pop, wq, client_socket_fd, pushed, &wait);
+  }
+
+  if (popped && wq_size(wq) > 0) wq_wake(&wq->not_empty);
+  return popped;
+}
 
-  wq_item->client_socket_fd = client_socket_fd;
-  DL_APPEND(wq->head, wq_item);
-  wq->size++;
+/* Wakes every thread waiting to pop from WQ, without giving it an item. */
+void wq_interrupt(wq_t *wq) {
+  __atomic_add_fetch(&wq->not_empty.futex, 1, __ATOMIC_SEQ_CST);
+  futex_wake(&wq->not_empty.futex, INT_MAX);
+}
 
-  pthread_mutex_unlock(&(wq->mutex));
+/* Add ITEM to WQ. This function blocks while the queue is full. */
+void wq_push(wq_t *wq, int client_socket_fd) {
+  while (1) {
+    int pushed = 0;
+    for (int i = 0; i < WQ_SPIN && !pushed; i++) {
+      pushed = wq_try_push(wq, client_socket_fd);
+    }
+    if (!pushed) {
+      pushed = wq_sleep(&wq->not_full, wq_try_push_ptr, wq, &client_socket_fd, NULL, NULL);
+    }
+
+    if (pushed) {
+      if (wq_size(wq) <= wq->mask) wq_wake(&wq->not_full);
+      return;
+    }
+  }
+}
 
-  pthread_cond_signal(&(wq->has_jobs));
+/* Returns the number of items in WQ. Only a snapshot under concurrency. */
+size_t wq_size(wq_t *wq) {
+  size_t tail = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+  size_t head = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+  return head > tail ? head - tail : 0;
+}
 
+/* Returns when the item at the front of WQ was queued, or 0 if WQ is empty.
+ * Only a snapshot under concurrency. */
+uint64_t wq_oldest(wq_t *wq) {
+  size_t pos = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+  wq_cell_t *cell = &wq->cells[pos & wq->mask];
+  if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != pos + 1) return 0;
+  return __atomic_load_n(&cell->pushed, __ATOMIC_RELAXED);
 }
@@ -1,26 +1,56 @@
 #ifndef __WQ__
 #define __WQ__
 
-#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /* WQ defines a work queue which will be used to store accepted client sockets
- * waiting to be served. */
+ * waiting to be served.
+ *
+ * It is a bounded, lock-free multi-producer/multi-consumer ring. Each cell
+ * carries a sequence number that tells producers and consumers whose turn it
+ * is, so pushes and pops only contend on the head or tail counter. Threads
+ * only sleep (on a futex) when the ring is empty (wq_pop) or full (wq_push). */
 
-typedef struct wq_item {
+#define WQ_DEFAULT_CAPACITY 4096
+#define WQ_CACHE_LINE 64
+
+typedef struct wq_cell {
+  size_t sequence;
   int client_socket_fd; // Client socket to be served.
-  struct wq_item *next;
-  struct wq_item *prev;
-} wq_item_t;
+  uint64_t pushed;      // When it was queued (CLOCK_MONOTONIC nanoseconds).
+} wq_cell_t;
+
+/* A futex word that sleepers wait on, the number of sleepers, and whether a
+ * woken sleeper has yet to run (so bursts of pushes cost one wakeup). */
+typedef struct wq_waiters {
+  int futex;
+  int count;
+  int pending;
+} __attribute__((aligned(WQ_CACHE_LINE))) wq_waiters_t;
 
 typedef struct wq {
-  int size;
-  wq_item_t *head;
-  pthread_mutex_t mutex;
-  pthread_cond_t has_jobs;
+  wq_cell_t *cells;
+  size_t mask;                  // Capacity - 1; capacity is a power of two.
+
+  /* Producers and consumers each get their own cache line. */
+  size_t head __attribute__((aligned(WQ_CACHE_LINE)));  // Next cell to push.
+  size_t tail __attribute__((aligned(WQ_CACHE_LINE)));  // Next cell to pop.
+
+  wq_waiters_t not_empty;       // Consumers waiting for work.
+  wq_waiters_t not_full;        // Producers waiting for space.
 } wq_t;
 
 void wq_init(wq_t *wq);
+void wq_init_capacity(wq_t *wq, size_t capacity);
 void wq_push(wq_t *wq, int client_socket_fd);
+int wq_try_push(wq_t *wq, int client_socket_fd);
 int wq_pop(wq_t *wq);
+int wq_pop_stamped(wq_t *wq, uint64_t *pushed);
+int wq_try_pop(wq_t *wq, int *client_socket_fd, uint64_t *pushed);
+int wq_pop_timeout(wq_t *wq, int *client_socket_fd, uint64_t *pushed, uint64_t timeout);
+void wq_interrupt(wq_t *wq);
+size_t wq_size(wq_t *wq);
+uint64_t wq_oldest(wq_t *wq);
 
 #endif
@@ -0,0 +1,167 @@
+/*
+ * wqbench: a contention microbenchmark for the work queue.
+ *
+ * For each thread count, half the threads push and half pop a fixed number
+ * of items through one queue, first through the mutex and condition variable
+ * protected list that wq used to be, then through the lock-free ring in wq.c.
+ * Reports items moved per second.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utlist.h"
+#include "wq.h"
+
+long bench_items = 2000000;
+int bench_thread_counts[] = {1, 2, 4, 8, 16, 32, 64};
+int bench_max_threads = 64;
+
+/* The work queue as it was: a list node calloc'd per push, under a mutex. */
+typedef struct list_item {
+  int client_socket_fd;
+  struct list_item *next;
+  struct list_item *prev;
+} list_item_t;
+
+typedef struct list_queue {
+  list_item_t *head;
+  pthread_mutex_t mutex;
+  pthread_cond_t has_jobs;
+} list_queue_t;
+
+static void list_push(list_queue_t *queue, int client_socket_fd) {
+  list_item_t *item = calloc(1, sizeof(list_item_t));
+  item->client_socket_fd = client_socket_fd;
+  pthread_mutex_lock(&queue->mutex);
+  DL_APPEND(queue->head, item);
+  pthread_mutex_unlock(&queue->mutex);
+  pthread_cond_signal(&queue->has_jobs);
+}
+
+static int list_pop(list_queue_t *queue) {
+  pthread_mutex_lock(&queue->mutex);
+  while (queue->head == NULL) pthread_cond_wait(&queue->has_jobs, &queue->mutex);
+  list_item_t *item = queue->head;
+  DL_DELETE(queue->head, item);
+  pthread_mutex_unlock(&queue->mutex);
+  int client_socket_fd = item->client_socket_fd;
+  free(item);
+  return client_socket_fd;
+}
+
+typedef struct bench_run {
+  int ring;                     // 1 for wq, 0 for the list.
+  wq_t wq;
+  list_queue_t list;
+  long items_per_producer;
+} bench_run_t;
+
+static void bench_push(bench_run_t *run, int item) {
+  if (run->ring) wq_push(&run->wq, item);
+  else list_push(&run->list, item);
+}
+
+static int bench_pop(bench_run_t *run) {
+  return run->ring ? wq_pop(&run->wq) : list_pop(&run->list);
+}
+
+static void *bench_producer(void *arg) {
+  bench_run_t *run = arg;
+  for (long i = 0; i < run->items_per_producer; i++) bench_push(run, 1);
+  return NULL;
+}
+
+/* Pops until it gets the -1 that tells it to stop. */
+static void *bench_consumer(void *arg) {
+  bench_run_t *run = arg;
+  while (bench_pop(run) != -1) continue;
+  return NULL;
+}
+
+static uint64_t bench_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Moves the items through the queue with THREADS threads, half pushing and
+ * half popping (one each for a single thread), and returns items per second. */
+static double bench(int ring, int threads) {
+  bench_run_t run;
+  memset(&run, 0, sizeof(run));
+  run.ring = ring;
+  if (ring) {
+    wq_init(&run.wq);
+  } else {
+    pthread_mutex_init(&run.list.mutex, NULL);
+    pthread_cond_init(&run.list.has_jobs, NULL);
+  }
+
+  int producers = threads > 1 ? threads / 2 : 1;
+  int consumers = threads > 1 ? threads - producers : 1;
+  run.items_per_producer = bench_items / producers;
+  pthread_t producer_threads[producers], consumer_threads[consumers];
+
+  uint64_t start = bench_now();
+  for (int i = 0; i < consumers; i++) {
+    pthread_create(&consumer_threads[i], NULL, bench_consumer, &run);
+  }
+  for (int i = 0; i < producers; i++) {
+    pthread_create(&producer_threads[i], NULL, bench_producer, &run);
+  }
+  for (int i = 0; i < producers; i++) pthread_join(producer_threads[i], NULL);
+  for (int i = 0; i < consumers; i++) bench_push(&run, -1);
+  for (int i = 0; i < consumers; i++) pthread_join(consumer_threads[i], NULL);
+  double seconds = (bench_now() - start) / 1e9;
+
+  if (ring) free(run.wq.cells);
+  return run.items_per_producer * producers / seconds;
+}
+
+char *USAGE =
+  "Usage: ./wqbench [--items N] [--max-threads N]\n"
+  "\n"
+  "       --items N              items to move through the queue per run (default 2000000)\n"
+  "       --max-threads N        stop after this many threads (default 64)\n";
+
+void exit_with_usage() {
+  fprintf(stderr, "%s", USAGE);
+  exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp("--items", argv[i]) == 0) {
+      if (++i >= argc || (bench_items = atol(argv[i])) < 1) {
+        fprintf(stderr, "Expected positive integer after --items\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-threads", argv[i]) == 0) {
+      if (++i >= argc || (bench_max_threads = atoi(argv[i])) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--help", argv[i]) == 0) {
+      exit_with_usage();
+    } else {
+      fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
+      exit_with_usage();
+    }
+  }
+
+  printf("%7s %20s %8s   (M items/s)\n", "threads", "mutex+condvar list", "ring");
+  for (size_t i = 0; i < sizeof(bench_thread_counts) / sizeof(int); i++) {
+    int threads = bench_thread_counts[i];
+    if (threads > bench_max_threads) break;
+    double list = bench(0, threads);
+    double ring = bench(1, threads);
+    printf("%7d %20.2f %8.2f\n", threads, list / 1e6, ring / 1e6);
+  }
+  return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * wqtest: a stress test for sleeping and waking in the work queue.
+ *
+ * One producer pushes items one at a time and waits for each to be popped,
+ * so the queue goes from empty to non-empty on every item and the consumer
+ * goes back to sleep between them. Meanwhile a third thread keeps waking the
+ * consumer with wq_interrupt, and in the second round the consumer sleeps
+ * with short timeouts, so sleeps also end without a wakeup being consumed.
+ * A wakeup that is lost leaves the consumer asleep with an item queued; the
+ * test fails if no item is popped for a few seconds.
+ *
+ * Those races only show up under real parallelism, so a last round starts
+ * from the state they leave behind: a wakeup marked pending with nobody
+ * asleep to take it.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wq.h"
+
+#define TEST_STALL_SECONDS 3
+
+long test_items = 200000;
+
+typedef struct test_run {
+  wq_t wq;
+  int timeouts;                 // The consumer pops with wq_pop_timeout.
+  int stale;                    // Start with a wakeup pending and no sleeper.
+  long popped;
+  int done;
+} test_run_t;
+
+static void *test_producer(void *arg) {
+  test_run_t *run = arg;
+  for (long i = 0; i < test_items; i++) {
+    wq_push(&run->wq, 1);
+    while (__atomic_load_n(&run->popped, __ATOMIC_ACQUIRE) <= i) sched_yield();
+  }
+  return NULL;
+}
+
+static void *test_consumer(void *arg) {
+  test_run_t *run = arg;
+  int client_socket_fd;
+  uint64_t timeout = 1000;
+  while (__atomic_load_n(&run->popped, __ATOMIC_ACQUIRE) < test_items) {
+    if (run->timeouts) {
+      if (!wq_pop_timeout(&run->wq, &client_socket_fd, NULL, timeout)) {
+        // Vary the timeout so it ends at different points of a wakeup.
+        timeout = timeout < 100000 ? timeout * 2 : 1000;
+        continue;
+      }
+    } else {
+      client_socket_fd = wq_pop(&run->wq);
+    }
+    __atomic_add_fetch(&run->popped, 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+static void *test_interrupter(void *arg) {
+  test_run_t *run = arg;
+  while (!run->stale && !__atomic_load_n(&run->done, __ATOMIC_ACQUIRE)) {
+    wq_interrupt(&run->wq);
+    sched_yield();
+  }
+  return NULL;
+}
+
+/* Runs one round and returns 0 if every item was popped, or 1 if popping
+ * stalled. A stalled round leaves its threads blocked; the caller exits. */
+static int test_round(char *name, int timeouts, int stale) {
+  static test_run_t run;
+  memset(&run, 0, sizeof(run));
+  wq_init(&run.wq);
+  run.timeouts = timeouts;
+  run.stale = stale;
+  if (stale) run.wq.not_empty.pending = 1;
+
+  pthread_t producer, consumer, interrupter;
+  pthread_create(&consumer, NULL, test_consumer, &run);
+  pthread_create(&interrupter, NULL, test_interrupter, &run);
+  pthread_create(&producer, NULL, test_producer, &run);
+
+  long last = -1;
+  int stalled = 0;
+  while (stalled < TEST_STALL_SECONDS) {
+    sleep(1);
+    long popped = __atomic_load_n(&run.popped, __ATOMIC_ACQUIRE);
+    if (popped == test_items) break;
+    stalled = popped == last ? stalled + 1 : 0;
+    last = popped;
+  }
+  if (stalled == TEST_STALL_SECONDS) {
+    printf("%s: FAIL, stalled with %ld of %ld items popped and %zu queued\n",
+        name, last, test_items, wq_size(&run.wq));
+    return 1;
+  }
+
+  __atomic_store_n(&run.done, 1, __ATOMIC_RELEASE);
+  pthread_join(producer, NULL);
+  pthread_join(consumer, NULL);
+  pthread_join(interrupter, NULL);
+  free(run.wq.cells);
+  printf("%s: ok, %ld items\n", name, test_items);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && (test_items = atol(argv[1])) < 1) {
+    fprintf(stderr, "Usage: ./wqtest [ITEMS]\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (test_round("wq_pop", 0, 0) || test_round("wq_pop_timeout", 1, 0)
+      || test_round("stale pending wakeup", 0, 1)) {
+    exit(EXIT_FAILURE);
+  }
+  return 0;
+}